@@ -0,0 +1,82 @@
+#include "scene.h"
+
+#include <map>
+#include <vector>
+#define _USE_MATH_DEFINES
+#include <math.h>
+
+using namespace std;
+
+// Keyframe tracks set absolute values, so result depends only on time and not on
+// previously evaluated frames. Script can still change scene after tracks are applied
+
+bool Scene::hasAnimation() const
+{
+	return !animation.empty();
+}
+
+void Scene::animate(float time)
+{
+	// Components of object transform, identity unless some track changes them
+	struct Pose
+	{
+		Vector3f translate;
+		Vector3f rotate;
+		Vector3f scale{ 1.f, 1.f, 1.f };
+	};
+	map <size_t, Pose> poses;
+
+	for (const Animation::Channel &channel : animation.channels)
+	{
+		Vector3f value = channel.track.evaluate(time);
+		switch (channel.target)
+		{
+		case Animation::Target::Object:
+		{
+			if (channel.index >= objects.size() || channel.index >= animation.baseTransforms.size())
+				break;
+
+			Pose &pose = poses[channel.index];
+			if (channel.property == Animation::Property::Translate)
+				pose.translate = value;
+			else if (channel.property == Animation::Property::Rotate)
+				pose.rotate = value * (static_cast <float>(M_PI) / 180.f);
+			else if (channel.property == Animation::Property::Scale)
+				pose.scale = value;
+			break;
+		}
+		case Animation::Target::Camera:
+			if (channel.property == Animation::Property::Position)
+				camera.setPosition(value);
+			else if (channel.property == Animation::Property::Lookat)
+				camera.setLookat(value);
+			else if (channel.property == Animation::Property::Up)
+				camera.setUp(value);
+			break;
+		case Animation::Target::Light:
+		{
+			if (channel.index >= lights.size())
+				break;
+
+			Light *light = GET_POINTER(lights[channel.index]);
+			if (channel.property == Animation::Property::Color)
+				light->color = Color(value[0], value[1], value[2]);
+			else if (channel.property == Animation::Property::Position)
+				light->setPosition(value);
+			else if (channel.property == Animation::Property::Direction)
+				light->setDirection(value);
+			break;
+		}
+		}
+	}
+
+	// Object is scaled and rotated around its own origin, then placed by transform
+	// from scene file and moved in world space
+	for (const auto &[index, pose] : poses)
+	{
+		Matrix4f rotation = Matrix4f::fromRotationZ(pose.rotate[2]) * Matrix4f::fromRotationY(pose.rotate[1]) *
+			Matrix4f::fromRotationX(pose.rotate[0]);
+		objects[index]->setTransform(Matrix4f::fromTranslation(pose.translate) * animation.baseTransforms[index] *
+			rotation * Matrix4f::fromScaling(pose.scale));
+	}
+}
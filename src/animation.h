@@ -0,0 +1,197 @@
+#ifndef RAYTRACER_ANIMATION_H_
+#define RAYTRACER_ANIMATION_H_
+
+#include "vector.h"
+#include "matrix.h"
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+// Values of some parameter at given moments. Value between keys is interpolated,
+// before first and after last key it is equal to value of that key
+class Track
+{
+public:
+	enum class Interpolation {
+		Step,
+		Linear,
+		Spline		// Catmull-Rom spline through all keys
+	};
+
+	struct Key
+	{
+		float time;
+		Vector3f value;
+	};
+
+private:
+	std::vector <Key> keys;
+	Interpolation interpolation;
+
+	// Slope of spline in key n, estimated from neighbour keys
+	Vector3f getTangent(size_t n) const
+	{
+		size_t prev = n > 0 ? n - 1 : n;
+		size_t next = std::min(n + 1, keys.size() - 1);
+		float dt = keys[next].time - keys[prev].time;
+		if (dt <= 0.f)
+			return Vector3f();
+		return (keys[next].value - keys[prev].value) * (1.f / dt);
+	}
+
+public:
+	Track(Interpolation interpolation = Interpolation::Linear) :
+		interpolation(interpolation)
+	{
+
+	}
+
+	static bool parseInterpolation(const std::string &name, Interpolation &res)
+	{
+		if (name == "step")
+			res = Interpolation::Step;
+		else if (name == "linear" || name.empty())
+			res = Interpolation::Linear;
+		else if (name == "spline")
+			res = Interpolation::Spline;
+		else
+			return false;
+		return true;
+	}
+
+	void addKey(float time, const Vector3f &value)
+	{
+		// Keys are kept sorted, key with the same time goes after existing ones
+		auto it = std::upper_bound(keys.begin(), keys.end(), time, [](float t, const Key &key)
+		{
+			return t < key.time;
+		});
+		keys.insert(it, { time, value });
+	}
+
+	bool empty() const
+	{
+		return keys.empty();
+	}
+
+	// Value at given time, does not depend on previously evaluated times
+	Vector3f evaluate(float time) const
+	{
+		if (keys.empty())
+			return Vector3f();
+		if (time <= keys.front().time)
+			return keys.front().value;
+		if (time >= keys.back().time)
+			return keys.back().value;
+
+		// Segment between keys n - 1 and n contains time, its length is not zero
+		size_t n = std::upper_bound(keys.begin(), keys.end(), time, [](float t, const Key &key)
+		{
+			return t < key.time;
+		}) - keys.begin();
+		const Key &a = keys[n - 1];
+		const Key &b = keys[n];
+		float span = b.time - a.time;
+		float t = (time - a.time) / span;
+
+		if (interpolation == Interpolation::Step)
+			return a.value;
+		if (interpolation == Interpolation::Linear)
+			return a.value + (b.value - a.value) * t;
+
+		// Cubic Hermite segment, tangents are scaled to length of segment
+		Vector3f m0 = getTangent(n - 1) * span;
+		Vector3f m1 = getTangent(n) * span;
+		float t2 = t * t;
+		float t3 = t2 * t;
+		return a.value * (2.f * t3 - 3.f * t2 + 1.f) + m0 * (t3 - 2.f * t2 + t) +
+			b.value * (3.f * t2 - 2.f * t3) + m1 * (t3 - t2);
+	}
+};
+
+// Keyframe tracks from scene file. State of scene is a function of time only,
+// so every frame can be computed without computing previous ones
+struct Animation
+{
+	enum class Target {
+		Object,
+		Camera,
+		Light
+	};
+
+	enum class Property {
+		Translate,	// Objects, added to transform from scene file in world space
+		Rotate,		// Objects, angles in degrees around x, y and z axes of object
+		Scale,		// Objects, applied before transform from scene file
+		Position,	// Camera, point and spot lights
+		Lookat,		// Camera
+		Up,			// Camera
+		Direction,	// Parallel and spot lights
+		Color		// Lights
+	};
+
+	struct Channel
+	{
+		Target target;
+		size_t index;	// Position of object or light in scene file
+		Property property;
+		Track track;
+	};
+
+	std::vector <Channel> channels;
+	// Transforms of objects from scene file, tracks are applied on top of them
+	std::vector <Matrix4f> baseTransforms;
+
+	static bool parseTarget(const std::string &name, Target &res)
+	{
+		if (name == "object")
+			res = Target::Object;
+		else if (name == "camera")
+			res = Target::Camera;
+		else if (name == "light")
+			res = Target::Light;
+		else
+			return false;
+		return true;
+	}
+
+	static bool parseProperty(const std::string &name, Target target, Property &res)
+	{
+		static const std::pair <const char *, Property> names[] = {
+			{ "translate", Property::Translate },
+			{ "rotate", Property::Rotate },
+			{ "scale", Property::Scale },
+			{ "position", Property::Position },
+			{ "lookat", Property::Lookat },
+			{ "up", Property::Up },
+			{ "direction", Property::Direction },
+			{ "color", Property::Color }
+		};
+
+		for (const auto &[n, prop] : names)
+		{
+			if (name != n)
+				continue;
+
+			res = prop;
+			switch (target)
+			{
+			case Target::Object:
+				return prop == Property::Translate || prop == Property::Rotate || prop == Property::Scale;
+			case Target::Camera:
+				return prop == Property::Position || prop == Property::Lookat || prop == Property::Up;
+			case Target::Light:
+				return prop == Property::Position || prop == Property::Direction || prop == Property::Color;
+			}
+		}
+		return false;
+	}
+
+	bool empty() const
+	{
+		return channels.empty();
+	}
+};
+
+#endif  // RAYTRACER_ANIMATION_H_
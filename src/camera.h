@@ -167,10 +167,45 @@ public:
 		return aperture;
 	}
 
+	// Map sample from unit square to point on lens (in camera space).
+	// Concentric mapping (Shirley, Chiu) keeps stratification of samples
+	Vector3f getLensPoint(const Vector2f &u) const
+	{
+		float a = 2.f * u[0] - 1.f;
+		float b = 2.f * u[1] - 1.f;
+		if (a == 0.f && b == 0.f)
+			return { 0.f, 0.f, 0.f };
+
+		float rho, theta;
+		if (std::fabs(a) > std::fabs(b))
+		{
+			rho = a;
+			theta = static_cast <float>(M_PI) / 4.f * (b / a);
+		}
+		else
+		{
+			rho = b;
+			theta = static_cast <float>(M_PI) / 2.f - static_cast <float>(M_PI) / 4.f * (a / b);
+		}
+		return { aperture * rho * std::cos(theta), aperture * rho * std::sin(theta), 0.f };
+	}
+
 	void setAperture(float apert)
 	{
 		aperture = apert;
 	}
+
+	// Cameras that generate the same rays
+	bool operator ==(const Camera &rhs) const
+	{
+		return pos == rhs.pos && lookat == rhs.lookat && up == rhs.up && fov == rhs.fov &&
+			resolution == rhs.resolution && bounces == rhs.bounces && aperture == rhs.aperture;
+	}
+
+	bool operator !=(const Camera &rhs) const
+	{
+		return !((*this) == rhs);
+	}
 };
 
 #endif  // RAYTRACER_CAMERA_H_
\ No newline at end of file
@@ -0,0 +1,288 @@
+#include "float_image.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <vector>
+
+using namespace std;
+
+static const pair <const char *, ImageFormat> FormatNames[] = {
+	{ "png", ImageFormat::Png },
+	{ "pfm", ImageFormat::Pfm },
+	{ "exr", ImageFormat::Exr }
+};
+
+bool parseImageFormat(const string &name, ImageFormat &format)
+{
+	for (const auto &[n, f] : FormatNames)
+	{
+		if (name == n)
+		{
+			format = f;
+			return true;
+		}
+	}
+	return false;
+}
+
+ImageFormat getImageFormat(const string &filename)
+{
+	size_t pos = filename.rfind('.');
+	ImageFormat res = ImageFormat::Png;
+	if (pos == string::npos)
+		return res;
+
+	string ext = filename.substr(pos + 1);
+	transform(ext.begin(), ext.end(), ext.begin(), [](unsigned char c) { return static_cast <char>(tolower(c)); });
+	parseImageFormat(ext, res);
+	return res;
+}
+
+string replaceExtension(const string &filename, ImageFormat format)
+{
+	size_t pos = filename.rfind('.');
+	size_t slash = filename.find_last_of("/\\");
+	string res = (pos == string::npos || (slash != string::npos && pos < slash)) ? filename : filename.substr(0, pos);
+	for (const auto &[n, f] : FormatNames)
+	{
+		if (f == format)
+			return res + "." + n;
+	}
+	return filename;
+}
+
+static bool isLittleEndian()
+{
+	const uint16_t one = 1;
+	return *reinterpret_cast <const uint8_t *>(&one) == 1;
+}
+
+// Values of row in RGB order. Rows of RGB framebuffer are used directly
+static const float *getRgbRow(const Framebuffer &data, size_t y, vector <float> &buffer)
+{
+	if (data.getLayout() == Framebuffer::Layout::RGB)
+		return data.row(y);
+
+	buffer.resize(data.width() * 3);
+	for (size_t x = 0; x < data.width(); ++x)
+	{
+		Color c = data.get(x, y);
+		copy(&c[0], &c[0] + 3, &buffer[x * 3]);
+	}
+	return buffer.data();
+}
+
+static string getPfmHeader(size_t width, size_t height)
+{
+	// Negative scale means little-endian floats
+	return "PF\n" + to_string(width) + ' ' + to_string(height) + '\n' + (isLittleEndian() ? "-1.0" : "1.0") + '\n';
+}
+
+bool writePfm(const Framebuffer &data, const string &filename)
+{
+	ofstream file(filename, ios::binary);
+	if (!file)
+		return false;
+
+	file << getPfmHeader(data.width(), data.height());
+	vector <float> buffer;
+	for (size_t y = data.height(); y-- > 0; )
+		file.write(reinterpret_cast <const char *>(getRgbRow(data, y, buffer)), data.width() * 3 * sizeof(float));
+	return bool(file);
+}
+
+// OpenEXR stores all numbers as little-endian
+static void putInt(vector <char> &out, uint64_t v, size_t bytes)
+{
+	for (size_t i = 0; i < bytes; ++i)
+		out.push_back(static_cast <char>(v >> (8 * i)));
+}
+
+static void putFloat(vector <char> &out, float v)
+{
+	uint32_t bits;
+	memcpy(&bits, &v, sizeof(bits));
+	putInt(out, bits, 4);
+}
+
+static void putAttribute(vector <char> &out, const string &name, const string &type, const vector <char> &value)
+{
+	out.insert(out.end(), name.begin(), name.end());
+	out.push_back(0);
+	out.insert(out.end(), type.begin(), type.end());
+	out.push_back(0);
+	putInt(out, value.size(), 4);
+	out.insert(out.end(), value.begin(), value.end());
+}
+
+// Header of scanline file together with table of line offsets
+static vector <char> getExrHeader(size_t width, size_t height)
+{
+	vector <char> header = { 0x76, 0x2f, 0x31, 0x01, 2, 0, 0, 0 };	// Magic number, version 2, scanline file
+
+	// Channels are sorted by name: B, G, R. Every channel is 32 bit float without subsampling
+	vector <char> channels;
+	for (const char *name : { "B", "G", "R" })
+	{
+		channels.push_back(name[0]);
+		channels.push_back(0);
+		putInt(channels, 2, 4);		// FLOAT
+		putInt(channels, 0, 4);		// pLinear and reserved bytes
+		putInt(channels, 1, 4);
+		putInt(channels, 1, 4);
+	}
+	channels.push_back(0);
+	putAttribute(header, "channels", "chlist", channels);
+	putAttribute(header, "compression", "compression", { 0 });
+
+	vector <char> window;
+	putInt(window, 0, 4);
+	putInt(window, 0, 4);
+	putInt(window, width - 1, 4);
+	putInt(window, height - 1, 4);
+	putAttribute(header, "dataWindow", "box2i", window);
+	putAttribute(header, "displayWindow", "box2i", window);
+	putAttribute(header, "lineOrder", "lineOrder", { 0 });	// Increasing y, rows from the top
+
+	vector <char> value;
+	putFloat(value, 1.f);
+	putAttribute(header, "pixelAspectRatio", "float", value);
+	putAttribute(header, "screenWindowWidth", "float", value);
+	value.clear();
+	putFloat(value, 0.f);
+	putFloat(value, 0.f);
+	putAttribute(header, "screenWindowCenter", "v2f", value);
+	header.push_back(0);
+
+	// Every scanline is block of its own: y, size of data and channels one after another
+	size_t lineSize = width * 3 * sizeof(float);
+	size_t firstLine = header.size() + height * sizeof(uint64_t);
+	for (size_t y = 0; y < height; ++y)
+		putInt(header, firstLine + y * (8 + lineSize), 8);
+	return header;
+}
+
+// Scanline block of row y of data, which is written as row line of file
+static void getExrLine(const Framebuffer &data, size_t y, size_t line, vector <float> &buffer, vector <char> &out)
+{
+	size_t width = data.width();
+	out.clear();
+	putInt(out, line, 4);
+	putInt(out, width * 3 * sizeof(float), 4);
+	out.resize(8 + width * 3 * sizeof(float));
+	float *planes = reinterpret_cast <float *>(out.data() + 8);
+
+	if (data.getLayout() == Framebuffer::Layout::Planar)
+	{
+		// Rows of planes are already in the order of file
+		for (size_t c = 0; c < 3; ++c)
+			memcpy(planes + (2 - c) * width, data.data() + (c * data.height() + y) * width, width * sizeof(float));
+		return;
+	}
+
+	const float *row = getRgbRow(data, y, buffer);
+	for (size_t x = 0; x < width; ++x)
+	{
+		for (size_t c = 0; c < 3; ++c)
+			planes[(2 - c) * width + x] = row[x * 3 + c];
+	}
+}
+
+bool writeExr(const Framebuffer &data, const string &filename)
+{
+	ofstream file(filename, ios::binary);
+	if (!file || data.empty() || !isLittleEndian())
+		return false;
+
+	vector <char> header = getExrHeader(data.width(), data.height());
+	file.write(header.data(), header.size());
+
+	vector <float> buffer;
+	vector <char> line;
+	for (size_t y = 0; y < data.height(); ++y)
+	{
+		getExrLine(data, y, y, buffer, line);
+		file.write(line.data(), line.size());
+	}
+	return bool(file);
+}
+
+bool FloatImageFile::open(const string &filename, ImageFormat type, size_t w, size_t h, bool keep)
+{
+	close();
+	if (type == ImageFormat::Png || w == 0 || h == 0 || (type == ImageFormat::Exr && !isLittleEndian()))
+		return false;
+
+	vector <char> header;
+	if (type == ImageFormat::Pfm)
+	{
+		string pfm = getPfmHeader(w, h);
+		header.assign(pfm.begin(), pfm.end());
+	}
+	else
+		header = getExrHeader(w, h);
+
+	size_t rowSize = w * 3 * sizeof(float) + (type == ImageFormat::Exr ? 8 : 0);
+	size_t size = header.size() + h * rowSize;
+	if (!file.open(filename, size, keep))
+		return false;
+
+	// File of the same size but with other header is not continued
+	kept = file.wasKept() && memcmp(header.data(), file.data(), header.size()) == 0;
+	if (file.wasKept() && !kept && !file.open(filename, size, false))
+		return false;
+	if (!kept)
+		copy(header.begin(), header.end(), file.data());
+
+	format = type;
+	width = w;
+	height = h;
+	headerSize = header.size();
+	return true;
+}
+
+size_t FloatImageFile::getRowSize() const
+{
+	return width * 3 * sizeof(float) + (format == ImageFormat::Exr ? 8 : 0);
+}
+
+size_t FloatImageFile::getRowOffset(size_t y) const
+{
+	// Rows of PFM go from the bottom
+	return headerSize + (format == ImageFormat::Pfm ? height - 1 - y : y) * getRowSize();
+}
+
+void FloatImageFile::writeRows(size_t y, const Framebuffer &band)
+{
+	vector <float> buffer;
+	vector <char> line;
+	for (size_t i = 0; i < band.height() && y + i < height; ++i)
+	{
+		unsigned char *out = file.data() + getRowOffset(y + i);
+		if (format == ImageFormat::Pfm)
+			memcpy(out, getRgbRow(band, i, buffer), getRowSize());
+		else
+		{
+			getExrLine(band, i, y + i, buffer, line);
+			copy(line.begin(), line.end(), out);
+		}
+	}
+}
+
+bool FloatImageFile::flush(size_t y, size_t rows)
+{
+	if (rows == 0)
+		return true;
+	size_t first = format == ImageFormat::Pfm ? y + rows - 1 : y;
+	return file.flush(getRowOffset(first), rows * getRowSize());
+}
+
+void FloatImageFile::close()
+{
+	file.close();
+	width = height = headerSize = 0;
+	kept = false;
+}
@@ -0,0 +1,58 @@
+#ifndef RAYTRACER_FLOAT_IMAGE_H_
+#define RAYTRACER_FLOAT_IMAGE_H_
+
+#include "framebuffer.h"
+#include "mapped_file.h"
+
+#include <string>
+
+// Formats of saved images. Float formats keep values outside of [0, 1], so image
+// can be used at another exposure without rendering it again
+enum class ImageFormat
+{
+	Png,
+	Pfm,	// Portable float map, rows from the bottom
+	Exr		// OpenEXR, uncompressed 32 bit float scanlines
+};
+
+bool parseImageFormat(const std::string &name, ImageFormat &format);
+
+// Format given by extension of file, png if extension is not known
+ImageFormat getImageFormat(const std::string &filename);
+
+// Filename with extension of format
+std::string replaceExtension(const std::string &filename, ImageFormat format);
+
+// Floats are written as they are, without clamping
+bool writePfm(const Framebuffer &data, const std::string &filename);
+bool writeExr(const Framebuffer &data, const std::string &filename);
+
+// PFM or EXR file of known size whose rows are written in any order as they are
+// rendered. File is mapped to memory, so only rows that are written take memory
+class FloatImageFile
+{
+	MappedFile file;
+	ImageFormat format = ImageFormat::Pfm;
+	size_t width = 0, height = 0;
+	size_t headerSize = 0;
+	bool kept = false;
+
+	size_t getRowSize() const;
+	size_t getRowOffset(size_t y) const;
+
+public:
+	// If keep is set, rows of existing file of the same size and format are kept
+	bool open(const std::string &filename, ImageFormat format, size_t width, size_t height, bool keep);
+	bool wasKept() const
+	{
+		return kept;
+	}
+
+	// Rows of band are written starting at row y from the top
+	void writeRows(size_t y, const Framebuffer &band);
+	// Rows [y, y + rows) are written to disk, so they are not lost if process is killed
+	bool flush(size_t y, size_t rows);
+	void close();
+};
+
+#endif  // RAYTRACER_FLOAT_IMAGE_H_
@@ -0,0 +1,232 @@
+#ifndef RAYTRACER_FRAMEBUFFER_H_
+#define RAYTRACER_FRAMEBUFFER_H_
+
+#include "color.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#ifdef _MSC_VER
+#include <malloc.h>
+#endif
+
+// Float image in one aligned allocation, rows go from the top. Pixels are stored
+// interleaved (RGB or RGBA) or planar (all red values, then green, then blue), so
+// encoders can read rows directly without transposing image
+class Framebuffer
+{
+public:
+	enum class Layout {
+		RGB,
+		RGBA,	// Alpha is 1 for every written pixel
+		Planar
+	};
+
+	static constexpr size_t Alignment = 64;
+
+private:
+	struct Deleter
+	{
+		void operator ()(float *p) const
+		{
+#ifdef _MSC_VER
+			_aligned_free(p);
+#else
+			std::free(p);
+#endif
+		}
+	};
+
+	size_t w = 0;
+	size_t h = 0;
+	Layout layout = Layout::RGB;
+	std::unique_ptr <float[], Deleter> pixels;
+
+	static float *allocate(size_t count)
+	{
+		// Size of aligned allocation has to be multiple of alignment
+		size_t bytes = (count * sizeof(float) + Alignment - 1) / Alignment * Alignment;
+#ifdef _MSC_VER
+		void *p = _aligned_malloc(bytes, Alignment);
+#else
+		void *p = std::aligned_alloc(Alignment, bytes);
+#endif
+		if (p == nullptr)
+			throw std::bad_alloc();
+		std::memset(p, 0, bytes);
+		return static_cast <float *>(p);
+	}
+
+	// Position of first channel of pixel and distance between its channels
+	size_t offset(size_t x, size_t y) const
+	{
+		return layout == Layout::Planar ? y * w + x : (y * w + x) * channels();
+	}
+
+	size_t stride() const
+	{
+		return layout == Layout::Planar ? w * h : 1;
+	}
+
+public:
+	// Part of framebuffer. Tiles that do not overlap can be written by different threads
+	class Tile
+	{
+		Framebuffer *fb;
+		size_t x0, y0, w, h;
+
+	public:
+		Tile(Framebuffer &fb, size_t x0, size_t y0, size_t w, size_t h) :
+			fb(&fb), x0(x0), y0(y0), w(w), h(h)
+		{
+
+		}
+
+		size_t width() const
+		{
+			return w;
+		}
+
+		size_t height() const
+		{
+			return h;
+		}
+
+		// Coordinates are relative to top left corner of tile
+		Color get(size_t x, size_t y) const
+		{
+			return fb->get(x0 + x, y0 + y);
+		}
+
+		void set(size_t x, size_t y, const Color &c)
+		{
+			fb->set(x0 + x, y0 + y, c);
+		}
+	};
+
+	Framebuffer() {}
+
+	// Image is filled with black
+	Framebuffer(size_t width, size_t height, Layout layout = Layout::RGB) :
+		w(width), h(height), layout(layout)
+	{
+		if (size() != 0)
+			pixels.reset(allocate(size()));
+	}
+
+	// Frames are large, so they are only moved. Copy has to be made with clone()
+	Framebuffer(const Framebuffer &) = delete;
+	Framebuffer &operator =(const Framebuffer &) = delete;
+	Framebuffer(Framebuffer &&other) noexcept :
+		w(other.w), h(other.h), layout(other.layout), pixels(std::move(other.pixels))
+	{
+		other.w = other.h = 0;
+	}
+
+	Framebuffer &operator =(Framebuffer &&other) noexcept
+	{
+		w = other.w;
+		h = other.h;
+		layout = other.layout;
+		pixels = std::move(other.pixels);
+		other.w = other.h = 0;
+		return *this;
+	}
+
+	Framebuffer clone() const
+	{
+		Framebuffer res(w, h, layout);
+		if (size() != 0)
+			std::memcpy(res.pixels.get(), pixels.get(), size() * sizeof(float));
+		return res;
+	}
+
+	size_t width() const
+	{
+		return w;
+	}
+
+	size_t height() const
+	{
+		return h;
+	}
+
+	bool empty() const
+	{
+		return w == 0 || h == 0;
+	}
+
+	Layout getLayout() const
+	{
+		return layout;
+	}
+
+	size_t channels() const
+	{
+		return layout == Layout::RGBA ? 4 : 3;
+	}
+
+	// Amount of floats in framebuffer
+	size_t size() const
+	{
+		return w * h * channels();
+	}
+
+	Color get(size_t x, size_t y) const
+	{
+		const float *p = &pixels[offset(x, y)];
+		size_t s = stride();
+		return Color(p[0], p[s], p[2 * s]);
+	}
+
+	void set(size_t x, size_t y, const Color &c)
+	{
+		float *p = &pixels[offset(x, y)];
+		size_t s = stride();
+		p[0] = c[0];
+		p[s] = c[1];
+		p[2 * s] = c[2];
+		if (layout == Layout::RGBA)
+			p[3] = 1.f;
+	}
+
+	Tile tile(size_t x0, size_t y0, size_t width, size_t height)
+	{
+		return Tile(*this, x0, y0, width, height);
+	}
+
+	// Copy rectangle of another framebuffer of the same size and layout to the same place
+	void copyRect(const Framebuffer &from, size_t x0, size_t y0, size_t x1, size_t y1)
+	{
+		size_t planes = layout == Layout::Planar ? 3 : 1;
+		size_t perPixel = layout == Layout::Planar ? 1 : channels();
+		for (size_t c = 0; c < planes; ++c)
+		{
+			for (size_t y = y0; y < y1; ++y)
+			{
+				size_t begin = c * w * h + offset(x0, y);
+				std::copy(&from.pixels[begin], &from.pixels[begin] + (x1 - x0) * perPixel, &pixels[begin]);
+			}
+		}
+	}
+
+	// Raw data for encoders, layout describes order of values
+	const float *data() const
+	{
+		return pixels.get();
+	}
+
+	float *data()
+	{
+		return pixels.get();
+	}
+
+	// First value of row for interleaved layouts
+	const float *row(size_t y) const
+	{
+		return &pixels[y * w * channels()];
+	}
+};
+
+#endif  // RAYTRACER_FRAMEBUFFER_H_
@@ -0,0 +1,203 @@
+#include "scene.h"
+
+#include <vector>
+#include <algorithm>
+#include <future>
+
+using namespace std;
+
+// Incremental renderer reuses tiles of previous frame. While tile is traced, space
+// visited by its rays is recorded. Tile has to be traced again only if some object that
+// changed (in old or new state) is inside of that space, or if any light changed
+
+bool Scene::sameView(const Scene &other) const
+{
+	return camera == other.camera && background == other.background && properties == other.properties &&
+		settings == other.settings && getRegion().x0 == other.getRegion().x0 && getRegion().y0 == other.getRegion().y0 &&
+		getRegion().x1 == other.getRegion().x1 && getRegion().y1 == other.getRegion().y1 &&
+		minThroughput == other.minThroughput && rouletteThreshold == other.rouletteThreshold &&
+		objects.size() == other.objects.size() && lights.size() == other.lights.size();
+}
+
+Region Scene::getScreenBounds(const Bounds &bounds) const
+{
+	size_t width = camera.getResolution().first;
+	size_t height = camera.getResolution().second;
+	Region whole;
+	whole.x1 = width;
+	whole.y1 = height;
+
+	// Rays through lens do not start in camera position
+	if (hasProperty(DOF))
+		return whole;
+
+	float ratio = static_cast <float>(width) / height;
+	float xm = tan(camera.getFOV());
+	float ym = tan(camera.getFOV() / ratio);
+	Matrix4f toCamera = camera.getView().transpose();
+
+	float lo[2] = { numeric_limits <float>::max(), numeric_limits <float>::max() };
+	float hi[2] = { -numeric_limits <float>::max(), -numeric_limits <float>::max() };
+	for (size_t i = 0; i < 8; ++i)
+	{
+		Vector3f corner((i & 1) ? bounds.max[0] : bounds.min[0], (i & 2) ? bounds.max[1] : bounds.min[1],
+			(i & 4) ? bounds.max[2] : bounds.min[2]);
+		Vector3f c = toCamera * (corner - camera.getPosition());
+		// Box reaches behind camera
+		if (c[2] > -1e-4f)
+			return whole;
+
+		// Position in pixels, same mapping as used for generation of rays
+		float px = (c[0] / -c[2] / xm + 1.f) * 0.5f * width;
+		float py = (c[1] / -c[2] / ym + 1.f) * 0.5f * height;
+		lo[0] = min(lo[0], px);
+		hi[0] = max(hi[0], px);
+		lo[1] = min(lo[1], py);
+		hi[1] = max(hi[1], py);
+	}
+
+	// Expand by one pixel to cover jitter of samples, rows are counted from the top
+	auto clampTo = [](float v, size_t size)
+	{
+		return static_cast <size_t>(min(max(v, 0.f), static_cast <float>(size)));
+	};
+	Region res;
+	res.x0 = clampTo(floor(lo[0]) - 1.f, width);
+	res.x1 = clampTo(ceil(hi[0]) + 2.f, width);
+	res.y0 = height - clampTo(ceil(hi[1]) + 2.f, height);
+	res.y1 = height - clampTo(floor(lo[1]) - 1.f, height);
+	return res;
+}
+
+Framebuffer Scene::renderIncremental(const FrameHistory &previous, vector <TileInfluence> &tiles)
+{
+	const size_t tileSize = FrameHistory::TileSize;
+	size_t width = camera.getResolution().first;
+	size_t height = camera.getResolution().second;
+	Region reg = getRegion();
+	Framebuffer data(reg.width(), reg.height());
+
+	for (ObjectRef &obj : objects)
+		obj->updateInverse();
+	// Tiles of previous frame are reused, so noise must not change between frames
+	updateFrameKey(false);
+	tracedRays = 0;
+	prunedRays = 0;
+
+	size_t tilesX = (reg.width() + tileSize - 1) / tileSize;
+	size_t tilesY = (reg.height() + tileSize - 1) / tileSize;
+	tiles.assign(tilesX * tilesY, TileInfluence());
+
+	// Find what changed since previous frame
+	const Scene *prev = previous.scene.get();
+	bool full = prev == nullptr || previous.image == nullptr || previous.tiles.size() != tiles.size() || !sameView(*prev);
+	bool lightsChanged = false;
+	vector <Bounds> changed;
+	vector <Region> changedOnScreen;
+	if (!full)
+	{
+		for (size_t i = 0; i < lights.size(); ++i)
+			lightsChanged = lightsChanged || !lights[i]->sameAs(*GET_POINTER(prev->lights[i]));
+
+		for (size_t i = 0; i < objects.size(); ++i)
+		{
+			if (objects[i]->sameAs(*GET_POINTER(prev->objects[i])))
+				continue;
+
+			Bounds b;
+			auto [oldMin, oldMax] = prev->objects[i]->getBounds();
+			auto [newMin, newMax] = objects[i]->getBounds();
+			b.expand(oldMin);
+			b.expand(oldMax);
+			b.expand(newMin);
+			b.expand(newMax);
+			changed.push_back(b);
+			changedOnScreen.push_back(getScreenBounds(b));
+		}
+	}
+
+	// Shadow rays towards lights at infinite distance have the same direction everywhere
+	vector <Vector3f> lightDirs(lights.size());
+	for (size_t l = 0; l < lights.size(); ++l)
+		lightDirs[l] = lights[l]->getDirection(Vector3f()).first;
+
+	auto isDirty = [&](size_t tx, size_t ty)
+	{
+		if (full)
+			return true;
+
+		const TileInfluence &old = previous.tiles[ty * tilesX + tx];
+		if (lightsChanged && old.lit)
+			return true;
+
+		size_t x0 = reg.x0 + tx * tileSize, y0 = reg.y0 + ty * tileSize;
+		size_t x1 = min(x0 + tileSize, reg.x1), y1 = min(y0 + tileSize, reg.y1);
+		for (size_t i = 0; i < changed.size(); ++i)
+		{
+			const Region &screen = changedOnScreen[i];
+			if (screen.x0 < x1 && x0 < screen.x1 && screen.y0 < y1 && y0 < screen.y1)
+				return true;
+			if (old.unbounded || old.segments.intersects(changed[i]))
+				return true;
+			for (size_t l = 0; l < old.sweeps.size(); ++l)
+			{
+				if (old.sweeps[l].sweepIntersects(lightDirs[l], changed[i]))
+					return true;
+			}
+		}
+		return false;
+	};
+
+	float ratio = static_cast <float>(width) / height;
+	float xm = tan(camera.getFOV());
+	float ym = tan(camera.getFOV() / ratio);
+	float dx = 2.f * xm / width;
+	float dy = 2.f * ym / height;
+	size_t sub = hasProperty(Supersampling) ? settings.at(Scene::Supersampling) : 0;
+
+	vector <future <void>> fut;
+	size_t reused = 0;
+	for (size_t ty = 0; ty < tilesY; ++ty)
+	{
+		for (size_t tx = 0; tx < tilesX; ++tx)
+		{
+			size_t x0 = tx * tileSize, y0 = ty * tileSize;
+			size_t x1 = min(x0 + tileSize, reg.width()), y1 = min(y0 + tileSize, reg.height());
+			TileInfluence &tile = tiles[ty * tilesX + tx];
+
+			if (!isDirty(tx, ty))
+			{
+				data.copyRect(*previous.image, x0, y0, x1, y1);
+				tile = previous.tiles[ty * tilesX + tx];
+				++reused;
+				continue;
+			}
+
+			fut.push_back(pool->push([&, x0, y0, x1, y1, out = data.tile(x0, y0, x1 - x0, y1 - y0)](int) mutable
+			{
+				tile.sweeps.resize(lights.size());
+				RenderStats stats;
+				for (size_t x = x0; x < x1; ++x)
+				{
+					size_t px = reg.x0 + x;
+					float xf = (2.f * static_cast <float>(px) / width - 1.f) * xm;
+					for (size_t y = y0; y < y1; ++y)
+					{
+						// Image rows are counted from the top, rays from the bottom
+						size_t py = height - 1 - (reg.y0 + y);
+						float yf = (2.f * static_cast <float>(py) / height - 1.f) * ym;
+						out.set(x - x0, y - y0, getPixel(px, py, xf, yf, dx, dy, sub, stats, &tile));
+					}
+				}
+				addStats(stats);
+			}));
+		}
+	}
+
+	for (auto &f : fut)
+		f.get();
+
+	lastTiles = tiles.size();
+	lastReused = reused;
+	return data;
+}
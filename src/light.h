@@ -40,6 +40,19 @@ public:
 	// Get direction and distance to light source
 	virtual std::pair <Vector3f, float> getDirection(const Vector3f &inter) const = 0;
 
+	// Copy of light that can be changed independently
+	virtual Light * clone() const = 0;
+
+	// Lights that have no position or direction ignore these
+	virtual void setPosition(const Vector3f &) {}
+	virtual void setDirection(const Vector3f &) {}
+
+	// Check if light gives the same illumination as other one
+	virtual bool sameAs(const Light &other) const
+	{
+		return directional == other.directional && on == other.on && color == other.color;
+	}
+
 	bool isDirectional()
 	{
 		return directional;
@@ -67,13 +80,23 @@ struct AmbientLight : public Light
 
 	virtual Color getColor(const Intersection &inter, const Vector3f &camera, const Material *mat) const
 	{
-		return mat->getColor(inter.tex) * color * mat->ka;
+		return mat->getColor(inter.tex, inter.footprint) * color * mat->ka;
 	}
 
 	virtual std::pair <Vector3f, float> getDirection(const Vector3f &inter) const
 	{
 		return { Vector3f(), 0.f };
 	}
+
+	virtual Light * clone() const
+	{
+		return new AmbientLight(*this);
+	}
+
+	virtual bool sameAs(const Light &other) const
+	{
+		return dynamic_cast <const AmbientLight *>(&other) != nullptr && Light::sameAs(other);
+	}
 };
 
 struct ParallelLight : public Light
@@ -93,7 +116,7 @@ struct ParallelLight : public Light
 		Vector3f toCamera = camera - inter.pos;
 		toCamera.normalize();
 
-		Color matColor = mat->getColor(inter.tex);
+		Color matColor = mat->getColor(inter.tex, inter.footprint);
 		// Diffuse
 		Color dif = matColor * color * (std::max(0.f, inter.normal * toLight) * mat->kd);
 		// Specular
@@ -108,6 +131,23 @@ struct ParallelLight : public Light
 	{
 		return { -direction, std::numeric_limits <float>::infinity() };
 	}
+
+	virtual Light * clone() const
+	{
+		return new ParallelLight(*this);
+	}
+
+	virtual bool sameAs(const Light &other) const
+	{
+		auto l = dynamic_cast <const ParallelLight *>(&other);
+		return l != nullptr && Light::sameAs(other) && direction == l->direction;
+	}
+
+	virtual void setDirection(const Vector3f &dir)
+	{
+		direction = dir;
+		direction.normalize();
+	}
 };
 
 struct PointLight : public Light
@@ -130,7 +170,7 @@ struct PointLight : public Light
 		Vector3f toCamera = camera - inter.pos;
 		toCamera.normalize();
 
-		Color matColor = mat->getColor(inter.tex);
+		Color matColor = mat->getColor(inter.tex, inter.footprint);
 		// Diffuse
 		Color dif = matColor * color * (std::max(0.f, inter.normal * toLight) * mat->kd);
 		// Specular
@@ -149,6 +189,22 @@ struct PointLight : public Light
 
 		return { d, dist };
 	}
+
+	virtual Light * clone() const
+	{
+		return new PointLight(*this);
+	}
+
+	virtual bool sameAs(const Light &other) const
+	{
+		auto l = dynamic_cast <const PointLight *>(&other);
+		return l != nullptr && Light::sameAs(other) && position == l->position;
+	}
+
+	virtual void setPosition(const Vector3f &pos)
+	{
+		position = pos;
+	}
 };
 
 struct SpotLight : public Light
@@ -176,7 +232,7 @@ struct SpotLight : public Light
 		Vector3f toCamera = camera - inter.pos;
 		toCamera.normalize();
 
-		Color matColor = mat->getColor(inter.tex);
+		Color matColor = mat->getColor(inter.tex, inter.footprint);
 		// Diffuse
 		Color dif = matColor * color * (std::max(0.f, inter.normal * toLight) * mat->kd);
 		// Specular
@@ -202,6 +258,28 @@ struct SpotLight : public Light
 		return { d, dist };
 	}
 
+	virtual Light * clone() const
+	{
+		return new SpotLight(*this);
+	}
+
+	virtual bool sameAs(const Light &other) const
+	{
+		auto l = dynamic_cast <const SpotLight *>(&other);
+		return l != nullptr && Light::sameAs(other) && position == l->position && direction == l->direction &&
+			inner == l->inner && outer == l->outer;
+	}
+
+	virtual void setPosition(const Vector3f &pos)
+	{
+		position = pos;
+	}
+
+	virtual void setDirection(const Vector3f &dir)
+	{
+		setDir(dir);
+	}
+
 	Vector3f getDir() const
 	{
 		return direction;
@@ -0,0 +1,138 @@
+#ifndef RAYTRACER_MANIFEST_H_
+#define RAYTRACER_MANIFEST_H_
+
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string>
+
+// List of animation frames that are completely written to disk. Frame is added only
+// after its file is written and the list is flushed every time, so after crash it
+// still describes valid frames. File layout: line "job <description>" followed
+// by lines "frame <index> <filename>"
+class FrameManifest
+{
+	std::string path;
+	std::ofstream file;
+	std::map <size_t, std::string> done;
+	mutable std::mutex mutex;
+
+	static bool fileExists(const std::string &filename)
+	{
+		std::ifstream f(filename, std::ios::binary | std::ios::ate);
+		return f && f.tellg() > 0;
+	}
+
+public:
+	// Read frames listed in manifest file without checking their files.
+	// Returns false if file can not be read, job is set to description of job
+	static bool read(const std::string &path, std::string &job, std::map <size_t, std::string> &frames)
+	{
+		std::ifstream in(path);
+		std::string line;
+		if (!std::getline(in, line) || line.compare(0, 4, "job ") != 0)
+			return false;
+
+		job = line.substr(4);
+		while (std::getline(in, line))
+		{
+			// Last line without end of line is still being written
+			if (in.eof())
+				break;
+
+			std::istringstream fields(line);
+			std::string tag, filename;
+			size_t index;
+			if (!(fields >> tag >> index) || tag != "frame")
+				continue;
+			std::getline(fields >> std::ws, filename);
+			frames[index] = filename;
+		}
+		return true;
+	}
+
+	// Add frames of job that are listed in manifest and whose files exist.
+	// Returns false if manifest can not be read or belongs to another job
+	static bool readDone(const std::string &path, const std::string &job, std::map <size_t, std::string> &frames)
+	{
+		std::string oldJob;
+		std::map <size_t, std::string> listed;
+		if (!read(path, oldJob, listed) || oldJob != job)
+			return false;
+
+		for (const auto &[index, filename] : listed)
+		{
+			if (fileExists(filename))
+				frames[index] = filename;
+		}
+		return true;
+	}
+
+	// Start manifest of job. If resume is set, frames of previous run of the same job
+	// whose files still exist are kept, otherwise manifest starts empty
+	bool open(const std::string &path, const std::string &job, bool resume)
+	{
+		this->path = path;
+		done.clear();
+
+		if (resume && !readDone(path, job, done) && fileExists(path))
+			std::cerr << "Manifest " << path << " belongs to another job, rendering all frames\n";
+
+		// Rewrite manifest, so it contains only frames that are really on disk
+		file.open(path, std::ios::trunc);
+		if (!file)
+			return false;
+		file << "job " << job << '\n';
+		for (const auto &[index, filename] : done)
+			file << "frame " << index << ' ' << filename << '\n';
+		file.flush();
+		return true;
+	}
+
+	bool isOpen() const
+	{
+		return file.is_open();
+	}
+
+	bool isDone(size_t index) const
+	{
+		std::lock_guard <std::mutex> lock(mutex);
+		return done.count(index) != 0;
+	}
+
+	std::string getFile(size_t index) const
+	{
+		std::lock_guard <std::mutex> lock(mutex);
+		auto it = done.find(index);
+		return it == done.end() ? std::string() : it->second;
+	}
+
+	size_t doneCount() const
+	{
+		std::lock_guard <std::mutex> lock(mutex);
+		return done.size();
+	}
+
+	// Called by writers after file of frame is written
+	void markDone(size_t index, const std::string &filename)
+	{
+		std::lock_guard <std::mutex> lock(mutex);
+		done[index] = filename;
+		if (file.is_open())
+		{
+			file << "frame " << index << ' ' << filename << '\n';
+			file.flush();
+		}
+	}
+
+	void close()
+	{
+		std::lock_guard <std::mutex> lock(mutex);
+		if (file.is_open())
+			file.close();
+	}
+};
+
+#endif  // RAYTRACER_MANIFEST_H_
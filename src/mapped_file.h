@@ -0,0 +1,186 @@
+#ifndef RAYTRACER_MAPPED_FILE_H_
+#define RAYTRACER_MAPPED_FILE_H_
+
+#include <string>
+
+#ifdef _MSC_VER
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// File mapped to memory. File of fixed size is mapped for writing and pages that are written
+// stay in file even if process crashes before file is closed. Existing file can be mapped
+// for reading, then pages are read from disk only when they are accessed
+class MappedFile
+{
+	unsigned char *ptr = nullptr;
+	size_t length = 0;
+	bool kept = false;
+#ifdef _MSC_VER
+	HANDLE file = INVALID_HANDLE_VALUE;
+	HANDLE mapping = nullptr;
+#else
+	int fd = -1;
+#endif
+
+public:
+	MappedFile() {}
+	MappedFile(const MappedFile &) = delete;
+	MappedFile &operator =(const MappedFile &) = delete;
+
+	~MappedFile()
+	{
+		close();
+	}
+
+	// Open file with given size. If keep is set and file already has this size, its
+	// content is kept, otherwise file is filled with zeros
+	bool open(const std::string &path, size_t size, bool keep)
+	{
+		close();
+		if (size == 0)
+			return false;
+
+#ifdef _MSC_VER
+		file = CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, 0, nullptr, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+		if (file == INVALID_HANDLE_VALUE)
+			return false;
+
+		LARGE_INTEGER current, zero{}, target;
+		target.QuadPart = static_cast <LONGLONG>(size);
+		kept = keep && GetFileSizeEx(file, &current) && current.QuadPart == target.QuadPart;
+		if (!kept && !(SetFilePointerEx(file, zero, nullptr, FILE_BEGIN) && SetEndOfFile(file) &&
+			SetFilePointerEx(file, target, nullptr, FILE_BEGIN) && SetEndOfFile(file)))
+		{
+			close();
+			return false;
+		}
+
+		mapping = CreateFileMappingA(file, nullptr, PAGE_READWRITE, static_cast <DWORD>(target.QuadPart >> 32),
+			static_cast <DWORD>(target.QuadPart), nullptr);
+		if (mapping != nullptr)
+			ptr = static_cast <unsigned char *>(MapViewOfFile(mapping, FILE_MAP_WRITE, 0, 0, size));
+#else
+		fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+		if (fd < 0)
+			return false;
+
+		struct stat st;
+		kept = keep && fstat(fd, &st) == 0 && static_cast <size_t>(st.st_size) == size;
+		if (!kept && (ftruncate(fd, 0) != 0 || ftruncate(fd, static_cast <off_t>(size)) != 0))
+		{
+			close();
+			return false;
+		}
+
+		void *p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		ptr = p == MAP_FAILED ? nullptr : static_cast <unsigned char *>(p);
+#endif
+		if (ptr == nullptr)
+		{
+			close();
+			return false;
+		}
+		length = size;
+		return true;
+	}
+
+	// Map existing file for reading, its content must not be changed through data()
+	bool openRead(const std::string &path)
+	{
+		close();
+#ifdef _MSC_VER
+		file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+		LARGE_INTEGER size;
+		if (file == INVALID_HANDLE_VALUE || !GetFileSizeEx(file, &size) || size.QuadPart == 0)
+		{
+			close();
+			return false;
+		}
+
+		mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		if (mapping != nullptr)
+			ptr = static_cast <unsigned char *>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+		length = static_cast <size_t>(size.QuadPart);
+#else
+		fd = ::open(path.c_str(), O_RDONLY);
+		struct stat st;
+		if (fd < 0 || fstat(fd, &st) != 0 || st.st_size == 0)
+		{
+			close();
+			return false;
+		}
+
+		length = static_cast <size_t>(st.st_size);
+		void *p = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+		ptr = p == MAP_FAILED ? nullptr : static_cast <unsigned char *>(p);
+#endif
+		if (ptr == nullptr)
+		{
+			close();
+			return false;
+		}
+		kept = true;
+		return true;
+	}
+
+	// Content of file was kept by open
+	bool wasKept() const
+	{
+		return kept;
+	}
+
+	unsigned char *data()
+	{
+		return ptr;
+	}
+
+	size_t size() const
+	{
+		return length;
+	}
+
+	// Write changed pages of [offset, offset + size) to disk
+	bool flush(size_t offset, size_t size)
+	{
+		if (ptr == nullptr)
+			return false;
+#ifdef _MSC_VER
+		return FlushViewOfFile(ptr + offset, size) && FlushFileBuffers(file);
+#else
+		// Range has to start at page boundary
+		size_t page = static_cast <size_t>(sysconf(_SC_PAGESIZE));
+		size_t begin = offset / page * page;
+		return msync(ptr + begin, offset + size - begin, MS_SYNC) == 0;
+#endif
+	}
+
+	void close()
+	{
+#ifdef _MSC_VER
+		if (ptr != nullptr)
+			UnmapViewOfFile(ptr);
+		if (mapping != nullptr)
+			CloseHandle(mapping);
+		if (file != INVALID_HANDLE_VALUE)
+			CloseHandle(file);
+		mapping = nullptr;
+		file = INVALID_HANDLE_VALUE;
+#else
+		if (ptr != nullptr)
+			munmap(ptr, length);
+		if (fd >= 0)
+			::close(fd);
+		fd = -1;
+#endif
+		ptr = nullptr;
+		length = 0;
+	}
+};
+
+#endif  // RAYTRACER_MAPPED_FILE_H_
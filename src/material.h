@@ -2,9 +2,10 @@
 #define RAYTRACER_MATERIAL_H_
 
 #include "color.h"
-#include "lodepng.h"
+#include "texture.h"
 
 #include <iostream>
+#include <memory>
 
 // Abstract class with interface to access color of material
 struct Material
@@ -30,7 +31,17 @@ struct Material
 	}
 
 	virtual ~Material() { }
-	virtual Color getColor(const Vector2f &pos) const = 0;
+	// Color at texture coordinates, footprint is width of area around them that is seen by ray
+	virtual Color getColor(const Vector2f &pos, float footprint) const = 0;
+	// Copy of material that can be changed independently
+	virtual Material * clone() const = 0;
+
+	// Check if material looks the same as other one
+	virtual bool sameAs(const Material &other) const
+	{
+		return ka == other.ka && kd == other.kd && ks == other.ks && exponent == other.exponent &&
+			reflectance == other.reflectance && transmittance == other.transmittance && refraction == other.refraction;
+	}
 };
 
 struct MaterialSolid : public Material
@@ -44,49 +55,56 @@ struct MaterialSolid : public Material
 
 	}
 
-	virtual Color getColor(const Vector2f &) const
+	virtual Color getColor(const Vector2f &, float) const
 	{
 		return color;
 	}
+
+	virtual Material * clone() const
+	{
+		return new MaterialSolid(*this);
+	}
+
+	virtual bool sameAs(const Material &other) const
+	{
+		auto m = dynamic_cast <const MaterialSolid *>(&other);
+		return m != nullptr && Material::sameAs(other) && color == m->color;
+	}
 };
 
 struct MaterialTextured : public Material
 {
-	unsigned width;
-	unsigned height;
-	std::vector <std::vector <Color>> texture;
+	// Texels are never changed after loading, so copies of material share them
+	std::shared_ptr <TextureSource> texture;
+	Texture::Filter filter;
+
+	// Lazy material decodes its texture when it is first sampled
+	MaterialTextured(const std::string &filename, float ka, float kd, float ks, float exp, float refl, float trans, float refr,
+		Texture::Layout layout = Texture::Layout::Tiled, Texture::Filter filter = Texture::Filter::Trilinear, bool lazy = false) :
+		Material(ka, kd, ks, exp, refl, trans, refr),
+		texture(std::make_shared <TextureSource>(filename, layout, lazy)),
+		filter(filter)
+	{
 
-	MaterialTextured(const std::string &filename, float ka, float kd, float ks, float exp, float refl, float trans, float refr) :
-		Material(ka, kd, ks, exp, refl, trans, refr)
+	}
+
+	virtual Color getColor(const Vector2f &coord, float footprint) const
 	{
-		// Load texture
-		std::vector <unsigned char> image;
-		unsigned error = lodepng::decode(image, width, height, filename);
-		if (error)
-		{
-			std::cerr << "PNG decoder error: " << lodepng_error_text(error) << std::endl;
-			return;
-		}
-
-		texture.resize(width);
-		for (size_t i = 0; i < width; ++i)
-			texture[i].reserve(height);
-
-		// Data returned from decode() is flat and we want it to be 2d
-		for (size_t i = 0; i < image.size(); i += 4)
-		{
-			texture[(i / 4) % width].emplace_back(image[i] / 255.f, image[i + 1] / 255.f, image[i + 2] / 255.f);
-		}
+		const Texture *t = texture->get();
+		if (t == nullptr)
+			return Color(0.f, 0.f, 0.f);
+		return t->sample(coord, footprint, filter);
 	}
 
-	virtual Color getColor(const Vector2f &coord) const
+	virtual Material * clone() const
 	{
-		size_t x = static_cast <size_t>(static_cast <int>(coord[0] * width));
-		size_t y = static_cast <size_t>(static_cast <int>(coord[1] * height));
-		x %= width;
-		y %= height;
+		return new MaterialTextured(*this);
+	}
 
-		return texture[x][y];
+	virtual bool sameAs(const Material &other) const
+	{
+		auto m = dynamic_cast <const MaterialTextured *>(&other);
+		return m != nullptr && Material::sameAs(other) && (texture == m->texture || texture->sameFile(*m->texture)) && filter == m->filter;
 	}
 };
 
@@ -92,6 +92,80 @@ struct Matrix
 		}
 	}
 
+	bool operator ==(const Matrix <T, N> &rhs) const
+	{
+		for (size_t x = 0; x < N; ++x)
+		{
+			for (size_t y = 0; y < N; ++y)
+			{
+				if (data[x][y] != rhs.data[x][y])
+					return false;
+			}
+		}
+		return true;
+	}
+
+	bool operator !=(const Matrix <T, N> &rhs) const
+	{
+		return !((*this) == rhs);
+	}
+
+	// In place operations let scripts change matrix without creating temporary ones
+
+	void setIdentity()
+	{
+		*this = Matrix <T, N>();
+	}
+
+	// Element in given row and column
+	T get(size_t row, size_t col) const
+	{
+		return data[col][row];
+	}
+
+	void set(size_t row, size_t col, const T &val)
+	{
+		data[col][row] = val;
+	}
+
+	// this = lhs * this, so lhs is applied after this transform
+	void preMultiply(const Matrix <T, N> &lhs)
+	{
+		*this = lhs * (*this);
+	}
+
+	// this = this * rhs, so rhs is applied before this transform
+	void postMultiply(const Matrix <T, N> &rhs)
+	{
+		*this *= rhs;
+	}
+
+	// Apply transform after this one, only for 4x4 matrices
+	void applyTranslation(const T &x, const T &y, const T &z)
+	{
+		preMultiply(fromTranslation(Vector <T, N - 1>(x, y, z)));
+	}
+
+	void applyScaling(const T &x, const T &y, const T &z)
+	{
+		preMultiply(fromScaling(Vector <T, N - 1>(x, y, z)));
+	}
+
+	void applyRotationX(const T &alpha)
+	{
+		preMultiply(fromRotationX(alpha));
+	}
+
+	void applyRotationY(const T &alpha)
+	{
+		preMultiply(fromRotationY(alpha));
+	}
+
+	void applyRotationZ(const T &alpha)
+	{
+		preMultiply(fromRotationZ(alpha));
+	}
+
 	Vector <T, N> operator *(const Vector <T, N> &rhs) const
 	{
 		Vector <T, N> res;
@@ -0,0 +1,371 @@
+#include "mesh_optimizer.h"
+
+#include <algorithm>
+#include <cstring>
+#include <functional>
+#include <limits>
+#include <queue>
+#include <thread>
+
+using namespace std;
+
+// Triangle whose area is this small part of square of its edges is a line or a point
+static const float DegenerateRatio = 1e-6f;
+
+// Bits of every coordinate in Morton code
+static const unsigned MortonBits = 21;
+
+// Meshes with fewer corners per thread are welded by one thread
+static const size_t MinCornersPerThread = size_t(1) << 16;
+
+// Marks free slot of welding table and vertex that is not used yet
+static const uint32_t None = numeric_limits <uint32_t>::max();
+
+// All attributes of corner, corners with equal keys are one vertex
+struct VertexKey
+{
+	float values[8];
+
+	VertexKey(const Vector3f &pos, const Vector3f &normal, const Vector2f &tex)
+	{
+		const float source[8] = { pos[0], pos[1], pos[2], normal[0], normal[1], normal[2], tex[0], tex[1] };
+		// Adding zero turns -0 into 0, so they are welded
+		for (size_t i = 0; i < 8; ++i)
+			values[i] = source[i] + 0.f;
+	}
+
+	bool operator ==(const VertexKey &rhs) const
+	{
+		return memcmp(values, rhs.values, sizeof(values)) == 0;
+	}
+};
+
+static uint32_t hashKey(const VertexKey &key)
+{
+	uint64_t h = 14695981039346656037ull;
+	for (float v : key.values)
+	{
+		uint32_t bits;
+		memcpy(&bits, &v, sizeof(bits));
+		h = (h ^ bits) * 1099511628211ull;
+	}
+	return static_cast <uint32_t>(h ^ (h >> 32));
+}
+
+// Arrays of loader, every corner of triangle gives welding key
+struct CornerSource
+{
+	const vector <Vector3f> &positions;
+	const vector <Vector3f> &normals;
+	const vector <Vector2f> &texcoords;
+	const vector <VertexIndices> &corners;
+
+	// Normal of triangle, false if it has no area
+	bool getFace(size_t triangle, Vector3f &face) const
+	{
+		const Vector3f &a = positions[corners[triangle * 3].vertex_index];
+		Vector3f e1 = positions[corners[triangle * 3 + 1].vertex_index] - a;
+		Vector3f e2 = positions[corners[triangle * 3 + 2].vertex_index] - a;
+		face = e1.cross(e2);
+		if (face.length() <= DegenerateRatio * (e1.sqrLength() + e2.sqrLength()))
+			return false;
+		face.normalize();
+		return true;
+	}
+
+	VertexKey getKey(size_t corner, const Vector3f &face) const
+	{
+		const VertexIndices &c = corners[corner];
+		return VertexKey(positions[c.vertex_index], c.normal_index >= 0 ? normals[c.normal_index] : face,
+			!texcoords.empty() && c.texcoord_index >= 0 ? texcoords[c.texcoord_index] : Vector2f());
+	}
+
+	VertexKey getKey(size_t corner) const
+	{
+		Vector3f face;
+		if (corners[corner].normal_index < 0)
+			getFace(corner / 3, face);
+		return getKey(corner, face);
+	}
+};
+
+static void parallelFor(size_t count, const function <void(size_t)> &task)
+{
+	vector <thread> threads;
+	for (size_t i = 1; i < count; ++i)
+		threads.emplace_back(task, i);
+	if (count > 0)
+		task(0);
+	for (thread &t : threads)
+		t.join();
+}
+
+// Welded vertices of one part of keys. Table holds vertices at slots found by linear probing,
+// vertex is number of its first corner in reps and numbers give its place in whole mesh
+struct WeldPart
+{
+	vector <uint32_t> slots;
+	vector <uint32_t> reps;
+	vector <uint32_t> numbers;
+
+	// Vertex of corner, hash / parts chooses slot
+	uint32_t insert(uint32_t corner, uint32_t hash, size_t parts, const vector <uint32_t> &hashes, const CornerSource &source)
+	{
+		if ((reps.size() + 1) * 2 > slots.size())
+			grow(parts, hashes);
+		size_t mask = slots.size() - 1;
+		VertexKey key = source.getKey(corner);
+		for (size_t i = hash / parts & mask; ; i = (i + 1) & mask)
+		{
+			uint32_t v = slots[i];
+			if (v == None)
+			{
+				slots[i] = static_cast <uint32_t>(reps.size());
+				reps.push_back(corner);
+				return slots[i];
+			}
+			if (hashes[reps[v]] == hash && source.getKey(reps[v]) == key)
+				return v;
+		}
+	}
+
+	void grow(size_t parts, const vector <uint32_t> &hashes)
+	{
+		vector <uint32_t> old(max <size_t>(slots.size() * 2, 1024), None);
+		old.swap(slots);
+		size_t mask = slots.size() - 1;
+		for (uint32_t v = 0; v < reps.size(); ++v)
+		{
+			size_t i = hashes[reps[v]] / parts & mask;
+			while (slots[i] != None)
+				i = (i + 1) & mask;
+			slots[i] = v;
+		}
+	}
+};
+
+// Insert two zero bits between every bit of 21 lower bits
+static uint64_t spreadBits(uint64_t x)
+{
+	x &= 0x1fffff;
+	x = (x | x << 32) & 0x1f00000000ffffull;
+	x = (x | x << 16) & 0x1f0000ff0000ffull;
+	x = (x | x << 8) & 0x100f00f00f00f00full;
+	x = (x | x << 4) & 0x10c30c30c30c30c3ull;
+	x = (x | x << 2) & 0x1249249249249249ull;
+	return x;
+}
+
+static uint64_t mortonCode(const Vector3f &point, const Vector3f &min, const Vector3f &scale)
+{
+	uint64_t res = 0;
+	for (size_t i = 0; i < 3; ++i)
+	{
+		float cell = std::clamp((point[i] - min[i]) * scale[i], 0.f, static_cast <float>((1u << MortonBits) - 1));
+		res |= spreadBits(static_cast <uint64_t>(cell)) << i;
+	}
+	return res;
+}
+
+// Triangle in sorted order: repeated triangles have the same code and vertices, so they are neighbours
+struct SortKey
+{
+	uint64_t code;
+	uint32_t sorted[3];		// Vertices in ascending order
+	uint32_t triangle;
+
+	bool operator <(const SortKey &rhs) const
+	{
+		return tie(code, sorted[0], sorted[1], sorted[2], triangle) <
+			tie(rhs.code, rhs.sorted[0], rhs.sorted[1], rhs.sorted[2], rhs.triangle);
+	}
+
+	bool sameVertices(const SortKey &rhs) const
+	{
+		return sorted[0] == rhs.sorted[0] && sorted[1] == rhs.sorted[1] && sorted[2] == rhs.sorted[2];
+	}
+};
+
+MeshReport optimizeMesh(vector <Vector3f> positions, vector <Vector3f> normals,
+	vector <Vector2f> texcoords, vector <VertexIndices> corners, IndexedMesh &res)
+{
+	MeshReport report;
+	report.corners = corners.size();
+	report.bytesBefore = positions.size() * sizeof(Vector3f) + normals.size() * sizeof(Vector3f) +
+		texcoords.size() * sizeof(Vector2f) + corners.size() * sizeof(VertexIndices);
+	bool hasTexcoords = !texcoords.empty();
+	CornerSource source{ positions, normals, texcoords, corners };
+	size_t triangleCount = corners.size() / 3;
+	size_t threads = max <size_t>(min <size_t>(thread::hardware_concurrency(), corners.size() / MinCornersPerThread), 1);
+
+	// Hash of key of every corner, triangles without area are marked and not welded
+	vector <uint32_t> hashes(triangleCount * 3);
+	vector <uint8_t> degenerate(triangleCount);
+	parallelFor(threads, [&](size_t part)
+	{
+		for (size_t t = triangleCount * part / threads; t < triangleCount * (part + 1) / threads; ++t)
+		{
+			Vector3f face;
+			degenerate[t] = !source.getFace(t, face);
+			for (size_t j = t * 3; j < t * 3 + 3 && !degenerate[t]; ++j)
+				hashes[j] = hashKey(source.getKey(j, face));
+		}
+	});
+
+	// Every thread welds corners of one part of hashes, so parts do not share vertices. Corner
+	// first gets number of vertex in its part
+	vector <uint32_t> triangles(triangleCount * 3);
+	vector <WeldPart> parts(threads);
+	parallelFor(threads, [&](size_t part)
+	{
+		for (size_t t = 0; t < triangleCount; ++t)
+		{
+			for (size_t j = t * 3; j < t * 3 + 3 && !degenerate[t]; ++j)
+			{
+				if (hashes[j] % threads == part)
+					triangles[j] = parts[part].insert(static_cast <uint32_t>(j), hashes[j], threads, hashes, source);
+			}
+		}
+		parts[part].slots = {};
+	});
+
+	// Vertices are numbered in order of their first corners, as if one thread welded them, so
+	// mesh does not depend on amount of cores. Every part lists its vertices in this order
+	size_t weldedCount = 0;
+	priority_queue <pair <uint32_t, size_t>, vector <pair <uint32_t, size_t>>, greater <pair <uint32_t, size_t>>> firstCorners;
+	for (size_t part = 0; part < threads; ++part)
+	{
+		weldedCount += parts[part].reps.size();
+		parts[part].numbers.reserve(parts[part].reps.size());
+		if (!parts[part].reps.empty())
+			firstCorners.push({ parts[part].reps[0], part });
+	}
+	for (uint32_t number = 0; !firstCorners.empty(); ++number)
+	{
+		WeldPart &part = parts[firstCorners.top().second];
+		part.numbers.push_back(number);
+		if (part.numbers.size() < part.reps.size())
+			firstCorners.push({ part.reps[part.numbers.size()], firstCorners.top().second });
+		firstCorners.pop();
+	}
+
+	size_t kept = 0;
+	for (size_t t = 0; t < triangleCount; ++t)
+	{
+		if (degenerate[t])
+		{
+			++report.degenerate;
+			continue;
+		}
+		for (size_t j = t * 3; j < t * 3 + 3; ++j)
+			triangles[kept++] = parts[hashes[j] % threads].numbers[triangles[j]];
+	}
+	triangles.resize(kept);
+	hashes = {};
+	degenerate = {};
+
+	res.vertices.resize(weldedCount);
+	res.normals.resize(weldedCount);
+	res.texcoords.resize(hasTexcoords ? weldedCount : 0);
+	// First corner of every vertex gives its attributes
+	parallelFor(threads, [&](size_t part)
+	{
+		const WeldPart &weld = parts[part];
+		for (size_t i = 0; i < weld.reps.size(); ++i)
+		{
+			VertexKey key = source.getKey(weld.reps[i]);
+			const float *v = key.values;
+			res.vertices[weld.numbers[i]] = Vector3f(v[0], v[1], v[2]);
+			res.normals[weld.numbers[i]] = Vector3f(v[3], v[4], v[5]);
+			if (hasTexcoords)
+				res.texcoords[weld.numbers[i]] = Vector2f(v[6], v[7]);
+		}
+	});
+
+	// Arrays of loader are not needed anymore
+	parts = {};
+	positions = {};
+	normals = {};
+	texcoords = {};
+	corners = {};
+
+	// Morton code of center of every triangle in bounds of mesh
+	Vector3f min(numeric_limits <float>::max(), numeric_limits <float>::max(), numeric_limits <float>::max());
+	Vector3f max(-numeric_limits <float>::max(), -numeric_limits <float>::max(), -numeric_limits <float>::max());
+	for (const Vector3f &v : res.vertices)
+	{
+		for (size_t i = 0; i < 3; ++i)
+		{
+			min[i] = std::min(min[i], v[i]);
+			max[i] = std::max(max[i], v[i]);
+		}
+	}
+	Vector3f scale;
+	for (size_t i = 0; i < 3; ++i)
+		scale[i] = max[i] > min[i] ? ((1u << MortonBits) - 1) / (max[i] - min[i]) : 0.f;
+
+	vector <SortKey> order(triangles.size() / 3);
+	parallelFor(threads, [&](size_t part)
+	{
+		for (size_t t = order.size() * part / threads; t < order.size() * (part + 1) / threads; ++t)
+		{
+			const uint32_t *v = &triangles[t * 3];
+			Vector3f center;
+			for (size_t j = 0; j < 3; ++j)
+				center += res.vertices[v[j]] * (1.f / 3.f);
+
+			SortKey &key = order[t];
+			key.code = mortonCode(center, min, scale);
+			copy(v, v + 3, key.sorted);
+			sort(key.sorted, key.sorted + 3);
+			key.triangle = static_cast <uint32_t>(t);
+		}
+	});
+	sort(order.begin(), order.end());
+
+	// Vertices are numbered as triangles use them, the first of repeated triangles is kept
+	vector <uint32_t> remap(weldedCount, None);
+	uint32_t count = 0;
+	res.indices.clear();
+	res.indices.reserve(triangles.size());
+	for (size_t t = 0; t < order.size(); ++t)
+	{
+		if (t > 0 && order[t].code == order[t - 1].code && order[t].sameVertices(order[t - 1]))
+		{
+			++report.duplicates;
+			continue;
+		}
+		for (size_t j = 0; j < 3; ++j)
+		{
+			uint32_t v = triangles[order[t].triangle * 3 + j];
+			if (remap[v] == None)
+				remap[v] = count++;
+			res.indices.push_back(remap[v]);
+		}
+	}
+	order = {};
+	triangles = {};
+
+	// Attributes are moved to new numbers one array at a time
+	auto renumber = [&](auto &values)
+	{
+		if (values.empty())
+			return;
+		typename remove_reference <decltype(values)>::type moved(count);
+		for (size_t i = 0; i < weldedCount; ++i)
+		{
+			if (remap[i] != None)
+				moved[remap[i]] = values[i];
+		}
+		values.swap(moved);
+	};
+	renumber(res.vertices);
+	renumber(res.normals);
+	renumber(res.texcoords);
+
+	report.triangles = res.indices.size() / 3;
+	report.vertices = count;
+	report.bytesAfter = res.vertices.size() * sizeof(Vector3f) + res.normals.size() * sizeof(Vector3f) +
+		res.texcoords.size() * sizeof(Vector2f) + res.indices.size() * sizeof(uint32_t);
+	return report;
+}
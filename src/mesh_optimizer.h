@@ -0,0 +1,52 @@
+#ifndef RAYTRACER_MESH_OPTIMIZER_H_
+#define RAYTRACER_MESH_OPTIMIZER_H_
+
+#include "obj_loader.h"
+#include "vector.h"
+
+#include <cstdint>
+#include <vector>
+
+// Mesh with one index per corner. Vertex i has position vertices[i], normal normals[i] and
+// texture coordinates texcoords[i]
+struct IndexedMesh
+{
+	std::vector <Vector3f> vertices;
+	std::vector <Vector3f> normals;
+	std::vector <Vector2f> texcoords;	// Empty if mesh has no texture coordinates
+	std::vector <uint32_t> indices;		// Three vertices of every triangle
+};
+
+// What optimizeMesh did with mesh
+struct MeshReport
+{
+	size_t triangles = 0;		// Triangles that are kept
+	size_t degenerate = 0;		// Removed triangles without area
+	size_t duplicates = 0;		// Removed triangles with the same vertices as another one
+	size_t corners = 0;			// Corners of triangles in file
+	size_t vertices = 0;		// Vertices after welding
+	size_t bytesBefore = 0;		// Memory of arrays as they were loaded
+	size_t bytesAfter = 0;
+
+	void operator +=(const MeshReport &rhs)
+	{
+		triangles += rhs.triangles;
+		degenerate += rhs.degenerate;
+		duplicates += rhs.duplicates;
+		corners += rhs.corners;
+		vertices += rhs.vertices;
+		bytesBefore += rhs.bytesBefore;
+		bytesAfter += rhs.bytesAfter;
+	}
+};
+
+// Turn triangles with separate indices of position, normal and texture coordinates into
+// indexed mesh. Corners with equal attributes are welded into one vertex, triangles without
+// area and repeated triangles are removed. Triangles are sorted along Morton curve through
+// their centers and vertices are numbered in order of their first use, so triangles that are
+// close in space are close in memory. Corner without normal takes normal of its face.
+// Arrays of loader are moved in and freed as soon as vertices are welded
+MeshReport optimizeMesh(std::vector <Vector3f> positions, std::vector <Vector3f> normals,
+	std::vector <Vector2f> texcoords, std::vector <VertexIndices> corners, IndexedMesh &res);
+
+#endif  // RAYTRACER_MESH_OPTIMIZER_H_
@@ -0,0 +1,259 @@
+#ifndef RAYTRACER_MOTION_H_
+#define RAYTRACER_MOTION_H_
+
+#include "matrix.h"
+#include "vector.h"
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+// Rotation as unit quaternion w + xi + yj + zk
+struct Quaternion
+{
+	float w = 1.f;
+	float x = 0.f;
+	float y = 0.f;
+	float z = 0.f;
+
+	// Rotation part of matrix, it should have orthonormal columns and determinant 1
+	static Quaternion fromMatrix(const Matrix4f &m)
+	{
+		Quaternion q;
+		float trace = m.get(0, 0) + m.get(1, 1) + m.get(2, 2);
+		if (trace > 0.f)
+		{
+			float s = std::sqrt(trace + 1.f) * 2.f;
+			q.w = 0.25f * s;
+			q.x = (m.get(2, 1) - m.get(1, 2)) / s;
+			q.y = (m.get(0, 2) - m.get(2, 0)) / s;
+			q.z = (m.get(1, 0) - m.get(0, 1)) / s;
+		}
+		else if (m.get(0, 0) > m.get(1, 1) && m.get(0, 0) > m.get(2, 2))
+		{
+			float s = std::sqrt(1.f + m.get(0, 0) - m.get(1, 1) - m.get(2, 2)) * 2.f;
+			q.w = (m.get(2, 1) - m.get(1, 2)) / s;
+			q.x = 0.25f * s;
+			q.y = (m.get(0, 1) + m.get(1, 0)) / s;
+			q.z = (m.get(0, 2) + m.get(2, 0)) / s;
+		}
+		else if (m.get(1, 1) > m.get(2, 2))
+		{
+			float s = std::sqrt(1.f + m.get(1, 1) - m.get(0, 0) - m.get(2, 2)) * 2.f;
+			q.w = (m.get(0, 2) - m.get(2, 0)) / s;
+			q.x = (m.get(0, 1) + m.get(1, 0)) / s;
+			q.y = 0.25f * s;
+			q.z = (m.get(1, 2) + m.get(2, 1)) / s;
+		}
+		else
+		{
+			float s = std::sqrt(1.f + m.get(2, 2) - m.get(0, 0) - m.get(1, 1)) * 2.f;
+			q.w = (m.get(1, 0) - m.get(0, 1)) / s;
+			q.x = (m.get(0, 2) + m.get(2, 0)) / s;
+			q.y = (m.get(1, 2) + m.get(2, 1)) / s;
+			q.z = 0.25f * s;
+		}
+		q.normalize();
+		return q;
+	}
+
+	Matrix4f toMatrix() const
+	{
+		Matrix4f m;
+		m.set(0, 0, 1.f - 2.f * (y * y + z * z));
+		m.set(0, 1, 2.f * (x * y - z * w));
+		m.set(0, 2, 2.f * (x * z + y * w));
+		m.set(1, 0, 2.f * (x * y + z * w));
+		m.set(1, 1, 1.f - 2.f * (x * x + z * z));
+		m.set(1, 2, 2.f * (y * z - x * w));
+		m.set(2, 0, 2.f * (x * z - y * w));
+		m.set(2, 1, 2.f * (y * z + x * w));
+		m.set(2, 2, 1.f - 2.f * (x * x + y * y));
+		return m;
+	}
+
+	float dot(const Quaternion &rhs) const
+	{
+		return w * rhs.w + x * rhs.x + y * rhs.y + z * rhs.z;
+	}
+
+	void normalize()
+	{
+		float length = std::sqrt(dot(*this));
+		w /= length;
+		x /= length;
+		y /= length;
+		z /= length;
+	}
+
+	// Angle of rotation from this one to other, in radians
+	float angleTo(const Quaternion &rhs) const
+	{
+		return 2.f * std::acos(std::min(std::fabs(dot(rhs)), 1.f));
+	}
+
+	// Rotation with constant angular speed along shorter arc
+	static Quaternion slerp(const Quaternion &a, Quaternion b, float t)
+	{
+		float cos = a.dot(b);
+		if (cos < 0.f)
+		{
+			b = { -b.w, -b.x, -b.y, -b.z };
+			cos = -cos;
+		}
+
+		// Nearly equal rotations are interpolated linearly, sin of angle is too small
+		float wa = 1.f - t, wb = t;
+		if (cos < 0.9995f)
+		{
+			float angle = std::acos(cos);
+			float sin = std::sin(angle);
+			wa = std::sin((1.f - t) * angle) / sin;
+			wb = std::sin(t * angle) / sin;
+		}
+		Quaternion res{ a.w * wa + b.w * wb, a.x * wa + b.x * wb, a.y * wa + b.y * wb, a.z * wa + b.z * wb };
+		res.normalize();
+		return res;
+	}
+};
+
+// Transform of object or camera while shutter is open, given by keys at equal steps of exposure.
+// Every key is split into translation, rotation and stretch (polar decomposition), they are
+// interpolated separately, so rotating object keeps its size and shape between keys
+class MotionPath
+{
+	struct Key
+	{
+		Matrix4f transform;
+		Vector3f translation;
+		Quaternion rotation;
+		Matrix4f stretch;		// Scale and shear applied before rotation
+	};
+	std::vector <Key> keys;
+
+	// Linear part of transform, without translation
+	static Matrix4f getLinear(const Matrix4f &m)
+	{
+		Matrix4f res = m;
+		for (size_t i = 0; i < 3; ++i)
+			res.data[3][i] = 0.f;
+		return res;
+	}
+
+	// Split linear part into rotation * stretch. Average of matrix and its inverse transpose
+	// converges to the closest rotation
+	static void decompose(const Matrix4f &linear, Quaternion &rotation, Matrix4f &stretch)
+	{
+		float det = linear.determinant();
+		if (std::fabs(det) < 1e-12f)
+		{
+			// Flattened object has no rotation that could be found, it is only stretched
+			rotation = Quaternion();
+			stretch = linear;
+			return;
+		}
+
+		// Reflection is moved into stretch, so rotation has determinant 1
+		Matrix4f r = linear;
+		float sign = det < 0.f ? -1.f : 1.f;
+		for (size_t i = 0; i < 3; ++i)
+		{
+			for (size_t j = 0; j < 3; ++j)
+				r.data[i][j] *= sign;
+		}
+		for (size_t iteration = 0; iteration < 30; ++iteration)
+		{
+			Matrix4f inverseTranspose = r.invert().transpose();
+			float change = 0.f;
+			for (size_t i = 0; i < 3; ++i)
+			{
+				for (size_t j = 0; j < 3; ++j)
+				{
+					float next = 0.5f * (r.data[i][j] + inverseTranspose.data[i][j]);
+					change = std::max(change, std::fabs(next - r.data[i][j]));
+					r.data[i][j] = next;
+				}
+			}
+			if (change < 1e-7f)
+				break;
+		}
+		rotation = Quaternion::fromMatrix(r);
+		stretch = rotation.toMatrix().transpose() * linear;
+	}
+
+public:
+	size_t size() const
+	{
+		return keys.size();
+	}
+
+	const Matrix4f & getKey(size_t i) const
+	{
+		return keys[i].transform;
+	}
+
+	// Add transform at next step of exposure. Returns angle of rotation since previous key
+	float addKey(const Matrix4f &transform)
+	{
+		Key key;
+		key.transform = transform;
+		key.translation = transform * Vector3f();
+		decompose(getLinear(transform), key.rotation, key.stretch);
+		if (keys.empty())
+		{
+			keys.push_back(key);
+			return 0.f;
+		}
+
+		keys.push_back(key);
+		return keys[keys.size() - 2].rotation.angleTo(key.rotation);
+	}
+
+	// Transform at moment of exposure in [0, 1], split into linear part and translation.
+	// Path goes through every key exactly
+	void at(float time, Matrix4f &linear, Vector3f &translation) const
+	{
+		float pos = std::clamp(time, 0.f, 1.f) * (keys.size() - 1);
+		size_t i = std::min(static_cast <size_t>(pos), keys.size() - 1);
+		float t = pos - i;
+		if (t == 0.f || i + 1 == keys.size())
+		{
+			linear = getLinear(keys[i].transform);
+			translation = keys[i].translation;
+			return;
+		}
+
+		const Key &a = keys[i];
+		const Key &b = keys[i + 1];
+		Matrix4f stretch;
+		for (size_t x = 0; x < 3; ++x)
+		{
+			for (size_t y = 0; y < 3; ++y)
+				stretch.data[x][y] = a.stretch.data[x][y] + (b.stretch.data[x][y] - a.stretch.data[x][y]) * t;
+		}
+		linear = Quaternion::slerp(a.rotation, b.rotation, t).toMatrix() * stretch;
+		translation = a.translation + (b.translation - a.translation) * t;
+	}
+
+	Matrix4f at(float time) const
+	{
+		Matrix4f linear;
+		Vector3f translation;
+		at(time, linear, translation);
+		return Matrix4f::fromTranslation(translation) * linear;
+	}
+
+	bool operator ==(const MotionPath &rhs) const
+	{
+		if (keys.size() != rhs.keys.size())
+			return false;
+		for (size_t i = 0; i < keys.size(); ++i)
+		{
+			if (keys[i].transform != rhs.keys[i].transform)
+				return false;
+		}
+		return true;
+	}
+};
+
+#endif  // RAYTRACER_MOTION_H_
@@ -0,0 +1,312 @@
+#include "obj_loader.h"
+#include "mapped_file.h"
+
+#include <algorithm>
+#include <charconv>
+#include <cstring>
+#include <functional>
+#include <thread>
+
+using namespace std;
+
+// Files smaller than this are parsed by one thread
+static const size_t MinChunk = size_t(1) << 22;
+
+// Amount of elements in chunk of file. Counts of previous chunks give position of chunk in output
+struct Counts
+{
+	size_t vertices = 0;
+	size_t normals = 0;
+	size_t texcoords = 0;
+	size_t indices = 0;
+};
+
+static void parallelFor(size_t count, const function <void(size_t)> &task)
+{
+	vector <thread> threads;
+	for (size_t i = 1; i < count; ++i)
+		threads.emplace_back(task, i);
+	if (count > 0)
+		task(0);
+	for (thread &t : threads)
+		t.join();
+}
+
+static void skipSpaces(const char *&p, const char *end)
+{
+	while (p < end && (*p == ' ' || *p == '\t' || *p == '\r'))
+		++p;
+}
+
+static bool parseFloat(const char *&p, const char *end, float &value)
+{
+	skipSpaces(p, end);
+	if (p < end && *p == '+')
+		++p;
+	auto [ptr, ec] = from_chars(p, end, value);
+	if (ec != errc())
+		return false;
+	p = ptr;
+	return true;
+}
+
+static bool parseInt(const char *&p, const char *end, int &value)
+{
+	auto [ptr, ec] = from_chars(p, end, value);
+	if (ec != errc())
+		return false;
+	p = ptr;
+	return true;
+}
+
+// Statements that are read, everything else is skipped
+enum class Statement
+{
+	None,
+	Vertex,
+	Normal,
+	Texcoord,
+	Face
+};
+
+// Kind of statement of line, p is moved after keyword
+static Statement getStatement(const char *&p, const char *end)
+{
+	skipSpaces(p, end);
+	auto keyword = [&](const char *name, size_t length)
+	{
+		if (static_cast <size_t>(end - p) <= length || memcmp(p, name, length) != 0 || (p[length] != ' ' && p[length] != '\t'))
+			return false;
+		p += length;
+		return true;
+	};
+
+	if (keyword("v", 1))
+		return Statement::Vertex;
+	if (keyword("vn", 2))
+		return Statement::Normal;
+	if (keyword("vt", 2))
+		return Statement::Texcoord;
+	if (keyword("f", 1))
+		return Statement::Face;
+	return Statement::None;
+}
+
+// Call f(line, end) for every line of [begin, end)
+template <typename F>
+static void forEachLine(const char *begin, const char *end, F &&f)
+{
+	for (const char *p = begin; p < end; )
+	{
+		const char *next = static_cast <const char *>(memchr(p, '\n', end - p));
+		if (next == nullptr)
+			next = end;
+		f(p, next);
+		p = next + 1;
+	}
+}
+
+// Amount of corners of face, without parsing them
+static size_t countCorners(const char *p, const char *end)
+{
+	size_t res = 0;
+	bool word = false;
+	for (; p < end && *p != '#'; ++p)
+	{
+		bool space = *p == ' ' || *p == '\t' || *p == '\r';
+		res += !space && !word;
+		word = !space;
+	}
+	return res;
+}
+
+static Counts countChunk(const char *begin, const char *end)
+{
+	Counts res;
+	forEachLine(begin, end, [&](const char *p, const char *lineEnd)
+	{
+		switch (getStatement(p, lineEnd))
+		{
+		case Statement::Vertex:
+			++res.vertices;
+			break;
+		case Statement::Normal:
+			++res.normals;
+			break;
+		case Statement::Texcoord:
+			++res.texcoords;
+			break;
+		case Statement::Face:
+		{
+			size_t corners = countCorners(p, lineEnd);
+			if (corners >= 3)
+				res.indices += (corners - 2) * 3;
+			break;
+		}
+		case Statement::None:
+			break;
+		}
+	});
+	return res;
+}
+
+// OBJ indices start at 1, negative index counts back from the last element that is already
+// defined. Missing index (0) gives -1
+static bool fixIndex(int index, size_t defined, int &res)
+{
+	if (index > 0 && static_cast <size_t>(index) <= defined)
+		res = index - 1;
+	else if (index < 0 && static_cast <size_t>(-static_cast <long long>(index)) <= defined)
+		res = static_cast <int>(defined + index);
+	else
+		return false;
+	return true;
+}
+
+// Corner of face: v, v/vt, v//vn or v/vt/vn, followed by space, comment or end of line
+static bool parseCorner(const char *&p, const char *end, const Counts &defined, VertexIndices &res)
+{
+	int v = 0, t = 0, n = 0;
+	if (!parseInt(p, end, v))
+		return false;
+	if (p < end && *p == '/')
+	{
+		++p;
+		if (p < end && *p != '/' && !parseInt(p, end, t))
+			return false;
+		if (p < end && *p == '/')
+		{
+			++p;
+			if (!parseInt(p, end, n))
+				return false;
+		}
+	}
+	if (p < end && *p != ' ' && *p != '\t' && *p != '\r' && *p != '#')
+		return false;
+
+	res.normal_index = -1;
+	res.texcoord_index = -1;
+	return fixIndex(v, defined.vertices, res.vertex_index) &&
+		(t == 0 || fixIndex(t, defined.texcoords, res.texcoord_index)) &&
+		(n == 0 || fixIndex(n, defined.normals, res.normal_index));
+}
+
+bool loadObj(const string &filename, vector <Vector3f> &vertices, vector <Vector3f> &normals,
+	vector <Vector2f> &texcoords, vector <VertexIndices> &indices, string &error)
+{
+	MappedFile file;
+	if (!file.openRead(filename))
+	{
+		error = "Could not read " + filename;
+		return false;
+	}
+	const char *data = reinterpret_cast <const char *>(file.data());
+	size_t size = file.size();
+
+	// Chunks end at line boundaries
+	size_t threads = max <size_t>(thread::hardware_concurrency(), 1);
+	size_t chunks = max <size_t>(min(threads, size / MinChunk), 1);
+	vector <size_t> bounds(chunks + 1, size);
+	bounds[0] = 0;
+	for (size_t i = 1; i < chunks; ++i)
+	{
+		size_t pos = max(size * i / chunks, bounds[i - 1]);
+		const void *newline = memchr(data + pos, '\n', size - pos);
+		bounds[i] = newline == nullptr ? size : static_cast <const char *>(newline) - data + 1;
+	}
+
+	vector <Counts> counts(chunks);
+	parallelFor(chunks, [&](size_t i)
+	{
+		counts[i] = countChunk(data + bounds[i], data + bounds[i + 1]);
+	});
+
+	// Position of every chunk in output
+	vector <Counts> starts(chunks);
+	Counts total;
+	for (size_t i = 0; i < chunks; ++i)
+	{
+		starts[i] = total;
+		total.vertices += counts[i].vertices;
+		total.normals += counts[i].normals;
+		total.texcoords += counts[i].texcoords;
+		total.indices += counts[i].indices;
+	}
+	vertices.resize(total.vertices);
+	normals.resize(total.normals);
+	texcoords.resize(total.texcoords);
+	indices.resize(total.indices);
+
+	vector <string> errors(chunks);
+	parallelFor(chunks, [&](size_t i)
+	{
+		Counts pos = starts[i];
+		// Faces are written only to indices counted for this chunk
+		size_t indicesEnd = i + 1 < chunks ? starts[i + 1].indices : total.indices;
+		vector <VertexIndices> corners;
+		forEachLine(data + bounds[i], data + bounds[i + 1], [&](const char *p, const char *lineEnd)
+		{
+			if (!errors[i].empty())
+				return;
+
+			float x = 0.f, y = 0.f, z = 0.f;
+			switch (getStatement(p, lineEnd))
+			{
+			case Statement::Vertex:
+				if (!parseFloat(p, lineEnd, x) || !parseFloat(p, lineEnd, y) || !parseFloat(p, lineEnd, z))
+					errors[i] = "Malformed vertex";
+				vertices[pos.vertices++] = Vector3f(x, y, z);
+				break;
+			case Statement::Normal:
+				if (!parseFloat(p, lineEnd, x) || !parseFloat(p, lineEnd, y) || !parseFloat(p, lineEnd, z))
+					errors[i] = "Malformed normal";
+				normals[pos.normals++] = Vector3f(x, y, z);
+				break;
+			case Statement::Texcoord:
+				// Second coordinate is optional
+				if (!parseFloat(p, lineEnd, x))
+					errors[i] = "Malformed texture coordinates";
+				if (!parseFloat(p, lineEnd, y))
+					y = 0.f;
+				texcoords[pos.texcoords++] = Vector2f(x, y);
+				break;
+			case Statement::Face:
+				corners.clear();
+				for (skipSpaces(p, lineEnd); p < lineEnd && *p != '#'; skipSpaces(p, lineEnd))
+				{
+					VertexIndices corner;
+					if (!parseCorner(p, lineEnd, pos, corner))
+					{
+						errors[i] = "Malformed face or missing vertex";
+						return;
+					}
+					corners.push_back(corner);
+				}
+				if (corners.size() >= 3 && pos.indices + (corners.size() - 2) * 3 > indicesEnd)
+				{
+					errors[i] = "Malformed face";
+					return;
+				}
+				for (size_t c = 1; c + 1 < corners.size(); ++c)
+				{
+					indices[pos.indices++] = corners[0];
+					indices[pos.indices++] = corners[c];
+					indices[pos.indices++] = corners[c + 1];
+				}
+				break;
+			case Statement::None:
+				break;
+			}
+		});
+	});
+
+	for (const string &e : errors)
+	{
+		if (!e.empty())
+		{
+			error = e + " in " + filename;
+			return false;
+		}
+	}
+	return true;
+}
@@ -0,0 +1,23 @@
+#ifndef RAYTRACER_OBJ_LOADER_H_
+#define RAYTRACER_OBJ_LOADER_H_
+
+#include "vector.h"
+
+#include <string>
+#include <vector>
+
+// Zero-based indices of one corner of triangle, -1 if corner has no normal or texture coordinates
+struct VertexIndices {
+	int vertex_index;
+	int normal_index;
+	int texcoord_index;
+};
+
+// Read vertices, normals, texture coordinates and faces of OBJ file. File is mapped to memory
+// and parsed by several threads: the first pass counts elements of every chunk of lines, the
+// second one writes them directly to their place in output. Polygons are split into fans of
+// triangles, other statements (groups, materials, lines) are ignored
+bool loadObj(const std::string &filename, std::vector <Vector3f> &vertices, std::vector <Vector3f> &normals,
+	std::vector <Vector2f> &texcoords, std::vector <VertexIndices> &indices, std::string &error);
+
+#endif  // RAYTRACER_OBJ_LOADER_H_
@@ -4,9 +4,11 @@
 #include "ray.h"
 #include "material.h"
 #include "matrix.h"
+#include "motion.h"
 #include "vector.h"
+#include "mesh_optimizer.h"
+#include "obj_loader.h"
 
-#include "tiny_obj_loader.h"
 #ifndef LUA_BINDING_OFF
 #include "LuaBridge/RefCountedPtr.h"
 #endif
@@ -14,6 +16,9 @@
 #include <limits>
 #include <algorithm>
 #include <stack>
+#include <memory>
+#include <atomic>
+#include <mutex>
 #define _USE_MATH_DEFINES
 #include <math.h>
 
@@ -31,12 +36,7 @@ struct Intersection
 	Vector3f pos;		// Point of intersection
 	Vector3f normal;	// Surface normal in point of intersection
 	Vector2f tex;		// Texture coordinates
-};
-
-struct VertexIndices {
-	int vertex_index;
-	int normal_index;
-	int texcoord_index;
+	float footprint = 0.f;	// Width of ray cone on surface in texture coordinates
 };
 
 
@@ -139,7 +139,7 @@ public:
 	}
 
 	void addIndices(Axis axis, const std::vector <size_t>& indices,
-		const std::vector <VertexIndices>& vertexIndices, const std::vector <Vector3f>& vertices)
+		const std::vector <uint32_t>& vertexIndices, const std::vector <Vector3f>& vertices)
 	{
 		if (indices.size() <= 50)
 		{
@@ -165,9 +165,9 @@ public:
 		midTopExtended[static_cast<size_t>(axis)] += axisExtension;
 		for (size_t i = 0; i < indices.size(); ++i)
 		{
-			const Vector3f v1 = vertices[vertexIndices[indices[i]].vertex_index],
-				v2 = vertices[vertexIndices[indices[i] + 1].vertex_index],
-				v3 = vertices[vertexIndices[indices[i] + 2].vertex_index];
+			const Vector3f v1 = vertices[vertexIndices[indices[i]]],
+				v2 = vertices[vertexIndices[indices[i] + 1]],
+				v3 = vertices[vertexIndices[indices[i] + 2]];
 
 			if (VERTEX_IN_BOUNDS(v1, minExtended, midTopExtended) ||
 				VERTEX_IN_BOUNDS(v2, minExtended, midTopExtended) ||
@@ -189,6 +189,16 @@ public:
 		right->addIndices(Axis{ (static_cast<size_t>(axis) + 1) % 3 }, rightBoxIndices, vertexIndices, vertices);
 	}
 
+	Vector3f getMin() const
+	{
+		return min;
+	}
+
+	Vector3f getMax() const
+	{
+		return max;
+	}
+
 	// Expand box to cantain given point
 	void expand(const Vector3f& point)
 	{
@@ -299,14 +309,52 @@ public:
 };
 
 
+// Transform of object together with matrices derived from it
+struct ObjectTransform
+{
+	Matrix4f transform;
+	Matrix4f inverse;
+	Matrix4f inverseTranspose;
+};
+
+
 class Object
 {
 	bool changed;
+	bool moving;				// Object moves while shutter is open
+	MotionPath motion;			// Transforms at every step of exposure, empty if there is no motion blur
 
 protected:
-	Matrix4f transform;
-	Matrix4f inverseTransform;
-	Matrix4f inverseTransposeTransform;
+	ObjectTransform current;	// Transform at the moment shutter opens
+
+	// Transform at given moment of exposure. Moving objects interpolate keys of their path
+	// into temp, so inverse is calculated for every ray
+	const ObjectTransform & transformAt(float time, ObjectTransform &temp) const
+	{
+		if (!moving || time == 0.f)
+			return current;
+
+		temp.transform = motion.at(time);
+		temp.inverse = temp.transform.invert();
+		temp.inverseTranspose = temp.inverse.transpose();
+		return temp;
+	}
+
+	// Width of cone of original ray where it hits surface, in texture coordinates. Ray is hit at
+	// pos + dir * t in object space, texScale is change of texture coordinates per unit of
+	// distance along surface there. Cone is scaled to object space along direction of ray
+	static float getFootprint(const Ray &original, const Vector3f &dir, float t, const Vector3f &normal, float texScale)
+	{
+		if (original.width == 0.f && original.spread == 0.f)
+			return 0.f;
+
+		float originalLength = original.dir.length();
+		float dirLength = dir.length();
+		float width = (original.width + original.spread * t * originalLength) * dirLength / originalLength;
+		// Cone is stretched on surface that is hit at grazing angle
+		float cos = std::fabs(normal * dir) / (normal.length() * dirLength);
+		return width / std::max(cos, 0.05f) * texScale;
+	}
 
 public:
 #ifndef LUA_BINDING_OFF
@@ -318,9 +366,8 @@ public:
 	
 	Object(Material *mat, const Matrix4f &transform = Matrix4f(), const Matrix4f &inverse = Matrix4f()) :
 		changed(false),
-		transform(transform),
-		inverseTransform(inverse),
-		inverseTransposeTransform(inverse.transpose()),
+		moving(false),
+		current{ transform, inverse, inverse.transpose() },
 		material(mat)
 	{
 		
@@ -335,15 +382,86 @@ public:
 
 	virtual std::pair <bool, Intersection> intersection(const Ray &ray) = 0;
 
+	// Copy of object with its own transform and material, used for snapshots of scene
+	virtual Object * clone() const = 0;
+
+	// Bounding box in object space
+	virtual std::pair <Vector3f, Vector3f> getLocalBounds() const = 0;
+
+	// Bounding box in world space that contains object during whole exposure
+	std::pair <Vector3f, Vector3f> getBounds() const
+	{
+		auto [lo, hi] = getLocalBounds();
+		Vector3f resMin(std::numeric_limits <float>::max(), std::numeric_limits <float>::max(), std::numeric_limits <float>::max());
+		Vector3f resMax(-resMin);
+		// Keys are close in time, so box of every key is enough
+		for (size_t k = 0; k < (moving ? motion.size() : 1); ++k)
+		{
+			const Matrix4f &m = moving ? motion.getKey(k) : current.transform;
+			for (size_t i = 0; i < 8; ++i)
+			{
+				Vector3f corner((i & 1) ? hi[0] : lo[0], (i & 2) ? hi[1] : lo[1], (i & 4) ? hi[2] : lo[2]);
+				Vector3f p = m * corner;
+				for (size_t a = 0; a < 3; ++a)
+				{
+					resMin[a] = std::min(resMin[a], p[a]);
+					resMax[a] = std::max(resMax[a], p[a]);
+				}
+			}
+		}
+		return { resMin, resMax };
+	}
+
+	// Check if object has the same shape and position as other one
+	virtual bool sameShape(const Object &other) const
+	{
+		return current.transform == other.current.transform && moving == other.moving &&
+			(!moving || motion == other.motion);
+	}
+
+	// Check if object has the same shape, position and material as other one
+	bool sameAs(const Object &other) const
+	{
+#ifndef LUA_BINDING_OFF
+		const Material *otherMaterial = other.material.get();
+#else
+		const Material *otherMaterial = other.material;
+#endif
+		return sameShape(other) && material->sameAs(*otherMaterial);
+	}
+
 	Matrix4f getTransform() const
 	{
-		return transform;
+		return current.transform;
 	}
 
 	void setTransform(const Matrix4f &m)
 	{
 		changed = true;
-		transform = m;
+		current.transform = m;
+	}
+
+	// Copy transform into existing matrix, so script does not create new one
+	void getTransformTo(Matrix4f *out) const
+	{
+		*out = current.transform;
+	}
+
+	// Apply m after current transform
+	void applyTransform(const Matrix4f &m)
+	{
+		changed = true;
+		current.transform.preMultiply(m);
+	}
+
+	// Add transform at next step of exposure, current transform is the first key. Returns
+	// angle of rotation since previous key
+	float addMotionKey(const Matrix4f &m)
+	{
+		if (motion.size() == 0)
+			motion.addKey(current.transform);
+		moving = moving || m != current.transform;
+		return motion.addKey(m);
 	}
 	
 	// Update inverse of matrix if transform was changed
@@ -351,8 +469,8 @@ public:
 	{
 		if (changed)
 		{
-			inverseTransform = transform.invert();
-			inverseTransposeTransform = inverseTransform.transpose();
+			current.inverse = current.transform.invert();
+			current.inverseTranspose = current.inverse.transpose();
 			changed = false;
 		}
 	}
@@ -366,6 +484,14 @@ public:
 	{
 		material = mat;
 	}
+
+protected:
+	// Replace material shared with original object by its own copy
+	static Object * cloneWithMaterial(Object *copy)
+	{
+		copy->material = MaterialRef(copy->material->clone());
+		return copy;
+	}
 };
 
 
@@ -383,9 +509,11 @@ public:
 
 	virtual std::pair <bool, Intersection> intersection(const Ray &original)
 	{
-		const Vector3f pos = inverseTransform * original.pos;
+		ObjectTransform moved;
+		const ObjectTransform &m = transformAt(original.time, moved);
+		const Vector3f pos = m.inverse * original.pos;
 		// Expand dir to Vector4f with 0 as last element to ignore translation
-		const Vector3f dir = inverseTransform * Vector4f{original.dir, 0.f};
+		const Vector3f dir = m.inverse * Vector4f{original.dir, 0.f};
 
 		float dot = pos * dir;
 		float dirLen = dir.sqrLength();
@@ -411,14 +539,36 @@ public:
 
 		Vector3f inter = pos + dir * t;
 		
-		Vector3f normal = inverseTransposeTransform * Vector4f(inter, 0.f);
+		Vector3f normal = m.inverseTranspose * Vector4f(inter, 0.f);
 		normal.normalize();
 
 		float th = std::atan(inter[1] / inter[0]);
 		float ph = std::atan(inter[2] / r);
 		Vector2f tex(th / (2.f * static_cast<float>(M_PI)), (static_cast<float>(M_PI) - ph) / static_cast<float>(M_PI));
 
-		return { true, { transform * inter, normal, tex } };
+		// Derivatives of both texture coordinates along surface, texture is scaled by their geometric mean
+		float rho = std::max(std::sqrt(inter[0] * inter[0] + inter[1] * inter[1]), 0.001f * r);
+		float du = 1.f / (2.f * static_cast<float>(M_PI) * rho);
+		float dv = 1.f / (static_cast<float>(M_PI) * r * (1.f + inter[2] * inter[2] / (r * r)));
+		float footprint = getFootprint(original, dir, t, inter, std::sqrt(du * dv));
+
+		return { true, { m.transform * inter, normal, tex, footprint } };
+	}
+
+	virtual Object * clone() const
+	{
+		return cloneWithMaterial(new Sphere(*this));
+	}
+
+	virtual std::pair <Vector3f, Vector3f> getLocalBounds() const
+	{
+		return { Vector3f(-r, -r, -r), Vector3f(r, r, r) };
+	}
+
+	virtual bool sameShape(const Object &other) const
+	{
+		auto s = dynamic_cast <const Sphere *>(&other);
+		return s != nullptr && Object::sameShape(other) && r == s->r;
 	}
 
 	float getR() const
@@ -435,93 +585,128 @@ public:
 
 class Mesh : public Object
 {
-private:
-	std::vector <Vector3f> vertices;
-	std::vector <Vector3f> normals;
-	std::vector <Vector2f> texcoords;
-	std::vector <VertexIndices> indices;
+public:
+	// Geometry of mesh, shared by copies of mesh and never changed after loading
+	struct MeshData : IndexedMesh
+	{
+		MeshReport report;
 #if defined(BOUNDING_BOX) || defined(OBJECT_BOUNDING_TREE)
-	BoundingBox box;
+		BoundingBox box;
 #endif
+#ifdef OBJECT_BOUNDING_TREE
+		// Tree of lazy mesh is built by the first ray that reaches its bounds
+		bool lazy = false;
+		std::atomic <bool> treeBuilt{ false };
+		std::once_flag treeOnce;
 
-	template <size_t N>
-	static std::vector <Vector <float, N>> toVector(const std::vector <float> &vec)
-	{
-		std::vector <Vector <float, N>> res;
-		for (size_t i = 0; i < vec.size(); i += N)
+		void buildTree()
 		{
-			Vector <float, N> v;
-			std::copy(&vec[i], &vec[i] + N, v.data);
-			res.push_back(v);
+			std::call_once(treeOnce, [this]
+			{
+				std::vector <size_t> vertexIndices;
+				vertexIndices.reserve(indices.size() / 3);
+				for (size_t i = 0; i < indices.size(); i += 3)
+				{
+					vertexIndices.push_back(i);
+				}
+				box.addIndices(BoundingBox::Axis::X, vertexIndices, indices, vertices);
+				treeBuilt.store(true, std::memory_order_release);
+			});
 		}
-		return res;
-	}
+#endif // OBJECT_BOUNDING_TREE
+	};
 
-public:
+private:
+	std::shared_ptr <MeshData> data;
 
-	Mesh(const std::string &filename, Material *mat, const Matrix4f &transform = Matrix4f(), const Matrix4f &inverse = Matrix4f()) :
-		Object(mat, transform, inverse)
-#if defined(BOUNDING_BOX) || defined(OBJECT_BOUNDING_TREE)
-		//, box(new BoundingBox())
-#endif
+public:
+	// Parse OBJ file. It does not touch objects or materials, so several files can be loaded at once
+	static std::shared_ptr <MeshData> loadData(const std::string &filename, bool lazy = false)
 	{
-		//Load obj
-		std::string err;
-		std::string warn;
-		tinyobj::attrib_t attrib;
-		std::vector <tinyobj::shape_t> shapes;
-		std::vector <tinyobj::material_t> materials;
-		bool ret = tinyobj::LoadObj(&attrib, &shapes, &materials, &warn, &err, filename.c_str());
-
-		if (!err.empty())
-			std::cerr << err << std::endl;
-
-		if (!ret)
-			return;
+		auto data = std::make_shared <MeshData>();
 
-		// Reshape flat data into convenient format
-		vertices = toVector<3>(attrib.vertices);
-		normals = toVector<3>(attrib.normals);
-		texcoords = toVector<2>(attrib.texcoords);
-		for (size_t i = 0; i < shapes.size(); ++i)
+		std::vector <Vector3f> positions, normals;
+		std::vector <Vector2f> texcoords;
+		std::vector <VertexIndices> corners;
+		std::string err;
+		if (!loadObj(filename, positions, normals, texcoords, corners, err))
 		{
-			for (size_t j = 0; j < shapes[i].mesh.indices.size(); ++j)
-			{
-				indices.push_back(VertexIndices{
-					shapes[i].mesh.indices[j].vertex_index,
-					shapes[i].mesh.indices[j].normal_index,
-					shapes[i].mesh.indices[j].texcoord_index });
-			}
+			std::cerr << err << std::endl;
+			return data;
 		}
+		data->report = optimizeMesh(std::move(positions), std::move(normals), std::move(texcoords), std::move(corners), *data);
+
 #if defined(BOUNDING_BOX) || defined(OBJECT_BOUNDING_TREE)
-		for (size_t i = 0; i < indices.size(); ++i)
+		// Every vertex is used by some triangle after optimization
+		for (const Vector3f &v : data->vertices)
 		{
-			box.expand(vertices[indices[i].vertex_index]);
+			data->box.expand(v);
 		}
 #ifdef OBJECT_BOUNDING_TREE
-		std::vector <size_t> vertexIndices;
-		vertexIndices.reserve(indices.size() / 3);
-		for (size_t i = 0; i < indices.size(); i += 3)
-		{
-			vertexIndices.push_back(i);
-		}
-		box.addIndices(BoundingBox::Axis::X, vertexIndices, indices, vertices);
+		data->lazy = lazy;
+		if (!lazy)
+			data->buildTree();
 #endif // OBJECT_BOUNDING_TREE
 #endif // BOUNDING_BOX
+		return data;
+	}
+
+	Mesh(std::shared_ptr <MeshData> data, Material *mat, const Matrix4f &transform = Matrix4f(), const Matrix4f &inverse = Matrix4f()) :
+		Object(mat, transform, inverse),
+		data(data)
+	{
+
+	}
+
+	Mesh(const std::string &filename, Material *mat, const Matrix4f &transform = Matrix4f(), const Matrix4f &inverse = Matrix4f()) :
+		Mesh(loadData(filename), mat, transform, inverse)
+	{
+
 	}
 	
 	virtual ~Mesh()
 	{
+
+	}
+
+	virtual Object * clone() const
+	{
+		return cloneWithMaterial(new Mesh(*this));
+	}
+
+	virtual std::pair <Vector3f, Vector3f> getLocalBounds() const
+	{
 #if defined(BOUNDING_BOX) || defined(OBJECT_BOUNDING_TREE)
-		//delete box;
+		return { data->box.getMin(), data->box.getMax() };
+#else
+		BoundingBox box;
+		for (const Vector3f &v : data->vertices)
+			box.expand(v);
+		return { box.getMin(), box.getMax() };
 #endif
 	}
 
+	virtual bool sameShape(const Object &other) const
+	{
+		auto m = dynamic_cast <const Mesh *>(&other);
+		return m != nullptr && Object::sameShape(other) && data == m->data;
+	}
+
 	virtual std::pair <bool, Intersection> intersection(const Ray &original)
 	{
-		const Vector3f pos = inverseTransform * original.pos;
+		const std::vector <Vector3f> &vertices = data->vertices;
+		const std::vector <Vector3f> &normals = data->normals;
+		const std::vector <Vector2f> &texcoords = data->texcoords;
+		const std::vector <uint32_t> &indices = data->indices;
+#if defined(BOUNDING_BOX) || defined(OBJECT_BOUNDING_TREE)
+		BoundingBox &box = data->box;
+#endif
+
+		ObjectTransform moved;
+		const ObjectTransform &m = transformAt(original.time, moved);
+		const Vector3f pos = m.inverse * original.pos;
 		// Expand dir to Vector4f with 0 as last element to ignore translation
-		const Vector3f dir = inverseTransform * Vector4f{ original.dir, 0.f };
+		const Vector3f dir = m.inverse * Vector4f{ original.dir, 0.f };
 
 #ifdef BOUNDING_BOX
 #ifndef OBJECT_BOUNDING_TREE
@@ -532,6 +717,15 @@ public:
 #endif
 #endif // BOUNDING_BOX
 #ifdef OBJECT_BOUNDING_TREE
+		if (data->lazy && !data->treeBuilt.load(std::memory_order_acquire))
+		{
+			if (!box.intersects({ pos, dir }))
+				return { false, Intersection() };
+			data->buildTree();
+		}
+
+		// Tree is built in object space and ray is moved there at its own time,
+		// so bounds stay valid for moving objects
 		auto [possibleVertices, del] = box.traverse({ pos, dir });
 		if (possibleVertices->empty())
 		{
@@ -553,10 +747,10 @@ public:
 		{
 #endif
 		
-			const Vector3f &A = vertices[indices[i].vertex_index];
+			const Vector3f &A = vertices[indices[i]];
 
-			Vector3f E1 = vertices[indices[i + 1].vertex_index] - A;
-			Vector3f E2 = vertices[indices[i + 2].vertex_index] - A;
+			Vector3f E1 = vertices[indices[i + 1]] - A;
+			Vector3f E2 = vertices[indices[i + 2]] - A;
 			
 			Vector3f P = dir.cross(E2);
 			
@@ -600,17 +794,32 @@ public:
 			return { false, Intersection() };
 
 		Vector3f inter = pos + dir * t_min;
-		Vector3f normal = normals[indices[ind].normal_index] * (1.f - uf - vf) +
-			normals[indices[ind + 1].normal_index] * uf +
-			normals[indices[ind + 2].normal_index] * vf;
-		normal = inverseTransposeTransform * Vector4f(normal, 0.f);
+		Vector3f normal = normals[indices[ind]] * (1.f - uf - vf) +
+			normals[indices[ind + 1]] * uf +
+			normals[indices[ind + 2]] * vf;
+		normal = m.inverseTranspose * Vector4f(normal, 0.f);
 		normal.normalize();
 
-		Vector2f tex = (texcoords.size() != 0) ? (texcoords[indices[ind].texcoord_index] * (1.f - uf - vf) +
-			texcoords[indices[ind + 1].texcoord_index] * uf +
-			texcoords[indices[ind + 2].texcoord_index] * vf) : Vector2f();
+		Vector2f tex;
+		float footprint = 0.f;
+		if (texcoords.size() != 0)
+		{
+			const Vector2f &t0 = texcoords[indices[ind]];
+			const Vector2f &t1 = texcoords[indices[ind + 1]];
+			const Vector2f &t2 = texcoords[indices[ind + 2]];
+			tex = t0 * (1.f - uf - vf) + t1 * uf + t2 * vf;
+
+			// Texture is scaled by ratio of areas of triangle in texture and on surface
+			const Vector3f &A = vertices[indices[ind]];
+			Vector3f face = (vertices[indices[ind + 1]] - A).cross(vertices[indices[ind + 2]] - A);
+			Vector2f e1 = t1 - t0, e2 = t2 - t0;
+			float texArea = std::fabs(e1[0] * e2[1] - e1[1] * e2[0]);
+			float area = face.length();
+			if (area > 0.f)
+				footprint = getFootprint(original, dir, t_min, face, std::sqrt(texArea / area));
+		}
 
-		return { true, { transform * inter, normal, tex } };
+		return { true, { m.transform * inter, normal, tex, footprint } };
 	}
 };
 
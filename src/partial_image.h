@@ -0,0 +1,91 @@
+#ifndef RAYTRACER_PARTIAL_IMAGE_H_
+#define RAYTRACER_PARTIAL_IMAGE_H_
+
+#include "color.h"
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+// Part of bigger image stored as raw floats, so that image can be rendered
+// in pieces by independent processes and merged without loss of precision.
+// File layout: 8 byte signature, six 32 bit little-endian numbers
+// (full width, full height, x, y, width, height) and width * height RGB floats
+// row by row from the top
+struct PartialImage
+{
+	uint32_t fullWidth = 0;
+	uint32_t fullHeight = 0;
+	uint32_t x = 0;		// Position of top left corner in full image
+	uint32_t y = 0;
+	uint32_t width = 0;
+	uint32_t height = 0;
+	std::vector <float> data;
+
+	static constexpr char Signature[8] = { 'R', 'T', 'P', 'A', 'R', 'T', '1', '\n' };
+	static constexpr size_t HeaderSize = 8 + 6 * 4;
+
+	Color get(size_t px, size_t py) const
+	{
+		const float *p = &data[(py * width + px) * 3];
+		return Color(p[0], p[1], p[2]);
+	}
+
+	void set(size_t px, size_t py, const Color &c)
+	{
+		float *p = &data[(py * width + px) * 3];
+		p[0] = c[0];
+		p[1] = c[1];
+		p[2] = c[2];
+	}
+
+	static void putHeader(unsigned char *out, const uint32_t (&fields)[6])
+	{
+		std::memcpy(out, Signature, 8);
+		for (size_t i = 0; i < 6; ++i)
+		{
+			for (size_t b = 0; b < 4; ++b)
+				out[8 + i * 4 + b] = static_cast <unsigned char>(fields[i] >> (8 * b));
+		}
+	}
+
+	bool write(const std::string &filename) const
+	{
+		std::ofstream file(filename, std::ios::binary);
+		if (!file)
+			return false;
+
+		unsigned char header[HeaderSize];
+		putHeader(header, { fullWidth, fullHeight, x, y, width, height });
+		file.write(reinterpret_cast <const char *>(header), HeaderSize);
+		file.write(reinterpret_cast <const char *>(data.data()), data.size() * sizeof(float));
+		return bool(file);
+	}
+
+	bool read(const std::string &filename)
+	{
+		std::ifstream file(filename, std::ios::binary);
+		unsigned char header[HeaderSize];
+		if (!file.read(reinterpret_cast <char *>(header), HeaderSize) || std::memcmp(header, Signature, 8) != 0)
+			return false;
+
+		uint32_t *fields[6] = { &fullWidth, &fullHeight, &x, &y, &width, &height };
+		for (size_t i = 0; i < 6; ++i)
+		{
+			*fields[i] = 0;
+			for (size_t b = 0; b < 4; ++b)
+				*fields[i] |= static_cast <uint32_t>(header[8 + i * 4 + b]) << (8 * b);
+		}
+		// Checked without adding, so huge offsets of damaged file do not wrap around
+		if (width > fullWidth || x > fullWidth - width || height > fullHeight || y > fullHeight - height)
+			return false;
+
+		data.resize(static_cast <size_t>(width) * height * 3);
+		file.read(reinterpret_cast <char *>(data.data()), data.size() * sizeof(float));
+		return bool(file);
+	}
+};
+
+#endif  // RAYTRACER_PARTIAL_IMAGE_H_
@@ -0,0 +1,127 @@
+#ifndef RAYTRACER_PIPELINE_H_
+#define RAYTRACER_PIPELINE_H_
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Queue with limited capacity: push blocks while queue is full,
+// pop blocks while queue is empty and not closed
+template <typename T>
+class BoundedQueue
+{
+	std::deque <T> items;
+	size_t capacity;
+	bool closed = false;
+	std::mutex mutex;
+	std::condition_variable notFull;
+	std::condition_variable notEmpty;
+
+public:
+	explicit BoundedQueue(size_t capacity) :
+		capacity(std::max(capacity, static_cast <size_t>(1)))
+	{
+
+	}
+
+	void push(T item)
+	{
+		std::unique_lock <std::mutex> lock(mutex);
+		notFull.wait(lock, [this] { return items.size() < capacity; });
+		items.push_back(std::move(item));
+		notEmpty.notify_one();
+	}
+
+	// Returns false when queue is closed and all items were taken
+	bool pop(T &item)
+	{
+		std::unique_lock <std::mutex> lock(mutex);
+		notEmpty.wait(lock, [this] { return closed || !items.empty(); });
+		if (items.empty())
+			return false;
+
+		item = std::move(items.front());
+		items.pop_front();
+		notFull.notify_one();
+		return true;
+	}
+
+	void close()
+	{
+		std::lock_guard <std::mutex> lock(mutex);
+		closed = true;
+		notEmpty.notify_all();
+	}
+};
+
+// Threads that process jobs from bounded queue. Producer is blocked
+// when workers fall behind, so amount of pending jobs never grows
+template <typename Job>
+class WorkerPool
+{
+	BoundedQueue <Job> queue;
+	std::vector <std::thread> threads;
+
+public:
+	WorkerPool(size_t workers, size_t capacity, std::function <void(Job &)> work) :
+		queue(capacity)
+	{
+		for (size_t i = 0; i < std::max(workers, static_cast <size_t>(1)); ++i)
+		{
+			threads.emplace_back([this, work]()
+			{
+				Job job;
+				while (queue.pop(job))
+					work(job);
+			});
+		}
+	}
+
+	~WorkerPool()
+	{
+		finish();
+	}
+
+	void push(Job job)
+	{
+		queue.push(std::move(job));
+	}
+
+	// Process remaining jobs and stop threads
+	void finish()
+	{
+		queue.close();
+		for (std::thread &t : threads)
+		{
+			if (t.joinable())
+				t.join();
+		}
+	}
+};
+
+// Lets parallel jobs perform some step strictly in order of their tickets
+class Sequencer
+{
+	size_t next = 0;
+	std::mutex mutex;
+	std::condition_variable cond;
+
+public:
+	// Run f after steps of all previous tickets are done
+	template <typename F>
+	void run(size_t ticket, F &&f)
+	{
+		std::unique_lock <std::mutex> lock(mutex);
+		cond.wait(lock, [this, ticket] { return next == ticket; });
+		f();
+		++next;
+		cond.notify_all();
+	}
+};
+
+#endif  // RAYTRACER_PIPELINE_H_
@@ -0,0 +1,802 @@
+#include "png_writer.h"
+
+#include "lodepng.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <functional>
+#include <queue>
+#include <thread>
+
+using namespace std;
+
+// Strips are compressed independently, but matches of every strip may refer to the
+// end of previous strip, which decoder has already seen. Every strip except the last
+// one ends with empty stored block, so strips start at byte boundary and are simply
+// concatenated (the same as sync flush of zlib)
+
+static const size_t Bpp = 3;				// Bytes per pixel
+static const size_t StripBytes = 1 << 18;	// Smaller strips compress worse
+static const size_t Window = 32768;
+static const size_t MinMatch = 3;
+static const size_t MaxMatch = 258;
+static const size_t BlockSymbols = 1 << 15;
+static const size_t HashBits = 15;
+
+static const uint16_t LengthBase[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+	35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+static const uint8_t LengthExtra[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+	3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+static const uint16_t DistBase[30] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+	257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+static const uint8_t DistExtra[30] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+	7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+// Order in which lengths of code length codes are stored
+static const uint8_t ClenOrder[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+
+bool parsePngLevel(const string &name, PngLevel &level)
+{
+	if (name == "store")
+		level = PngLevel::Store;
+	else if (name == "rle")
+		level = PngLevel::Rle;
+	else if (name == "fast")
+		level = PngLevel::Fast;
+	else if (name == "default")
+		level = PngLevel::Default;
+	else if (name == "best")
+		level = PngLevel::Best;
+	else
+		return false;
+	return true;
+}
+
+// Deflate writes bits starting from the least significant one
+struct BitWriter
+{
+	vector <uint8_t> &out;
+	uint32_t bits = 0;
+	unsigned count = 0;
+
+	BitWriter(vector <uint8_t> &out) :
+		out(out)
+	{
+
+	}
+
+	// At most 16 bits at once
+	void put(uint32_t value, unsigned n)
+	{
+		bits |= value << count;
+		count += n;
+		while (count >= 8)
+		{
+			out.push_back(static_cast <uint8_t>(bits));
+			bits >>= 8;
+			count -= 8;
+		}
+	}
+
+	void align()
+	{
+		if (count != 0)
+			out.push_back(static_cast <uint8_t>(bits));
+		bits = 0;
+		count = 0;
+	}
+};
+
+// Literal byte if length is zero, otherwise match
+struct Symbol
+{
+	uint16_t length;
+	uint16_t value;		// Byte or distance
+};
+
+static size_t getLengthCode(size_t length)
+{
+	return upper_bound(LengthBase, LengthBase + 29, length) - LengthBase - 1;
+}
+
+static size_t getDistCode(size_t dist)
+{
+	return upper_bound(DistBase, DistBase + 30, dist) - DistBase - 1;
+}
+
+// Lengths of Huffman codes, no longer than maxBits. Frequencies are halved until tree fits
+static vector <uint8_t> buildLengths(const vector <uint32_t> &freq, unsigned maxBits)
+{
+	vector <uint8_t> lengths(freq.size(), 0);
+	vector <uint32_t> f = freq;
+	while (true)
+	{
+		// Leaves are nodes [0, n), parents are added after them
+		vector <int> parent;
+		vector <size_t> leaf;
+		priority_queue <pair <uint64_t, int>, vector <pair <uint64_t, int>>, greater <pair <uint64_t, int>>> queue;
+		for (size_t i = 0; i < f.size(); ++i)
+		{
+			if (f[i] == 0)
+				continue;
+			queue.push({ f[i], static_cast <int>(leaf.size()) });
+			leaf.push_back(i);
+			parent.push_back(-1);
+		}
+		if (leaf.size() == 1)
+			lengths[leaf[0]] = 1;
+		if (leaf.size() <= 1)
+			return lengths;
+
+		while (queue.size() > 1)
+		{
+			auto a = queue.top();
+			queue.pop();
+			auto b = queue.top();
+			queue.pop();
+			int node = static_cast <int>(parent.size());
+			parent.push_back(-1);
+			parent[a.second] = node;
+			parent[b.second] = node;
+			queue.push({ a.first + b.first, node });
+		}
+
+		// Parents have larger indices than children, so depths are found in reverse order
+		vector <unsigned> depth(parent.size(), 0);
+		unsigned maxDepth = 0;
+		for (size_t i = parent.size() - 1; i-- > 0; )
+			depth[i] = depth[parent[i]] + 1;
+		for (size_t i = 0; i < leaf.size(); ++i)
+			maxDepth = max(maxDepth, depth[i]);
+
+		if (maxDepth <= maxBits)
+		{
+			for (size_t i = 0; i < leaf.size(); ++i)
+				lengths[leaf[i]] = static_cast <uint8_t>(depth[i]);
+			return lengths;
+		}
+
+		for (uint32_t &v : f)
+		{
+			if (v != 0)
+				v = (v >> 1) | 1;
+		}
+	}
+}
+
+// Canonical codes with reversed bits, so they can be written starting from the lowest bit
+static vector <uint16_t> buildCodes(const vector <uint8_t> &lengths)
+{
+	uint16_t count[16] = {}, next[16] = {};
+	for (uint8_t len : lengths)
+		++count[len];
+	count[0] = 0;
+
+	uint16_t code = 0;
+	for (size_t bits = 1; bits < 16; ++bits)
+	{
+		code = static_cast <uint16_t>((code + count[bits - 1]) << 1);
+		next[bits] = code;
+	}
+
+	vector <uint16_t> codes(lengths.size(), 0);
+	for (size_t i = 0; i < lengths.size(); ++i)
+	{
+		unsigned len = lengths[i];
+		if (len == 0)
+			continue;
+		uint16_t c = next[len]++, reversed = 0;
+		for (unsigned b = 0; b < len; ++b)
+			reversed |= static_cast <uint16_t>(((c >> b) & 1) << (len - 1 - b));
+		codes[i] = reversed;
+	}
+	return codes;
+}
+
+// Huffman codes of one block together with description of them for dynamic block header
+struct BlockCodes
+{
+	vector <uint8_t> litLengths, distLengths;
+	vector <uint16_t> litCodes, distCodes;
+
+	size_t hlit = 0, hdist = 0, hclen = 0;
+	vector <uint8_t> clenLengths;
+	vector <uint16_t> clenCodes;
+	vector <pair <uint8_t, uint8_t>> lengthSymbols;	// Code length symbol and its extra bits
+
+	// Inflaters reject incomplete codes, code with one symbol of one bit is incomplete
+	static void atLeastTwoCodes(vector <uint32_t> &freq)
+	{
+		for (size_t i = 0; count_if(freq.begin(), freq.end(), [](uint32_t v) { return v != 0; }) < 2; ++i)
+			freq[i] = max(freq[i], 1u);
+	}
+
+	static BlockCodes fixed()
+	{
+		BlockCodes res;
+		res.litLengths.assign(288, 8);
+		fill(res.litLengths.begin() + 144, res.litLengths.begin() + 256, 9);
+		fill(res.litLengths.begin() + 256, res.litLengths.begin() + 280, 7);
+		res.distLengths.assign(30, 5);
+		res.litCodes = buildCodes(res.litLengths);
+		res.distCodes = buildCodes(res.distLengths);
+		return res;
+	}
+
+	static BlockCodes dynamic(vector <uint32_t> litFreq, vector <uint32_t> distFreq)
+	{
+		atLeastTwoCodes(litFreq);
+		atLeastTwoCodes(distFreq);
+
+		BlockCodes res;
+		res.litLengths = buildLengths(litFreq, 15);
+		res.distLengths = buildLengths(distFreq, 15);
+		res.litCodes = buildCodes(res.litLengths);
+		res.distCodes = buildCodes(res.distLengths);
+
+		res.hlit = 286;
+		while (res.hlit > 257 && res.litLengths[res.hlit - 1] == 0)
+			--res.hlit;
+		res.hdist = 30;
+		while (res.hdist > 1 && res.distLengths[res.hdist - 1] == 0)
+			--res.hdist;
+
+		// Lengths of both codes are stored as one sequence with runs replaced by symbols 16, 17 and 18
+		vector <uint8_t> all(res.litLengths.begin(), res.litLengths.begin() + res.hlit);
+		all.insert(all.end(), res.distLengths.begin(), res.distLengths.begin() + res.hdist);
+		for (size_t i = 0; i < all.size(); )
+		{
+			size_t run = 1;
+			while (i + run < all.size() && all[i + run] == all[i])
+				++run;
+
+			if (all[i] == 0 && run >= 3)
+			{
+				run = min(run, static_cast <size_t>(138));
+				if (run <= 10)
+					res.lengthSymbols.push_back({ 17, static_cast <uint8_t>(run - 3) });
+				else
+					res.lengthSymbols.push_back({ 18, static_cast <uint8_t>(run - 11) });
+			}
+			else if (run >= 4)
+			{
+				// Value itself, then repeats of previous value
+				run = min(run, static_cast <size_t>(7));
+				res.lengthSymbols.push_back({ all[i], 0 });
+				res.lengthSymbols.push_back({ 16, static_cast <uint8_t>(run - 4) });
+			}
+			else
+			{
+				run = 1;
+				res.lengthSymbols.push_back({ all[i], 0 });
+			}
+			i += run;
+		}
+
+		vector <uint32_t> clenFreq(19, 0);
+		for (const auto &s : res.lengthSymbols)
+			++clenFreq[s.first];
+		atLeastTwoCodes(clenFreq);
+		res.clenLengths = buildLengths(clenFreq, 7);
+		res.clenCodes = buildCodes(res.clenLengths);
+		res.hclen = 19;
+		while (res.hclen > 4 && res.clenLengths[ClenOrder[res.hclen - 1]] == 0)
+			--res.hclen;
+		return res;
+	}
+
+	static unsigned lengthExtraBits(uint8_t symbol)
+	{
+		return symbol == 16 ? 2 : symbol == 17 ? 3 : symbol == 18 ? 7 : 0;
+	}
+
+	size_t headerBits() const
+	{
+		size_t bits = 5 + 5 + 4 + 3 * hclen;
+		for (const auto &s : lengthSymbols)
+			bits += clenLengths[s.first] + lengthExtraBits(s.first);
+		return bits;
+	}
+
+	size_t dataBits(const vector <uint32_t> &litFreq, const vector <uint32_t> &distFreq) const
+	{
+		size_t bits = 0;
+		for (size_t i = 0; i < 286; ++i)
+			bits += static_cast <size_t>(litFreq[i]) * (litLengths[i] + (i > 256 ? LengthExtra[i - 257] : 0));
+		for (size_t i = 0; i < 30; ++i)
+			bits += static_cast <size_t>(distFreq[i]) * (distLengths[i] + DistExtra[i]);
+		return bits;
+	}
+
+	void writeHeader(BitWriter &out) const
+	{
+		out.put(static_cast <uint32_t>(hlit - 257), 5);
+		out.put(static_cast <uint32_t>(hdist - 1), 5);
+		out.put(static_cast <uint32_t>(hclen - 4), 4);
+		for (size_t i = 0; i < hclen; ++i)
+			out.put(clenLengths[ClenOrder[i]], 3);
+		for (const auto &s : lengthSymbols)
+		{
+			out.put(clenCodes[s.first], clenLengths[s.first]);
+			out.put(s.second, lengthExtraBits(s.first));
+		}
+	}
+
+	void writeSymbols(BitWriter &out, const Symbol *symbols, size_t count) const
+	{
+		for (size_t i = 0; i < count; ++i)
+		{
+			const Symbol &s = symbols[i];
+			if (s.length == 0)
+			{
+				out.put(litCodes[s.value], litLengths[s.value]);
+				continue;
+			}
+
+			size_t lc = getLengthCode(s.length);
+			out.put(litCodes[257 + lc], litLengths[257 + lc]);
+			out.put(s.length - LengthBase[lc], LengthExtra[lc]);
+			size_t dc = getDistCode(s.value);
+			out.put(distCodes[dc], distLengths[dc]);
+			out.put(s.value - DistBase[dc], DistExtra[dc]);
+		}
+		out.put(litCodes[256], litLengths[256]);
+	}
+};
+
+static void writeStored(BitWriter &out, const uint8_t *data, size_t size, bool final)
+{
+	do
+	{
+		size_t len = min(size, static_cast <size_t>(65535));
+		size -= len;
+		out.put(final && size == 0, 1);
+		out.put(0, 2);
+		out.align();
+		out.out.push_back(static_cast <uint8_t>(len));
+		out.out.push_back(static_cast <uint8_t>(len >> 8));
+		out.out.push_back(static_cast <uint8_t>(~len));
+		out.out.push_back(static_cast <uint8_t>(~len >> 8));
+		out.out.insert(out.out.end(), data, data + len);
+		data += len;
+	} while (size != 0);
+}
+
+// Write symbols of data [begin, end) as block of the smallest type
+static void writeBlock(BitWriter &out, const vector <Symbol> &symbols, const uint8_t *begin, const uint8_t *end, bool final)
+{
+	vector <uint32_t> litFreq(286, 0), distFreq(30, 0);
+	for (const Symbol &s : symbols)
+	{
+		if (s.length == 0)
+			++litFreq[s.value];
+		else
+		{
+			++litFreq[257 + getLengthCode(s.length)];
+			++distFreq[getDistCode(s.value)];
+		}
+	}
+	litFreq[256] = 1;
+
+	BlockCodes dynamic = BlockCodes::dynamic(litFreq, distFreq);
+	BlockCodes fixed = BlockCodes::fixed();
+	size_t dynamicBits = dynamic.headerBits() + dynamic.dataBits(litFreq, distFreq);
+	size_t fixedBits = fixed.dataBits(litFreq, distFreq);
+	size_t storedBits = (end - begin + 5 * ((end - begin) / 65535 + 1)) * 8;
+
+	if (storedBits < dynamicBits && storedBits < fixedBits)
+	{
+		writeStored(out, begin, end - begin, final);
+		return;
+	}
+
+	out.put(final, 1);
+	if (fixedBits <= dynamicBits)
+	{
+		out.put(1, 2);
+		fixed.writeSymbols(out, symbols.data(), symbols.size());
+	}
+	else
+	{
+		out.put(2, 2);
+		dynamic.writeHeader(out);
+		dynamic.writeSymbols(out, symbols.data(), symbols.size());
+	}
+}
+
+struct MatchSettings
+{
+	size_t chain;	// Amount of earlier positions with the same hash that are compared
+	size_t nice;	// Match of this length is not improved
+	bool lazy;		// Literal is emitted if next position has longer match
+};
+
+// Matches among previous positions with the same hash of first three bytes
+class MatchFinder
+{
+	const uint8_t *data;
+	size_t size;
+	vector <int32_t> head;
+	vector <int32_t> prev;
+	MatchSettings settings;
+
+	size_t hash(size_t pos) const
+	{
+		uint32_t v = data[pos] | (data[pos + 1] << 8) | (data[pos + 2] << 16);
+		return (v * 2654435761u) >> (32 - HashBits);
+	}
+
+public:
+	MatchFinder(const uint8_t *data, size_t size, const MatchSettings &settings) :
+		data(data), size(size), head(size_t(1) << HashBits, -1), prev(size, -1), settings(settings)
+	{
+
+	}
+
+	void insert(size_t pos)
+	{
+		if (pos + MinMatch > size)
+			return;
+		size_t h = hash(pos);
+		prev[pos] = head[h];
+		head[h] = static_cast <int32_t>(pos);
+	}
+
+	// Length of the longest match found, zero if there is no match
+	size_t find(size_t pos, size_t &dist) const
+	{
+		if (pos + MinMatch > size)
+			return 0;
+
+		size_t maxLen = min(MaxMatch, size - pos);
+		size_t best = 0;
+		size_t chain = settings.chain;
+		for (int32_t cand = head[hash(pos)]; cand >= 0 && pos - cand <= Window && chain-- > 0; cand = prev[cand])
+		{
+			const uint8_t *a = data + pos, *b = data + cand;
+			if (b[best] != a[best])
+				continue;
+			size_t len = 0;
+			while (len < maxLen && a[len] == b[len])
+				++len;
+			if (len > best)
+			{
+				best = len;
+				dist = pos - cand;
+				if (len >= settings.nice || len == maxLen)
+					break;
+			}
+		}
+		return best >= MinMatch ? best : 0;
+	}
+};
+
+// Runs of the same pixel or byte, found without hashing
+static size_t findRun(const uint8_t *data, size_t size, size_t pos, size_t &dist)
+{
+	size_t maxLen = min(MaxMatch, size - pos);
+	size_t best = 0;
+	for (size_t d : { static_cast <size_t>(1), Bpp })
+	{
+		if (pos < d)
+			continue;
+		size_t len = 0;
+		while (len < maxLen && data[pos + len] == data[pos + len - d])
+			++len;
+		if (len > best)
+		{
+			best = len;
+			dist = d;
+		}
+	}
+	return best >= MinMatch ? best : 0;
+}
+
+// Compress data [start, size). Data before start is already known to decoder and is used as dictionary
+static void deflateStrip(const uint8_t *data, size_t start, size_t size, PngLevel level, bool final, vector <uint8_t> &res)
+{
+	BitWriter out(res);
+	if (level == PngLevel::Store)
+	{
+		writeStored(out, data + start, size - start, final);
+		return;
+	}
+
+	// Only one window before strip can be referred to
+	size_t base = start > Window ? start - Window : 0;
+	data += base;
+	start -= base;
+	size -= base;
+
+	bool rle = level == PngLevel::Rle;
+	MatchSettings settings = level == PngLevel::Fast ? MatchSettings{ 4, 16, false } :
+		level == PngLevel::Best ? MatchSettings{ 256, MaxMatch, true } : MatchSettings{ 32, 128, !rle };
+	MatchFinder finder(data, rle ? 0 : size, settings);
+	for (size_t pos = 0; pos < start && !rle; ++pos)
+		finder.insert(pos);
+
+	auto findMatch = [&](size_t pos, size_t &dist)
+	{
+		return rle ? findRun(data, size, pos, dist) : finder.find(pos, dist);
+	};
+
+	vector <Symbol> symbols;
+	symbols.reserve(BlockSymbols);
+	size_t blockStart = start;
+	size_t pos = start;
+	size_t nextLen = 0, nextDist = 0;
+	bool haveNext = false;
+	while (pos < size)
+	{
+		size_t dist = 0;
+		size_t len = haveNext ? nextLen : findMatch(pos, dist);
+		if (haveNext)
+			dist = nextDist;
+		haveNext = false;
+		finder.insert(pos);
+
+		if (len != 0 && settings.lazy && len < settings.nice && pos + 1 < size)
+		{
+			nextLen = findMatch(pos + 1, nextDist);
+			if (nextLen > len)
+			{
+				symbols.push_back({ 0, data[pos] });
+				haveNext = true;
+				len = 0;
+			}
+		}
+
+		if (len != 0)
+		{
+			symbols.push_back({ static_cast <uint16_t>(len), static_cast <uint16_t>(dist) });
+			for (size_t i = 1; i < len; ++i)
+				finder.insert(pos + i);
+			pos += len;
+		}
+		else
+		{
+			if (!haveNext)
+				symbols.push_back({ 0, data[pos] });
+			++pos;
+		}
+
+		// Match that was found for next position is kept together with it in the same block
+		if (symbols.size() >= BlockSymbols && !haveNext)
+		{
+			writeBlock(out, symbols, data + blockStart, data + pos, final && pos == size);
+			symbols.clear();
+			blockStart = pos;
+		}
+	}
+	if (!symbols.empty() || blockStart == start)
+		writeBlock(out, symbols, data + blockStart, data + pos, final);
+
+	// Empty stored block ends strip at byte boundary
+	if (!final)
+		writeStored(out, nullptr, 0, false);
+	out.align();
+}
+
+static uint8_t paeth(int a, int b, int c)
+{
+	int p = a + b - c;
+	int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+	if (pa <= pb && pa <= pc)
+		return static_cast <uint8_t>(a);
+	return static_cast <uint8_t>(pb <= pc ? b : c);
+}
+
+// Filter row into out, first byte is type of filter. Filter is chosen by minimal sum of
+// absolute values of filtered bytes, the usual heuristic of PNG encoders
+static void filterRow(const uint8_t *row, const uint8_t *prev, size_t size, bool adaptive, uint8_t *out, vector <uint8_t> &scratch)
+{
+	if (!adaptive)
+	{
+		out[0] = 0;
+		copy(row, row + size, out + 1);
+		return;
+	}
+
+	// First row is predicted from row of zeros
+	scratch.assign(size * 6, 0);
+	if (prev == nullptr)
+		prev = &scratch[size * 5];
+
+	uint8_t *f = scratch.data();
+	for (size_t i = 0; i < size; ++i)
+	{
+		int a = i >= Bpp ? row[i - Bpp] : 0;
+		int b = prev[i];
+		int c = i >= Bpp ? prev[i - Bpp] : 0;
+		f[i] = row[i];
+		f[size + i] = static_cast <uint8_t>(row[i] - a);
+		f[2 * size + i] = static_cast <uint8_t>(row[i] - b);
+		f[3 * size + i] = static_cast <uint8_t>(row[i] - (a + b) / 2);
+		f[4 * size + i] = static_cast <uint8_t>(row[i] - paeth(a, b, c));
+	}
+
+	size_t bestSum = SIZE_MAX, bestType = 0;
+	for (size_t type = 0; type < 5; ++type)
+	{
+		size_t sum = 0;
+		for (size_t i = type * size; i < (type + 1) * size; ++i)
+			sum += f[i] < 128 ? f[i] : 256 - f[i];
+		if (sum < bestSum)
+		{
+			bestSum = sum;
+			bestType = type;
+		}
+	}
+	out[0] = static_cast <uint8_t>(bestType);
+	copy(&scratch[bestType * size], &scratch[bestType * size] + size, out + 1);
+}
+
+static uint32_t adler32(const uint8_t *data, size_t size)
+{
+	uint32_t a = 1, b = 0;
+	while (size != 0)
+	{
+		// Sums do not overflow during 5552 bytes
+		size_t n = min(size, static_cast <size_t>(5552));
+		size -= n;
+		for (size_t i = 0; i < n; ++i)
+		{
+			a += data[i];
+			b += a;
+		}
+		data += n;
+		a %= 65521;
+		b %= 65521;
+	}
+	return (b << 16) | a;
+}
+
+// Checksum of two parts from checksums of parts
+static uint32_t combineAdler32(uint32_t first, uint32_t second, size_t secondSize)
+{
+	const uint32_t Base = 65521;
+	uint32_t rem = static_cast <uint32_t>(secondSize % Base);
+	uint32_t sum1 = first & 0xffff;
+	uint32_t sum2 = (rem * sum1) % Base;
+	sum1 += (second & 0xffff) + Base - 1;
+	sum2 += ((first >> 16) & 0xffff) + ((second >> 16) & 0xffff) + Base - rem;
+	if (sum1 >= Base)
+		sum1 -= Base;
+	if (sum1 >= Base)
+		sum1 -= Base;
+	if (sum2 >= (Base << 1))
+		sum2 -= (Base << 1);
+	if (sum2 >= Base)
+		sum2 -= Base;
+	return sum1 | (sum2 << 16);
+}
+
+static void putBigEndian(vector <uint8_t> &out, uint32_t v)
+{
+	for (int shift = 24; shift >= 0; shift -= 8)
+		out.push_back(static_cast <uint8_t>(v >> shift));
+}
+
+static void addChunk(vector <uint8_t> &out, const char *type, const uint8_t *data, size_t size)
+{
+	putBigEndian(out, static_cast <uint32_t>(size));
+	size_t start = out.size();
+	out.insert(out.end(), type, type + 4);
+	out.insert(out.end(), data, data + size);
+	putBigEndian(out, lodepng_crc32(&out[start], size + 4));
+}
+
+// Run task(i) for i in [0, count) on all cores
+static void parallelFor(size_t count, const function <void(size_t)> &task)
+{
+	size_t threads = min(static_cast <size_t>(max(thread::hardware_concurrency(), 1u)), count);
+	atomic <size_t> next(0);
+	auto worker = [&]()
+	{
+		for (size_t i = next++; i < count; i = next++)
+			task(i);
+	};
+
+	vector <thread> pool;
+	for (size_t i = 1; i < threads; ++i)
+		pool.emplace_back(worker);
+	worker();
+	for (thread &t : pool)
+		t.join();
+}
+
+PngWriter::PngWriter(size_t width, size_t height, PngLevel level) :
+	width(width), height(height), level(level)
+{
+	output = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+	vector <uint8_t> header;
+	putBigEndian(header, static_cast <uint32_t>(width));
+	putBigEndian(header, static_cast <uint32_t>(height));
+	header.insert(header.end(), { 8, 2, 0, 0, 0 });	// 8 bit RGB, no interlacing
+	addChunk(output, "IHDR", header.data(), header.size());
+}
+
+void PngWriter::addRows(const unsigned char *rgb, size_t count)
+{
+	count = min(count, height - rows);
+	if (count == 0)
+		return;
+
+	size_t rowSize = width * Bpp;
+	size_t lineSize = rowSize + 1;
+	size_t rowsPerStrip = max(StripBytes / lineSize, static_cast <size_t>(1));
+	size_t strips = (count + rowsPerStrip - 1) / rowsPerStrip;
+	bool final = rows + count == height;
+
+	// Filtered rows follow the end of previous band, so matches can refer to it.
+	// Rows are filtered first, every strip needs filtered end of previous one as dictionary
+	size_t start = window.size();
+	vector <uint8_t> filtered(start + lineSize * count);
+	copy(window.begin(), window.end(), filtered.begin());
+	vector <uint32_t> checksums(strips);
+	parallelFor(strips, [&](size_t s)
+	{
+		vector <uint8_t> scratch;
+		size_t y1 = min((s + 1) * rowsPerStrip, count);
+		for (size_t y = s * rowsPerStrip; y < y1; ++y)
+		{
+			const uint8_t *prev = y > 0 ? rgb + (y - 1) * rowSize : rows > 0 ? lastRow.data() : nullptr;
+			filterRow(rgb + y * rowSize, prev, rowSize, level != PngLevel::Store, &filtered[start + y * lineSize], scratch);
+		}
+		size_t begin = start + s * rowsPerStrip * lineSize;
+		checksums[s] = adler32(&filtered[begin], start + y1 * lineSize - begin);
+	});
+
+	vector <vector <uint8_t>> compressed(strips);
+	parallelFor(strips, [&](size_t s)
+	{
+		size_t begin = start + s * rowsPerStrip * lineSize;
+		size_t end = start + min((s + 1) * rowsPerStrip, count) * lineSize;
+		deflateStrip(filtered.data(), begin, end, level, final && s + 1 == strips, compressed[s]);
+	});
+
+	// Zlib stream is split between IDAT chunks of bands
+	vector <uint8_t> zlib;
+	if (rows == 0)
+	{
+		// Compression level is only a hint for decoders
+		uint8_t cmf = 0x78;
+		uint8_t flg = static_cast <uint8_t>(level == PngLevel::Store || level == PngLevel::Rle ? 0 :
+			level == PngLevel::Fast ? 1 : level == PngLevel::Default ? 2 : 3) << 6;
+		flg = static_cast <uint8_t>(flg + (31 - (cmf * 256 + flg) % 31) % 31);
+		zlib.push_back(cmf);
+		zlib.push_back(flg);
+	}
+	for (size_t s = 0; s < strips; ++s)
+	{
+		zlib.insert(zlib.end(), compressed[s].begin(), compressed[s].end());
+		vector <uint8_t>().swap(compressed[s]);
+		size_t size = (min((s + 1) * rowsPerStrip, count) - s * rowsPerStrip) * lineSize;
+		checksum = combineAdler32(checksum, checksums[s], size);
+	}
+	if (final)
+		putBigEndian(zlib, checksum);
+
+	const size_t MaxChunk = size_t(1) << 30;
+	for (size_t pos = 0; pos < zlib.size(); pos += MaxChunk)
+		addChunk(output, "IDAT", &zlib[pos], min(MaxChunk, zlib.size() - pos));
+	if (final)
+		addChunk(output, "IEND", nullptr, 0);
+
+	rows += count;
+	lastRow.assign(rgb + (count - 1) * rowSize, rgb + count * rowSize);
+	window.assign(filtered.end() - min(Window, filtered.size()), filtered.end());
+}
+
+bool PngWriter::finished() const
+{
+	return rows == height;
+}
+
+vector <unsigned char> encodePng(const unsigned char *rgb, size_t width, size_t height, PngLevel level)
+{
+	PngWriter png(width, height, level);
+	png.addRows(rgb, height);
+	return move(png.output);
+}
@@ -0,0 +1,45 @@
+#ifndef RAYTRACER_PNG_WRITER_H_
+#define RAYTRACER_PNG_WRITER_H_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Compression effort of saved images
+enum class PngLevel
+{
+	Store,		// No compression, for intermediate frames that are encoded again
+	Rle,		// Only runs of repeated pixels are compressed
+	Fast,
+	Default,
+	Best
+};
+
+bool parsePngLevel(const std::string &name, PngLevel &level);
+
+// Encoder of image that is given in bands of rows from the top. Every band is compressed
+// at once and appended to output, so file can be written before whole image is ready
+class PngWriter
+{
+	size_t width, height;
+	PngLevel level;
+	size_t rows = 0;						// Rows that are already encoded
+	uint32_t checksum = 1;					// Adler-32 of filtered rows
+	std::vector <unsigned char> lastRow;	// Filters of next band refer to it
+	std::vector <unsigned char> window;		// End of filtered data, matches of next band refer to it
+
+public:
+	std::vector <unsigned char> output;		// Encoded data, can be taken after every band
+
+	PngWriter(size_t width, size_t height, PngLevel level);
+
+	// Add 8 bit RGB rows. After the last row of image output contains the end of file
+	void addRows(const unsigned char *rgb, size_t count);
+	bool finished() const;
+};
+
+// Encode 8 bit RGB pixels, row by row from the top, as PNG. Horizontal strips of image
+// are filtered and compressed by several threads and joined into one deflate stream
+std::vector <unsigned char> encodePng(const unsigned char *rgb, size_t width, size_t height, PngLevel level);
+
+#endif  // RAYTRACER_PNG_WRITER_H_
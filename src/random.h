@@ -0,0 +1,53 @@
+#ifndef RAYTRACER_RANDOM_H_
+#define RAYTRACER_RANDOM_H_
+
+#include <cstdint>
+
+// PCG hash: one step of 32 bit permuted congruential generator used as integer hash
+// (Jarzynski, Olano "Hash Functions for GPU Rendering")
+inline uint32_t pcgHash(uint32_t v)
+{
+	uint32_t state = v * 747796405u + 2891336453u;
+	uint32_t word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+	return (word >> 22u) ^ word;
+}
+
+// Map 32 random bits to float in range [0, 1)
+inline float toUnitFloat(uint32_t v)
+{
+	return static_cast <float>(v >> 8) * (1.f / 16777216.f);
+}
+
+// Stateless counter-based random number generator.
+// Every number is a pure function of (seed, frame, pixel, sample, dimension),
+// so result does not depend on which thread renders pixel or in which order
+class RandomSequence
+{
+	uint32_t key;
+
+public:
+	// Key shared by all pixels of one frame
+	static uint32_t frameKey(uint32_t seed, uint32_t frame)
+	{
+		return pcgHash(seed ^ pcgHash(frame));
+	}
+
+	RandomSequence(uint32_t frameKey, uint32_t pixel) :
+		key(pcgHash(frameKey ^ pcgHash(pixel)))
+	{
+
+	}
+
+	uint32_t getBits(uint32_t sample, uint32_t dimension) const
+	{
+		return pcgHash(key ^ pcgHash(sample ^ pcgHash(dimension)));
+	}
+
+	// Random number in range [0, 1)
+	float get(uint32_t sample, uint32_t dimension) const
+	{
+		return toUnitFloat(getBits(sample, dimension));
+	}
+};
+
+#endif  // RAYTRACER_RANDOM_H_
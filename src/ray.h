@@ -7,17 +7,31 @@ struct Ray
 {
 	Vector3f pos;
 	Vector3f dir;
+	float time = 0.f;	// Moment of exposure in [0, 1), used for motion blur
+	// Ray cone: width of area covered by ray at its origin and growth of width per unit
+	// of distance. It chooses detail of textures, curvature of surfaces is ignored
+	float width = 0.f;
+	float spread = 0.f;
 
-	Ray(const Vector3f &pos, const Vector3f &dir) :
-		pos(pos), dir(dir)
+	Ray() {}
+
+	Ray(const Vector3f &pos, const Vector3f &dir, float time = 0.f) :
+		pos(pos), dir(dir), time(time)
 	{
 
 	}
 
+	// Width of cone at point of ray
+	float getWidth(const Vector3f &point) const
+	{
+		return width + spread * (point - pos).length();
+	}
+
+	// Reflected and refracted rays continue cone of this ray from point where it hit surface
 	Ray reflect(const Vector3f &pos, const Vector3f &surfaceNormal, float offset = 0.f) const
 	{
 		Vector3f d = dir.reflect(surfaceNormal);
-		return Ray(pos + surfaceNormal * offset, d);
+		return continueCone(pos, Ray(pos + surfaceNormal * offset, d, time));
 	}
 
 	std::tuple <Ray, bool, bool> refract(const Vector3f &pos, const Vector3f &normal, float iof1, float iof2, float offset = 0.f) const
@@ -25,16 +39,26 @@ struct Ray
 		auto [d, refracted, negated] = dir.refract(normal, iof1, iof2);
 		if (negated)
 		{
-			return { Ray(pos + normal * (refracted ? offset : -offset), d), refracted, negated };
+			return { continueCone(pos, Ray(pos + normal * (refracted ? offset : -offset), d, time)), refracted, negated };
 		}
 		else
 		{
-			return { Ray(pos + normal * (refracted ? -offset : offset), d), refracted, negated };
+			return { continueCone(pos, Ray(pos + normal * (refracted ? -offset : offset), d, time)), refracted, negated };
 		}
 
 		//return { Ray(pos + d * offset, d), refracted, negated };
 	}
 
+private:
+	Ray continueCone(const Vector3f &hit, Ray next) const
+	{
+		if (spread != 0.f || width != 0.f)
+		{
+			next.width = getWidth(hit);
+			next.spread = spread;
+		}
+		return next;
+	}
 };
 
 #endif  // RAYTRACER_RAY_H_
@@ -1,5 +1,10 @@
 #include "scene.h"
 #include "color.h"
+#include "partial_image.h"
+#include "pipeline.h"
+#include "manifest.h"
+#include "png_writer.h"
+#include "float_image.h"
 
 #include "lua.hpp"
 #include "LuaBridge/LuaBridge.h"
@@ -9,6 +14,8 @@
 #include "cxxopts.hpp"
 
 #include <iostream>
+#include <fstream>
+#include <cstdio>
 #include <vector>
 #include <algorithm>
 #define _USE_MATH_DEFINES
@@ -16,9 +23,16 @@
 #include <chrono>
 #include <future>
 #include <map>
+#include <set>
+#include <deque>
+#include <optional>
+#include <csignal>
+#include <thread>
+#include <atomic>
 #ifndef _MSC_VER
 #include <unistd.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 #include <poll.h>
 #endif
 
@@ -42,12 +56,19 @@
 #define mkdir(T) mkdir((T), S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH)
 #endif
 
-#define ADD_LUA_VAR(L, space, var) auto * CAT(__pointer_, var) = &(var); \
-	getGlobalNamespace(L).beginNamespace(space).addVariable(#var, &CAT(__pointer_, var)).endNamespace()
-
 using namespace std;
 using namespace luabridge;
 
+// Set by SIGINT and SIGTERM, animation stops after frames that are already rendering
+volatile sig_atomic_t stopRequested = 0;
+
+void requestStop(int sig)
+{
+	stopRequested = 1;
+	// Second signal terminates immediately
+	signal(sig, SIG_DFL);
+}
+
 // Clamp value in range [0, 1]
 float clamp(float val)
 {
@@ -63,61 +84,293 @@ unsigned char convertToChar(float val)
 	return static_cast <unsigned char>(val);
 }
 
-vector <unsigned char> flattenImageData(const vector <vector <Color>>& data, size_t width, size_t height)
+// 8 bit RGB pixels row by row from the top
+vector <unsigned char> flattenImageData(const Framebuffer &data)
 {
+	size_t width = data.width(), height = data.height();
 	vector <unsigned char> flatData(width * height * 3);
 
+	if (data.getLayout() == Framebuffer::Layout::RGB)
+	{
+		// Framebuffer has the same order of values
+		const float *in = data.data();
+		for (size_t i = 0; i < flatData.size(); ++i)
+			flatData[i] = convertToChar(in[i]);
+		return flatData;
+	}
+
 	for (size_t y = 0; y < height; ++y)
 	{
 		for (size_t x = 0; x < width; ++x)
 		{
-			flatData[(y * width + x) * 3 + 0] = convertToChar(data[x][y][0]);
-			flatData[(y * width + x) * 3 + 1] = convertToChar(data[x][y][1]);
-			flatData[(y * width + x) * 3 + 2] = convertToChar(data[x][y][2]);
+			Color c = data.get(x, y);
+			for (size_t i = 0; i < 3; ++i)
+				flatData[(y * width + x) * 3 + i] = convertToChar(c[i]);
 		}
 	}
 	return flatData;
 }
 
-//Write image to disk
-unsigned int writeImage(const vector <vector <Color>> &data, const string &filename)
+// Encode image as png in memory
+vector <unsigned char> encodeImage(const Framebuffer &data, PngLevel level = PngLevel::Default)
 {
-	size_t width = data.size();
-	if (data.size() == 0)
+	if (data.empty())
+		return {};
+
+	vector <unsigned char> flatData = flattenImageData(data);
+	return encodePng(flatData.data(), data.width(), data.height(), level);
+}
+
+//Write image to disk, format is given by extension of file
+unsigned int writeImage(const Framebuffer &data, const string &filename, PngLevel level = PngLevel::Default)
+{
+	if (data.empty())
 		return 1;
-	size_t height = data[0].size();
 
-	vector <unsigned char> flatData = flattenImageData(data, width, height);
+	// Float formats are written from framebuffer without clamping
+	ImageFormat format = getImageFormat(filename);
+	if (format == ImageFormat::Pfm)
+		return writePfm(data, filename) ? 0 : 1;
+	if (format == ImageFormat::Exr)
+		return writeExr(data, filename) ? 0 : 1;
+	return lodepng::save_file(encodeImage(data, level), filename);
+}
+
+// Output file of scene, with extension of --format if it is given
+string getOutputImageName(const Scene &scene, const cxxopts::ParseResult &opts)
+{
+	string output = scene.getOutputFile();
+	if (opts.count("format") == 0)
+		return output;
+
+	ImageFormat format;
+	if (!parseImageFormat(opts["format"].as <string>(), format))
+	{
+		cerr << "Unknown image format " << opts["format"].as <string>() << ", using " << output << endl;
+		return output;
+	}
+	return replaceExtension(output, format);
+}
 
-	return lodepng::encode(filename, flatData, width, height, LodePNGColorType::LCT_RGB);
+PngLevel getPngLevel(const cxxopts::ParseResult &opts)
+{
+	PngLevel level = PngLevel::Default;
+	if (!parsePngLevel(opts["png-level"].as <string>(), level))
+		cerr << "Unknown png level " << opts["png-level"].as <string>() << ", using default\n";
+	return level;
 }
 
-// Wirte image to FILE
-unsigned int writeToFile(const vector <vector <Color>> &data, FILE *file)
+// Format of frames sent to ffmpeg
+enum class PipeFormat
 {
-	size_t width = data.size();
-	if (width == 0)
-		return 1;
-	size_t height = data[0].size();
+	Png,	// Compressed images, ffmpeg has to decode them again
+	Rgb24,	// Raw 8 bit RGB pixels
+	Float	// Raw 32 bit float RGB pixels without clamping
+};
+
+bool parsePipeFormat(const string &name, PipeFormat &format)
+{
+	if (name == "png")
+		format = PipeFormat::Png;
+	else if (name == "rgb24")
+		format = PipeFormat::Rgb24;
+	else if (name == "float")
+		format = PipeFormat::Float;
+	else
+		return false;
+	return true;
+}
+
+// Arguments that describe input of ffmpeg
+string getPipeInputArgs(PipeFormat format, size_t width, size_t height)
+{
+	if (format == PipeFormat::Png)
+		return " -f image2pipe";
 
-	vector <unsigned char> flatData = flattenImageData(data, width, height);
+	string res = " -f rawvideo -pix_fmt ";
+	res += (format == PipeFormat::Rgb24) ? "rgb24" : "rgbf32le";
+	res += " -s " + to_string(width) + "x" + to_string(height);
+	return res;
+}
+
+// Float frames in RGB layout are sent to pipe without conversion
+bool isRawFrame(const Framebuffer &data, PipeFormat format)
+{
+	return format == PipeFormat::Float && data.getLayout() == Framebuffer::Layout::RGB;
+}
+
+// Convert frame to bytes in given format, rows go from the top
+vector <unsigned char> encodeFrame(const Framebuffer &data, PipeFormat format, PngLevel level)
+{
+	if (data.empty())
+		return {};
+
+	if (format == PipeFormat::Png)
+		return encodeImage(data, level);
+	if (format == PipeFormat::Rgb24)
+		return flattenImageData(data);
+
+	size_t width = data.width(), height = data.height();
+	vector <unsigned char> res(width * height * 3 * sizeof(float));
+	float *out = reinterpret_cast <float *>(res.data());
+	for (size_t y = 0; y < height; ++y)
+	{
+		for (size_t x = 0; x < width; ++x)
+		{
+			Color c = data.get(x, y);
+			for (size_t i = 0; i < 3; ++i)
+				out[(y * width + x) * 3 + i] = c[i];
+		}
+	}
+	return res;
+}
+
+// Convert frame saved by previous run to bytes in given format
+vector <unsigned char> encodeSavedFrame(const string &filename, PipeFormat format)
+{
+	vector <unsigned char> res;
+	if (format == PipeFormat::Png)
+	{
+		if (lodepng::load_file(res, filename))
+			cerr << "Could not read " << filename << endl;
+		return res;
+	}
+
+	unsigned width, height;
+	if (lodepng::decode(res, width, height, filename, LodePNGColorType::LCT_RGB))
+	{
+		cerr << "Could not read " << filename << endl;
+		return {};
+	}
+	if (format == PipeFormat::Rgb24)
+		return res;
+
+	vector <unsigned char> floats(res.size() * sizeof(float));
+	float *out = reinterpret_cast <float *>(floats.data());
+	for (size_t i = 0; i < res.size(); ++i)
+		out[i] = res[i] / 255.f;
+	return floats;
+}
+
+// Write encoded frame to FILE
+size_t writeToFile(const unsigned char *encoded, size_t size, FILE *file)
+{
+	if (size == 0)
+		return 0;
 
 #ifdef __linux__
 	// Check if ffmpeg is indeed running
-	pollfd* pfds = new pollfd[1];
-	pfds[0].fd = fileno(file);
-	pfds[0].events = POLLOUT;
-	int ready = poll(pfds, 1, -1);
-	if (ready == 1 && (pfds[0].revents & POLLERR))
+	pollfd pfd;
+	pfd.fd = fileno(file);
+	pfd.events = POLLOUT;
+	int ready = poll(&pfd, 1, -1);
+	if (ready == 1 && (pfd.revents & POLLERR))
 	{
 		cerr << "\nCouldn't send data to pipe\nCheck if path to ffmpeg is correct\n";
 		exit(0);
 	}
 #endif
 
-	vector <unsigned char> res;
-	lodepng::encode(res, flatData, width, height, LodePNGColorType::LCT_RGB);
-	return fwrite(&res[0], 1, res.size(), file);
+	return fwrite(encoded, 1, size, file);
+}
+
+size_t writeToFile(const vector <unsigned char> &encoded, FILE *file)
+{
+	return writeToFile(encoded.data(), encoded.size(), file);
+}
+
+// Save rendered region as raw floats together with its position in full image
+bool writePartial(const Framebuffer &data, const Scene &scene, const string &filename)
+{
+	Region region = scene.getRegion();
+	PartialImage part;
+	part.fullWidth = static_cast <uint32_t>(scene.getCamera().getResolution().first);
+	part.fullHeight = static_cast <uint32_t>(scene.getCamera().getResolution().second);
+	part.x = static_cast <uint32_t>(region.x0);
+	part.y = static_cast <uint32_t>(region.y0);
+	part.width = static_cast <uint32_t>(region.width());
+	part.height = static_cast <uint32_t>(region.height());
+	part.data.resize(region.width() * region.height() * 3);
+
+	if (data.getLayout() == Framebuffer::Layout::RGB)
+		copy(data.data(), data.data() + data.size(), part.data.begin());
+	else
+	{
+		for (size_t y = 0; y < data.height(); ++y)
+		{
+			for (size_t x = 0; x < data.width(); ++x)
+				part.set(x, y, data.get(x, y));
+		}
+	}
+
+	return part.write(filename);
+}
+
+// Combine partial images into one png: raytracer merge output.png part1 part2 ...
+int mergePartials(int argc, char **argv)
+{
+	if (argc < 4)
+	{
+		cerr << "Usage: " << argv[0] << " merge output.png part1 [part2 ...]\n";
+		return 1;
+	}
+
+	Framebuffer data;
+	vector <bool> covered;
+	for (int i = 3; i < argc; ++i)
+	{
+		PartialImage part;
+		if (!part.read(argv[i]))
+		{
+			cerr << "Could not read partial image " << argv[i] << endl;
+			return 1;
+		}
+
+		if (data.empty())
+		{
+			data = Framebuffer(part.fullWidth, part.fullHeight);
+			covered.assign(data.width() * data.height(), false);
+		}
+		else if (data.width() != part.fullWidth || data.height() != part.fullHeight)
+		{
+			cerr << argv[i] << " belongs to image of different size\n";
+			return 1;
+		}
+
+		for (size_t y = 0; y < part.height; ++y)
+		{
+			for (size_t x = 0; x < part.width; ++x)
+			{
+				data.set(part.x + x, part.y + y, part.get(x, y));
+				covered[(part.y + y) * data.width() + part.x + x] = true;
+			}
+		}
+	}
+
+	size_t missing = count(covered.begin(), covered.end(), false);
+	if (missing != 0)
+		cerr << missing << " pixels are not covered by any part\n";
+
+	if (writeImage(data, argv[2]))
+	{
+		cerr << "Could not write " << argv[2] << endl;
+		return 1;
+	}
+	cerr << "Result saved to " << argv[2] << endl;
+	return 0;
+}
+
+bool parseRegion(const string &str, Region &region)
+{
+	unsigned long long v[4];
+	if (sscanf(str.c_str(), "%llu,%llu,%llu,%llu", &v[0], &v[1], &v[2], &v[3]) != 4 || v[2] <= v[0] || v[3] <= v[1])
+		return false;
+
+	region.x0 = static_cast <size_t>(v[0]);
+	region.y0 = static_cast <size_t>(v[1]);
+	region.x1 = static_cast <size_t>(v[2]);
+	region.y1 = static_cast <size_t>(v[3]);
+	return true;
 }
 
 string getRelativePath(const string &binary)
@@ -136,6 +389,160 @@ string getOutputVideoName(const string &path)
 	return (res + ".mp4");
 }
 
+// Name of saved animation frame, the same for all processes that render parts of animation
+string getFrameName(size_t index)
+{
+	string num = to_string(index);
+	return "temp/img" + string(num.size() < 4 ? 4 - num.size() : 0, '0') + num + ".png";
+}
+
+// Part of animation frames rendered by one of several worker processes
+struct Shard
+{
+	size_t index = 0;
+	size_t count = 1;
+	bool contiguous = false;	// Consecutive frames instead of every count-th frame
+
+	// Frames [first, end) are rendered by shard only if they are inside [from, to)
+	void getBounds(size_t first, size_t end, size_t &from, size_t &to) const
+	{
+		from = first;
+		to = end;
+		if (contiguous)
+		{
+			from = first + (end - first) * index / count;
+			to = first + (end - first) * (index + 1) / count;
+		}
+	}
+
+	bool contains(size_t frame, size_t first, size_t end) const
+	{
+		size_t from, to;
+		getBounds(first, end, from, to);
+		return frame >= from && frame < to && (contiguous || (frame - first) % count == index);
+	}
+};
+
+// Shard given as i/N, where 0 <= i < N
+bool parseShard(const string &str, Shard &shard)
+{
+	unsigned long long index, count;
+	if (sscanf(str.c_str(), "%llu/%llu", &index, &count) != 2 || count == 0 || index >= count)
+		return false;
+
+	shard.index = static_cast <size_t>(index);
+	shard.count = static_cast <size_t>(count);
+	return true;
+}
+
+// Frames [first, end) of animation, given by --frame-range a:b or by --skip and --frames
+bool getFrameRange(const cxxopts::ParseResult &opts, size_t &first, size_t &end)
+{
+	if (opts.count("frame-range"))
+	{
+		unsigned long long a, b;
+		if (sscanf(opts["frame-range"].as <string>().c_str(), "%llu:%llu", &a, &b) != 2 || b <= a)
+			return false;
+		first = static_cast <size_t>(a);
+		end = static_cast <size_t>(b);
+		return true;
+	}
+
+	first = opts["skip"].as <size_t>();
+	end = first + opts["frames"].as <size_t>();
+	return true;
+}
+
+bool getShard(const cxxopts::ParseResult &opts, Shard &shard)
+{
+	string layout = opts["shard-layout"].as <string>();
+	if (layout != "interleaved" && layout != "contiguous")
+		return false;
+	shard.contiguous = layout == "contiguous";
+	return opts.count("shard") == 0 || parseShard(opts["shard"].as <string>(), shard);
+}
+
+// Start ffmpeg that makes video from frames written to returned pipe
+FILE *openVideoPipe(const cxxopts::ParseResult &opts, PipeFormat format, const Region &region, const string &output)
+{
+	string ffmpeg = opts["ffmpeg"].as <string>();
+	ffmpeg += "ffmpeg -y -framerate ";
+	ffmpeg += to_string(opts["framerate"].as <size_t>());
+	ffmpeg += getPipeInputArgs(format, region.width(), region.height());
+	ffmpeg += " -i - ";
+	ffmpeg += getOutputVideoName(output);
+
+#ifdef _MSC_VER
+	ffmpeg += " 2> nul";
+#else
+	ffmpeg += " 2> /dev/null";
+#endif
+	return POPEN(ffmpeg.c_str());
+}
+
+// FNV-1a hash of bytes added to h
+uint64_t hashBytes(const string &bytes, uint64_t h = 14695981039346656037ull)
+{
+	for (unsigned char c : bytes)
+		h = (h ^ c) * 1099511628211ull;
+	return h;
+}
+
+string readWholeFile(const string &filename)
+{
+	ifstream file(filename, ios::binary);
+	return string(istreambuf_iterator <char>(file), istreambuf_iterator <char>());
+}
+
+// Frames and rows saved by another job are not reused. Job is given by contents of scene file
+// and script and by options that change pixels or bytes of saved images. Options that are
+// not given keep their default values, so they do not change the name
+string getJobName(const string &filename, const cxxopts::ParseResult &opts)
+{
+	static const set <string> pixelOptions = { "anim", "blur", "keyframes", "framerate", "seed", "super", "dof",
+		"sampler", "min-throughput", "roulette", "region", "wavefront", "relight", "incremental", "format", "png-level" };
+
+	// Amount of frames changes exposure of motion blur, but not frames of animation
+	bool anim = opts.count("anim") || (opts.count("blur") == 0 && opts["keyframes"].as <string>() == "anim");
+
+	// Order of options on command line does not matter
+	vector <string> given;
+	for (const auto &arg : opts.arguments())
+	{
+		if (pixelOptions.count(arg.key()) || (arg.key() == "frames" && !anim))
+			given.push_back(arg.key() + "=" + arg.value());
+	}
+	sort(given.begin(), given.end());
+
+	uint64_t h = hashBytes(readWholeFile(filename));
+	for (const string &option : given)
+		h = hashBytes(option + "\n", h);
+	for (const char *script : { "anim", "blur" })
+	{
+		if (opts.count(script))
+			h = hashBytes(readWholeFile(opts[script].as <string>()), h);
+	}
+
+	char hex[17];
+	snprintf(hex, sizeof(hex), "%016llx", static_cast <unsigned long long>(h));
+	return filename + " " + hex;
+}
+
+// Every worker process has its own manifest
+string getManifestName(const Shard &shard)
+{
+	if (shard.count == 1)
+		return "temp/manifest.txt";
+	return "temp/manifest_" + to_string(shard.index) + "_of_" + to_string(shard.count) + ".txt";
+}
+
+string getPartialName(const string &path, const Region &region)
+{
+	size_t pos = path.rfind('.');
+	string res = path.substr(0, pos);
+	return res + "_" + to_string(region.x0) + "_" + to_string(region.y0) + ".part";
+}
+
 bool runScript(lua_State *L)
 {
 	if (lua_pcall(L, 0, 0, 0))
@@ -195,6 +602,201 @@ bool callLuaFunction(LuaRef f, Args... args)
 	}
 }
 
+// Time that script took to prepare one frame, in microseconds
+struct ScriptTimes
+{
+	long long total = 0;	// Includes time below
+	long long native = 0;	// Inside of C functions called by script: bindings and Lua standard library
+	long long gc = 0;		// Garbage collection step after tick
+};
+
+// Splits time of script between Lua code and C functions with call and return hooks.
+// Hooks slow script down, so they are installed only when profiling is requested
+class ScriptProfiler
+{
+	inline static vector <bool> calls;	// Functions that did not return yet, true for C functions
+	inline static chrono::steady_clock::time_point last;
+	inline static long long native = 0;	// Nanoseconds
+
+	static void hook(lua_State *L, lua_Debug *ar)
+	{
+		if (!calls.empty() && calls.back())
+			native += chrono::duration_cast <chrono::nanoseconds>(chrono::steady_clock::now() - last).count();
+
+		lua_getinfo(L, "S", ar);
+		bool isC = ar->what[0] == 'C';
+		if (ar->event == LUA_HOOKCALL)
+			calls.push_back(isC);
+		else if (ar->event == LUA_HOOKTAILCALL && !calls.empty())
+			calls.back() = isC;
+		else if (ar->event == LUA_HOOKRET && !calls.empty())
+			calls.pop_back();
+
+		// Time of hook itself is not counted
+		last = chrono::steady_clock::now();
+	}
+
+public:
+	static void install(lua_State *L)
+	{
+		lua_sethook(L, hook, LUA_MASKCALL | LUA_MASKRET, 0);
+	}
+
+	// Start measuring of next call, calls interrupted by errors are forgotten
+	static void start()
+	{
+		calls.clear();
+		native = 0;
+	}
+
+	static long long getNative()
+	{
+		return native / 1000;
+	}
+};
+
+// Bulk functions read and write numbers directly in Lua tables, so they do not create
+// objects that garbage collector has to free. Scene is stored in upvalue
+
+Scene *getUpvalueScene(lua_State *L)
+{
+	return static_cast <Scene *>(lua_touserdata(L, lua_upvalueindex(1)));
+}
+
+// Read count numbers from table at stack index arg, starting from 0-based position from
+void readNumbers(lua_State *L, int arg, size_t from, float *out, size_t count)
+{
+	for (size_t i = 0; i < count; ++i)
+	{
+		lua_rawgeti(L, arg, static_cast <lua_Integer>(from + i + 1));
+		out[i] = static_cast <float>(lua_tonumber(L, -1));
+		lua_pop(L, 1);
+	}
+}
+
+// Arguments (first, values): items first, first + 1, ... get stride numbers each.
+// Raises Lua error if some of items do not exist, returns amount of items
+size_t checkBulkArgs(lua_State *L, size_t size, size_t stride, const char *name)
+{
+	lua_Integer first = luaL_checkinteger(L, 1);
+	luaL_checktype(L, 2, LUA_TTABLE);
+	size_t count = lua_rawlen(L, 2) / stride;
+	if (first < 0 || static_cast <size_t>(first) + count > size)
+		luaL_error(L, "%s: there are only %d items", name, static_cast <int>(size));
+	return count;
+}
+
+// tracer.setTransforms(first, values): 16 numbers per object, matrices row by row
+int luaSetTransforms(lua_State *L)
+{
+	Scene *scene = getUpvalueScene(L);
+	size_t count = checkBulkArgs(L, scene->objectsSize(), 16, "setTransforms");
+	size_t first = static_cast <size_t>(lua_tointeger(L, 1));
+	for (size_t n = 0; n < count; ++n)
+	{
+		float v[16];
+		readNumbers(L, 2, n * 16, v, 16);
+		Matrix4f m;
+		for (size_t i = 0; i < 16; ++i)
+			m.set(i / 4, i % 4, v[i]);
+		scene->objectAt(first + n).setTransform(m);
+	}
+	lua_pushinteger(L, static_cast <lua_Integer>(count));
+	return 1;
+}
+
+// tracer.getTransforms(first, count[, values]): transforms of objects row by row,
+// written to given table or to new one
+int luaGetTransforms(lua_State *L)
+{
+	Scene *scene = getUpvalueScene(L);
+	lua_Integer first = luaL_checkinteger(L, 1);
+	lua_Integer count = luaL_checkinteger(L, 2);
+	if (first < 0 || count < 0 || static_cast <size_t>(first + count) > scene->objectsSize())
+		return luaL_error(L, "getTransforms: there are only %d objects", static_cast <int>(scene->objectsSize()));
+
+	if (lua_istable(L, 3))
+		lua_settop(L, 3);
+	else
+	{
+		lua_settop(L, 2);
+		lua_createtable(L, static_cast <int>(count * 16), 0);
+	}
+	for (lua_Integer n = 0; n < count; ++n)
+	{
+		const Matrix4f &m = scene->objectAt(static_cast <size_t>(first + n)).getTransform();
+		for (lua_Integer i = 0; i < 16; ++i)
+		{
+			lua_pushnumber(L, m.get(static_cast <size_t>(i / 4), static_cast <size_t>(i % 4)));
+			lua_rawseti(L, 3, n * 16 + i + 1);
+		}
+	}
+	return 1;
+}
+
+// Set some vector of lights first, first + 1, ... from 3 numbers per light
+int setLightVectors(lua_State *L, const char *name, void (*set)(Light &, const Vector3f &))
+{
+	Scene *scene = getUpvalueScene(L);
+	size_t count = checkBulkArgs(L, scene->lightsSize(), 3, name);
+	size_t first = static_cast <size_t>(lua_tointeger(L, 1));
+	for (size_t n = 0; n < count; ++n)
+	{
+		Vector3f v;
+		readNumbers(L, 2, n * 3, v.data, 3);
+		set(scene->lightAt(first + n), v);
+	}
+	lua_pushinteger(L, static_cast <lua_Integer>(count));
+	return 1;
+}
+
+// tracer.setLightColors(first, values): r, g, b per light
+int luaSetLightColors(lua_State *L)
+{
+	return setLightVectors(L, "setLightColors", [](Light &light, const Vector3f &v)
+	{
+		light.color = Color(v[0], v[1], v[2]);
+	});
+}
+
+// tracer.setLightPositions(first, values): x, y, z per light, lights without position are not changed
+int luaSetLightPositions(lua_State *L)
+{
+	return setLightVectors(L, "setLightPositions", [](Light &light, const Vector3f &v)
+	{
+		light.setPosition(v);
+	});
+}
+
+// tracer.setLightDirections(first, values): x, y, z per light, lights without direction are not changed
+int luaSetLightDirections(lua_State *L)
+{
+	return setLightVectors(L, "setLightDirections", [](Light &light, const Vector3f &v)
+	{
+		light.setDirection(v);
+	});
+}
+
+// Add function that works with given scene to namespace tracer
+void addSceneFunction(lua_State *L, const char *name, lua_CFunction f, Scene *scene)
+{
+	lua_getglobal(L, "tracer");
+	lua_pushstring(L, name);
+	lua_pushlightuserdata(L, scene);
+	lua_pushcclosure(L, f, 1);
+	lua_rawset(L, -3);
+	lua_pop(L, 1);
+}
+
+void loadBulkAPI(lua_State *L, Scene *scene)
+{
+	addSceneFunction(L, "setTransforms", luaSetTransforms, scene);
+	addSceneFunction(L, "getTransforms", luaGetTransforms, scene);
+	addSceneFunction(L, "setLightColors", luaSetLightColors, scene);
+	addSceneFunction(L, "setLightPositions", luaSetLightPositions, scene);
+	addSceneFunction(L, "setLightDirections", luaSetLightDirections, scene);
+}
+
 void loadScriptingAPI(lua_State *L)
 {
 	getGlobalNamespace(L)
@@ -223,6 +825,16 @@ void loadScriptingAPI(lua_State *L)
 				.addStaticFunction("fromRotationX", &Matrix4f::fromRotationX<Matrix4f>)
 				.addStaticFunction("fromRotationY", &Matrix4f::fromRotationY<Matrix4f>)
 				.addStaticFunction("fromRotationZ", &Matrix4f::fromRotationZ<Matrix4f>)
+				.addFunction("identity", &Matrix4f::setIdentity)
+				.addFunction("get", &Matrix4f::get)
+				.addFunction("set", &Matrix4f::set)
+				.addFunction("preMultiply", &Matrix4f::preMultiply)
+				.addFunction("postMultiply", &Matrix4f::postMultiply)
+				.addFunction("translate", &Matrix4f::applyTranslation)
+				.addFunction("scale", &Matrix4f::applyScaling)
+				.addFunction("rotateX", &Matrix4f::applyRotationX)
+				.addFunction("rotateY", &Matrix4f::applyRotationY)
+				.addFunction("rotateZ", &Matrix4f::applyRotationZ)
 			.endClass()
 			.beginClass <Camera>("Camera")
 				.addFunction("lookAt", &Camera::lookAt)
@@ -250,6 +862,8 @@ void loadScriptingAPI(lua_State *L)
 			.endClass()
 			.beginClass <Object>("Object")
 				.addProperty("transform", &Object::getTransform, &Object::setTransform)
+				.addFunction("getTransformTo", &Object::getTransformTo)
+				.addFunction("applyTransform", &Object::applyTransform)
 				.addProperty("material", &Object::getMaterial, &Object::setMaterial)
 			.endClass()
 			.deriveClass <Sphere, Object>("Sphere")
@@ -295,6 +909,13 @@ void loadScriptingAPI(lua_State *L)
 		.endNamespace();
 }
 
+// Render threads of this process
+size_t getThreadCount(const cxxopts::ParseResult &opts)
+{
+	size_t threads = opts.count("threads") ? opts["threads"].as <size_t>() : thread::hardware_concurrency();
+	return max <size_t>(threads, 1);
+}
+
 void setSceneSettings(Scene &scene, const cxxopts::ParseResult &opts)
 {
 	if (opts.count("super"))
@@ -308,11 +929,169 @@ void setSceneSettings(Scene &scene, const cxxopts::ParseResult &opts)
 		scene.settings.insert({ Scene::DOF, opts["dof"].as <size_t>() });
 		scene.setProperty(Scene::DOF);
 	}
+
+	scene.settings.insert({ Scene::Seed, opts["seed"].as <size_t>() });
+
+	Sampler::Type sampler;
+	if (!Sampler::parseType(opts["sampler"].as <string>(), sampler))
+	{
+		cerr << "Unknown sampler " << opts["sampler"].as <string>() << ", using stratified\n";
+		sampler = Sampler::Type::Stratified;
+	}
+	scene.settings.insert({ Scene::SamplerType, static_cast <size_t>(sampler) });
+
+	scene.setPruning(opts["min-throughput"].as <float>(), opts["roulette"].as <float>());
+
+	if (opts.count("wavefront"))
+		scene.setProperty(Scene::Wavefront);
+
+	if (opts.count("lazy"))
+		scene.setProperty(Scene::LazyLoading);
+
+	if (opts.count("region"))
+	{
+		Region region;
+		if (parseRegion(opts["region"].as <string>(), region))
+			scene.setRegion(region);
+		else
+			cerr << "Region should be given as x0,y0,x1,y1, rendering whole image\n";
+	}
+}
+
+Framebuffer renderScene(Scene &scene)
+{
+	if (scene.hasProperty(Scene::Wavefront))
+		return scene.renderWavefront();
+#ifdef ASYNC_RENDER
+	return scene.renderParallel();
+#else
+	return scene.render();
+#endif
+}
+
+// Rows of streamed image that are already on disk, 0 if progress belongs to another job
+size_t readStreamProgress(const string &filename, const string &job)
+{
+	ifstream file(filename);
+	string line, word;
+	size_t rows = 0;
+	if (!getline(file, line) || line != job || !(file >> word >> rows) || word != "rows")
+		return 0;
+	return rows;
+}
+
+// Render still image in bands of rows that are written to output as soon as they are ready.
+// Only the band that is rendered and the band that is written are kept in memory.
+// Rows of pfm and exr files are written to mapped file and listed in <output>.progress,
+// so interrupted render is continued with --resume. Png is written as one stream
+// Stats of scene are reset by every band, so stats of all bands are added up
+bool renderStreamed(Scene &scene, const string &filename, const string &output, const cxxopts::ParseResult &opts,
+	RenderStats &stats)
+{
+	size_t width = scene.getCamera().getResolution().first;
+	size_t height = scene.getCamera().getResolution().second;
+	size_t rows = max <size_t>(opts["stream"].as <size_t>(), 1);
+	ImageFormat format = getImageFormat(output);
+	string progressName = output + ".progress";
+	string job = getJobName(filename, opts);
+
+	unique_ptr <FILE, decltype(&fclose)> pngFile(nullptr, fclose);
+	optional <PngWriter> png;
+	FloatImageFile floatFile;
+	size_t first = 0;
+	if (format == ImageFormat::Png)
+	{
+		if (opts.count("resume"))
+			cerr << "Streamed png can not be resumed, use pfm or exr output\n";
+		pngFile.reset(fopen(output.c_str(), "wb"));
+		if (!pngFile)
+		{
+			cerr << "Could not write " << output << endl;
+			return false;
+		}
+		png.emplace(width, height, getPngLevel(opts));
+	}
+	else
+	{
+		if (!floatFile.open(output, format, width, height, opts.count("resume") != 0))
+		{
+			cerr << "Could not write " << output << endl;
+			return false;
+		}
+		if (floatFile.wasKept())
+			first = min(readStreamProgress(progressName, job), height);
+		if (first != 0)
+			cerr << "Continuing from row " << first << endl;
+	}
+
+	bool ok = true;
+	auto writeBand = [&](Framebuffer band, size_t y)
+	{
+		if (png)
+		{
+			vector <unsigned char> flatData = flattenImageData(band);
+			png->addRows(flatData.data(), band.height());
+			ok = ok && fwrite(png->output.data(), 1, png->output.size(), pngFile.get()) == png->output.size();
+			png->output.clear();
+			return;
+		}
+
+		floatFile.writeRows(y, band);
+		ok = ok && floatFile.flush(y, band.height());
+		ofstream progress(progressName);
+		progress << job << "\nrows " << y + band.height() << endl;
+	};
+
+	// Rows that are already written are kept if render is interrupted
+	stopRequested = 0;
+	signal(SIGINT, requestStop);
+	signal(SIGTERM, requestStop);
+
+	future <void> pending;
+	size_t done = first;
+	for (size_t y = first; y < height && !stopRequested; y += rows)
+	{
+		scene.setRegion(Region{ 0, y, width, min(y + rows, height) });
+		Framebuffer band = renderScene(scene);
+		stats += scene.getStats();
+		if (pending.valid())
+			pending.get();
+#ifdef ASYNC_WRITE
+		pending = async(launch::async, writeBand, move(band), y);
+#else
+		writeBand(move(band), y);
+#endif
+		done = min(y + rows, height);
+		cerr << "\rRows " << done << "/" << height << flush;
+	}
+	if (pending.valid())
+		pending.get();
+	cerr << endl;
+
+	signal(SIGINT, SIG_DFL);
+	signal(SIGTERM, SIG_DFL);
+
+	if (!ok)
+	{
+		cerr << "Could not write " << output << endl;
+		return false;
+	}
+	if (done < height)
+	{
+		cerr << "Interrupted at row " << done << (png ? ", png is incomplete\n" : ", continue with --resume\n");
+		return false;
+	}
+	if (!png)
+	{
+		floatFile.close();
+		remove(progressName.c_str());
+	}
+	return true;
 }
 
 void renderSingle(const string &filename, cxxopts::ParseResult &opts)
 {
-	Scene scene;
+	Scene scene(getThreadCount(opts));
 	setSceneSettings(scene, opts);
 	auto start = chrono::steady_clock::now();
 
@@ -321,15 +1100,43 @@ void renderSingle(const string &filename, cxxopts::ParseResult &opts)
 		cerr << "File does not exist or malformed\n";
 		return;
 	}
+	// Still image shows the first moment of animation
+	if (scene.hasAnimation())
+		scene.animate(0.f);
 	auto loadEnd = chrono::steady_clock::now();
-#ifdef ASYNC_RENDER
-	auto data = scene.renderParallel();
-#else
-	auto data = scene.render();
-#endif
+
+	string output = getOutputImageName(scene, opts);
+	// Streamed bands are rendered as regions, so crop is checked before render
+	bool crop = scene.hasProperty(Scene::Crop);
+	bool stream = opts.count("stream") != 0;
+	if (stream && crop)
+	{
+		cerr << "Region is saved as .part file, --stream is ignored\n";
+		stream = false;
+	}
+
+	// Streamed bands are written while next band is rendered, so writing is part of render time
+	Framebuffer data;
+	RenderStats stats;
+	if (stream)
+	{
+		if (!renderStreamed(scene, filename, output, opts, stats))
+			return;
+	}
+	else
+	{
+		data = renderScene(scene);
+		stats = scene.getStats();
+	}
 	auto renderEnd = chrono::steady_clock::now();
 
-	writeImage(data, scene.getOutputFile());
+	if (crop)
+	{
+		output = getPartialName(scene.getOutputFile(), scene.getRegion());
+		writePartial(data, scene, output);
+	}
+	else if (!stream)
+		writeImage(data, output, getPngLevel(opts));
 	auto writeEnd = chrono::steady_clock::now();
 
 	auto elapsedLoad = chrono::duration_cast <chrono::milliseconds>(loadEnd - start).count();
@@ -339,54 +1146,75 @@ void renderSingle(const string &filename, cxxopts::ParseResult &opts)
 	cerr << "Elapsed:"
 		<< "\nLoad: " << elapsedLoad / 1000.f
 		<< "\nRender: " << elapsedRender / 1000.f
-		<< "\nWrite: " << elapsedWrite / 1000.f 
+		<< "\nWrite: " << elapsedWrite / 1000.f
+		<< "\nRays: " << stats.rays << " (pruned " << stats.pruned << ")"
 		<< endl;
 
-	cerr << "Result saved to " << scene.getOutputFile() << endl;
+	cerr << "Result saved to " << output << endl;
 }
 
 void renderMultiple(const string &filename, const string &script, const cxxopts::ParseResult &opts)
 {
-	Scene scene;
+	Scene scene(getThreadCount(opts));
 	setSceneSettings(scene, opts);
 	scene.loadScene(filename);
 
-	lua_State *L = initScript(script);
-	if (!L)
-		return;
-	loadScriptingAPI(L);
-	ADD_LUA_VAR(L, "tracer", scene);
-	if (!runScript(L))
-		return;
+	// Script is optional when scene is animated by keyframe tracks, then mode is given by --keyframes
+	bool anim = opts.count("anim") || (opts.count("blur") == 0 && opts["keyframes"].as <string>() == "anim");
+	lua_State *L = nullptr;
+	optional <LuaRef> scriptTick;
+	// Script refers to scene through this pointer, so it has to live as long as script
+	Scene *scenePointer = &scene;
+	bool profile = opts.count("script-profile") != 0;
+	if (!script.empty())
+	{
+		L = initScript(script);
+		if (!L)
+			return;
+		loadScriptingAPI(L);
+		getGlobalNamespace(L).beginNamespace("tracer").addVariable("scene", &scenePointer).endNamespace();
+		loadBulkAPI(L, &scene);
+		if (!runScript(L))
+			return;
 
-	LuaRef scriptTick = getGlobal(L, "tick");
+		scriptTick = getGlobal(L, "tick");
+		// Garbage is collected in steps between frames, so its time can be measured
+		lua_gc(L, LUA_GCSTOP, 0);
+		if (profile)
+			ScriptProfiler::install(L);
+	}
+	else if (!scene.hasAnimation())
+		cerr << "Scene has no animation tracks and no script is given, all frames will be the same\n";
 
-	long long totalTime = 0;
 	long long execTime = 0;
 	long long renderTime = 0;
 
-#ifdef ASYNC_WRITE
-	ctpl::thread_pool pool(1);
-	vector <future <unsigned int>> futures;
-#endif
+	PipeFormat pipeFormat;
+	if (!parsePipeFormat(opts["pipe-format"].as <string>(), pipeFormat))
+	{
+		cerr << "Unknown pipe format " << opts["pipe-format"].as <string>() << ", using rgb24\n";
+		pipeFormat = PipeFormat::Rgb24;
+	}
+	PngLevel pngLevel = getPngLevel(opts);
+
+	size_t skip, frames;
+	Shard shard;
+	if (!getFrameRange(opts, skip, frames) || !getShard(opts, shard))
+	{
+		cerr << "Frame range should be given as a:b with a < b, shard as i/N with i < N "
+			"and shard layout as interleaved or contiguous\n";
+		return;
+	}
+
+	// Worker process only saves frames, video is made by coordinator
+	bool worker = opts.count("shard") != 0;
+	if (worker && anim && opts.count("no-ffmpeg") == 0)
+		cerr << "Shard of animation is saved in temp/, video is not created\n";
 
 	unique_ptr <FILE, decltype(&PCLOSE)> pipe(nullptr, PCLOSE);
-	if (opts.count("anim") && opts.count("no-ffmpeg") == 0)
-	{
-		// Open pipe to ffmpeg
-		string ffmpeg = opts["ffmpeg"].as <string>();
-		ffmpeg += "ffmpeg -y -framerate ";
-		ffmpeg += to_string(opts["framerate"].as <size_t>());
-		ffmpeg += " -f image2pipe -i - ";
-		ffmpeg += getOutputVideoName(scene.getOutputFile());
-		
-#ifdef _MSC_VER
-		ffmpeg += " 2> nul";
-#else
-		ffmpeg += " 2> /dev/null";
-#endif
-		pipe = unique_ptr <FILE, decltype(&PCLOSE)>(POPEN(ffmpeg.c_str()), PCLOSE);
-		
+	if (anim && opts.count("no-ffmpeg") == 0 && !worker)
+	{
+		pipe = unique_ptr <FILE, decltype(&PCLOSE)>(openVideoPipe(opts, pipeFormat, scene.getRegion(), scene.getOutputFile()), PCLOSE);
 		if (!pipe.get())
 		{
 			cerr << "Could not init pipe\n";
@@ -394,150 +1222,615 @@ void renderMultiple(const string &filename, const string &script, const cxxopts:
 		}
 	}
 
-	if (opts.count("save-frames") || (opts.count("anim") && opts.count("no-ffmpeg")))
+	bool saveFrames = opts.count("save-frames") || (anim && (opts.count("no-ffmpeg") || worker));
+	if (saveFrames)
 	{
 		// Create folder temp
 		mkdir("temp");
 	}
 
-
-	vector <vector <Color>> blurRes;
-
-	string out("temp/img");
-	size_t skip = opts["skip"].as <size_t>();
 	size_t framerate = opts["framerate"].as <size_t>();
-	size_t frames = opts["frames"].as <size_t>() + skip;
 	auto start = chrono::steady_clock::now();
 
-	// Skip frames
-	for (size_t i = 0; i < skip; ++i)
+	// Saved frames are listed in manifest, so interrupted job can be continued with --resume.
+	// Frame shows the same moment only if input and framerate are the same
+	FrameManifest manifest;
+	bool resume = opts.count("resume") != 0;
+	if (anim && saveFrames)
 	{
-		if (callLuaFunction(scriptTick, 1.f / framerate))
-			break;
+		string job = getJobName(filename, opts);
+		if (!manifest.open(getManifestName(shard), job, resume))
+			cerr << "Could not write " << getManifestName(shard) << ", job can not be resumed\n";
+		else if (resume)
+			cerr << "Resuming, " << manifest.doneCount() << " frames are already on disk\n";
 	}
+	else if (resume && anim)
+		cerr << "Only frames saved to disk can be resumed, use --save-frames\n";
 
-	for (size_t i = skip; i < frames; ++i)
+	auto elapsedUs = [](chrono::steady_clock::time_point from)
 	{
-		cerr << i + 1 << '/' << frames << "  ";
-		auto start = chrono::steady_clock::now();
-		
-		if (callLuaFunction(scriptTick, 1.f / framerate))
+		return chrono::duration_cast <chrono::microseconds>(chrono::steady_clock::now() - from).count();
+	};
+
+	// Collector is stopped, so after every step of script a step of collector does as much work
+	// as automatic collector would do for memory allocated since before
+	auto collectGarbage = [&](int before)
+	{
+		lua_gc(L, LUA_GCSTEP, max(lua_gc(L, LUA_GCCOUNT, 0) - before, 1));
+	};
+
+	// Bring scene to frame n. Tracks depend only on time of frame, script makes one step after them.
+	// Returns true if script asks to stop
+	ScriptTimes tickTimes;
+	ScriptTimes totalTimes;
+	auto tick = [&](size_t n)
+	{
+		auto tickStart = chrono::steady_clock::now();
+		tickTimes = ScriptTimes();
+		if (scene.hasAnimation())
+			scene.animate(static_cast <float>(n) / framerate);
+
+		bool stop = false;
+		if (scriptTick)
+		{
+			if (profile)
+				ScriptProfiler::start();
+			int before = lua_gc(L, LUA_GCCOUNT, 0);
+			stop = callLuaFunction(*scriptTick, 1.f / framerate);
+			if (profile)
+				tickTimes.native = ScriptProfiler::getNative();
+
+			auto gcStart = chrono::steady_clock::now();
+			collectGarbage(before);
+			tickTimes.gc = elapsedUs(gcStart);
+		}
+
+		tickTimes.total = elapsedUs(tickStart);
+		totalTimes.total += tickTimes.total;
+		totalTimes.native += tickTimes.native;
+		totalTimes.gc += tickTimes.gc;
+		return stop;
+	};
+
+	// Skip frames, only script has to go through them
+	for (size_t i = 0; i < skip && scriptTick; ++i)
+	{
+		int before = lua_gc(L, LUA_GCCOUNT, 0);
+		bool stop = callLuaFunction(*scriptTick, 1.f / framerate);
+		collectGarbage(before);
+		if (stop)
 			break;
+	}
+
+	if (!anim)
+	{
+		// Shutter opens after first tick and closes after the last one. State after every tick is
+		// a key of motion, whole exposure is rendered at once and every ray gets its own moment of time
+		if (!scene.hasProperty(Scene::Supersampling))
+			cerr << "Motion blur is sampled with supersampling rays, use --super to reduce noise\n";
+
+		tick(skip);
+		unique_ptr <Scene> exposure = scene.snapshot();
+		float maxAngle = 0.f;
+		for (size_t i = skip + 1; i < frames; ++i)
+		{
+			if (tick(i))
+				break;
+			maxAngle = max(maxAngle, exposure->addMotionKey(scene));
+		}
+		exposure->setFrame(skip);
+		// Rotation between keys follows the shorter arc, faster spin needs more ticks
+		if (maxAngle > static_cast <float>(M_PI) / 2.f)
+		{
+			cerr << "Camera or object rotates by " << maxAngle * 180.f / static_cast <float>(M_PI)
+				<< " degrees during one tick, use more frames for accurate blur\n";
+		}
 
 		auto scriptEnd = chrono::steady_clock::now();
-#ifdef ASYNC_RENDER
-		auto data = scene.renderParallel();
-#else
-		auto data = scene.render();
-#endif
+		auto data = renderScene(*exposure);
 		auto renderEnd = chrono::steady_clock::now();
+		string output = getOutputImageName(scene, opts);
+		if (writeImage(data, output, pngLevel))
+			cerr << "Could not write " << output << endl;
+
+		RenderStats stats = exposure->getStats();
+		cerr << "Elapsed:"
+			<< "\nScript: " << chrono::duration_cast <chrono::milliseconds>(scriptEnd - start).count() / 1000.f
+			<< "\nRender: " << chrono::duration_cast <chrono::milliseconds>(renderEnd - scriptEnd).count() / 1000.f
+			<< "\nRays: " << stats.rays << " (pruned " << stats.pruned << ")" << endl;
+		cerr << "Result saved to " << output << endl;
+		return;
+	}
 
-		if (opts.count("save-frames") || (opts.count("anim") && opts.count("no-ffmpeg")))
+	// Rendered frame is shared by all writers without copying
+	using Frame = shared_ptr <const Framebuffer>;
+	struct WriteJob
+	{
+		size_t index = 0;
+		Frame frame{};
+		size_t ticket = 0;		// Position of frame in video
+		string savedFile{};		// Frame was saved by previous run, it is only sent to pipe
+	};
+
+	// Frames are encoded in parallel, but go to pipe in order of rendering
+	Sequencer pipeOrder;
+	size_t tickets = 0;
+	auto writeFrame = [&](WriteJob &job)
+	{
+		if (saveFrames && job.savedFile.empty())
 		{
 			// Save frame as image
-			string num = to_string(i);
-			string filename = out + string(4 - num.size(), '0') + num + ".png";
-#ifdef ASYNC_WRITE
-			futures.push_back(pool.push([](int id, const vector <vector <Color>> &data, const string &filename)
+			string filename = getFrameName(job.index);
+			if (writeImage(*job.frame, filename, pngLevel))
+				cerr << "Could not write " << filename << endl;
+			else if (manifest.isOpen())
+				manifest.markDone(job.index, filename);
+		}
+
+		if (pipe && job.savedFile.empty() && isRawFrame(*job.frame, pipeFormat))
+		{
+			// Framebuffer is written as it is, so it is kept until previous frames are sent
+			pipeOrder.run(job.ticket, [&]()
 			{
-				return writeImage(data, filename);
-			}, data, filename));
+				writeToFile(reinterpret_cast <const unsigned char *>(job.frame->data()), job.frame->size() * sizeof(float), pipe.get());
+			});
+		}
+		else if (pipe)
+		{
+			vector <unsigned char> encoded = job.savedFile.empty() ? encodeFrame(*job.frame, pipeFormat, pngLevel) :
+				encodeSavedFrame(job.savedFile, pipeFormat);
+			// Frame data is not needed anymore, release it before waiting for previous frames
+			job.frame.reset();
+			pipeOrder.run(job.ticket, [&]()
+			{
+				writeToFile(encoded, pipe.get());
+			});
+		}
+	};
+
+#ifdef ASYNC_WRITE
+	// Rendering waits when writers are behind by more than two frames per writer,
+	// so memory use does not depend on amount of frames
+	size_t writerCount = max(opts["writers"].as <size_t>(), static_cast <size_t>(1));
+	WorkerPool <WriteJob> writers(writerCount, writerCount * 2, writeFrame);
+#endif
+
+	// Frames are rendered from snapshots of scene, so script can prepare next frames
+	// while previous ones are still rendering
+	struct FrameInFlight
+	{
+		size_t index = 0;
+		unique_ptr <Scene> snapshot{};
+		future <Framebuffer> data{};
+		chrono::steady_clock::time_point start{};
+		shared_ptr <FrameHistory> next{};	// Data that next frame takes from this one
+		string savedFile{};					// Frame is not rendered, previous run saved it
+		ScriptTimes script{};
+	};
+	deque <FrameInFlight> inFlight;
+	size_t maxInFlight = max(opts["frames-in-flight"].as <size_t>(), static_cast <size_t>(1));
+
+	// Incremental rendering and relighting need previous frame, so frames are rendered one by one
+	bool relight = opts.count("relight") != 0;
+	bool incremental = !relight && opts.count("incremental") != 0;
+	if (relight && opts.count("incremental"))
+		cerr << "Relighting can not be combined with incremental rendering, using relighting\n";
+	FrameHistory history;
+	if (incremental || relight)
+	{
+		if (maxInFlight > 1 || scene.hasProperty(Scene::Wavefront))
+			cerr << "Incremental rendering and relighting render one frame at a time with depth-first renderer\n";
+		maxInFlight = 1;
+	}
+
+	// Wait for oldest frame and output it, frames are finished in order
+	auto finishFrame = [&]()
+	{
+		FrameInFlight &frame = inFlight.front();
+		size_t i = frame.index;
+		if (!frame.savedFile.empty())
+		{
+			// Frames of previous run are sent to pipe in their place in video
+			WriteJob job{ i, nullptr, tickets++, frame.savedFile };
+#ifdef ASYNC_WRITE
+			writers.push(move(job));
 #else
-			writeImage(data, filename);
+			writeFrame(job);
 #endif
+			inFlight.pop_front();
+			return;
 		}
 
-		if (opts.count("anim") && !opts.count("no-ffmpeg"))
+		Frame data = make_shared <const Framebuffer>(frame.data.get());
+		auto renderEnd = chrono::steady_clock::now();
+
+		if (saveFrames || pipe)
 		{
-			// Write to pipe
+			WriteJob job{ i, data, tickets++ };
 #ifdef ASYNC_WRITE
-			futures.push_back(pool.push([](int id, const vector <vector <Color>> data, FILE *pipe)
-			{
-				return writeToFile(data, pipe);
-			}, data, pipe.get()));
+			writers.push(move(job));
 #else
-			writeToFile(data, pipe.get());
-#endif	
+			writeFrame(job);
+#endif
 		}
 
-		// For some reasons thread pool does not free memory from already finished functions
-		// until future.get() called, which may lead to enormous memory consumption when
-		// we render a big amount of frames
-		// To avoid this, we will "flush" IO every 10th frame
-#ifdef ASYNC_WRITE
-		if (i % 10 == 9)
+		long long frameRenderTime = chrono::duration_cast <chrono::milliseconds>(renderEnd - frame.start).count();
+		renderTime += frameRenderTime;
+
+		RenderStats stats = frame.snapshot->getStats();
+		cerr << i + 1 << '/' << frames << "  " << frameRenderTime / 1000.f
+			<< "  rays: " << stats.rays << " pruned: " << stats.pruned;
+		if (incremental)
+			cerr << " reused tiles: " << stats.reused << '/' << stats.tiles
+				<< " (" << 100.f * stats.reused / max(stats.tiles, static_cast <size_t>(1)) << "%)";
+		if (scriptTick)
 		{
-			for (auto &f : futures)
-				f.get();
+			const ScriptTimes &t = frame.script;
+			cerr << " script: " << t.total / 1000.f << " ms (";
+			if (profile)
+				cerr << "lua " << (t.total - t.native - t.gc) / 1000.f << ", c++ " << t.native / 1000.f << ", ";
+			cerr << "gc " << t.gc / 1000.f << ")";
+		}
+		cerr << endl;
 
-			futures.clear();
+		if (incremental || relight)
+		{
+			history.scene = move(frame.snapshot);
+			history.image = data;
+			history.tiles = move(frame.next->tiles);
+			history.gbuffer = move(frame.next->gbuffer);
 		}
-#endif
-		if (opts.count("blur"))
+
+		// Snapshot holds references to objects, so it is destroyed here and not on render thread
+		inFlight.pop_front();
+	};
+
+	// Interrupted job finishes frames that are already rendering, so they are not lost
+	stopRequested = 0;
+	signal(SIGINT, requestStop);
+	signal(SIGTERM, requestStop);
+
+	// Frames after the last frame of shard are not needed
+	size_t shardFrom, shardTo;
+	shard.getBounds(skip, frames, shardFrom, shardTo);
+	for (size_t i = skip; i < shardTo; ++i)
+	{
+		if (stopRequested)
 		{
-			if (blurRes.size() == 0)
-				blurRes = data;
-			else
+			cerr << "Interrupted, finishing " << inFlight.size() << " frames in flight\n";
+			break;
+		}
+
+		auto start = chrono::steady_clock::now();
+		
+		if (tick(i))
+			break;
+
+		auto scriptEnd = chrono::steady_clock::now();
+		execTime += chrono::duration_cast <chrono::microseconds>(scriptEnd - start).count();
+
+		// Script is fast-forwarded through frames of other shards
+		if (!shard.contains(i, skip, frames))
+			continue;
+
+		// and through frames that previous run saved
+		if (resume && manifest.isDone(i))
+		{
+			if (pipe)
 			{
-				for (size_t x = 0; x < data.size(); ++x)
-				{
-					for (size_t y = 0; y < data[x].size(); ++y)
-						blurRes[x][y] += data[x][y];
-				}
+				FrameInFlight frame{ i };
+				frame.savedFile = manifest.getFile(i);
+				inFlight.push_back(move(frame));
+				if (inFlight.size() >= maxInFlight)
+					finishFrame();
 			}
+			continue;
 		}
 
-		totalTime += chrono::duration_cast <chrono::milliseconds>(renderEnd - start).count();
-		execTime += chrono::duration_cast <chrono::microseconds>(scriptEnd - start).count();
-		long long frameRenderTime = chrono::duration_cast <chrono::milliseconds>(renderEnd - scriptEnd).count();
-		renderTime += frameRenderTime;
+		scene.setFrame(i);
+		FrameInFlight frame{ i, scene.snapshot() };
+		frame.start = scriptEnd;
+		frame.script = tickTimes;
+		if (incremental || relight)
+		{
+			frame.next = make_shared <FrameHistory>();
+			frame.data = async(launch::async, [&history, relight](Scene *scene, FrameHistory *next)
+			{
+				if (relight)
+					return scene->renderRelight(history, next->gbuffer);
+				return scene->renderIncremental(history, next->tiles);
+			}, frame.snapshot.get(), frame.next.get());
+		}
+		else
+		{
+			frame.data = async(launch::async, [](Scene *scene)
+			{
+				return renderScene(*scene);
+			}, frame.snapshot.get());
+		}
+		inFlight.push_back(move(frame));
 
-		cerr << frameRenderTime / 1000.f << endl;
+		if (inFlight.size() >= maxInFlight)
+			finishFrame();
 	}
 
+	while (!inFlight.empty())
+		finishFrame();
+
 #ifdef ASYNC_WRITE
-	for (auto &f : futures)
-		f.get();
+	writers.finish();
+#endif
+	manifest.close();
+	signal(SIGINT, SIG_DFL);
+	signal(SIGTERM, SIG_DFL);
+
+	auto end = chrono::steady_clock::now();
+	cerr << "Elapsed:"
+		<< "\nSript: " << (execTime / 1000.f) << " ms";
+	if (profile && scriptTick)
+		cerr << " (C++ " << totalTimes.native / 1000.f << " ms)";
+	if (scriptTick)
+		cerr << "\nGarbage collection: " << totalTimes.gc / 1000.f << " ms";
+	cerr << "\nRender: " << renderTime / 1000.f
+		<< "\nTotal: " << chrono::duration_cast <chrono::milliseconds>(end - start).count() / 1000.f << endl;
+
+	if (L)
+		lua_gc(L, 0, 0);
+}
+
+// Signals received by coordinator, every one is forwarded to workers
+volatile sig_atomic_t coordinatorSignals = 0;
+
+void countSignal(int)
+{
+	coordinatorSignals = coordinatorSignals + 1;
+}
+
+// Argument for shell command line
+string quoteArgument(const string &arg)
+{
+#ifdef _MSC_VER
+	return "\"" + arg + "\"";
+#else
+	string res = "'";
+	for (char c : arg)
+		res += c == '\'' ? string("'\\''") : string(1, c);
+	return res + "'";
+#endif
+}
+
+// Start 'workers' processes that render shards of animation and send frames they
+// saved to ffmpeg in order, as soon as all previous frames are ready
+int coordinateWorkers(const vector <string> &args, const cxxopts::ParseResult &opts)
+{
+	size_t workers = opts["coordinator"].as <size_t>();
+	size_t first, end;
+	if (workers == 0 || !getFrameRange(opts, first, end))
+	{
+		cerr << "Coordinator needs at least one worker and frame range a:b with a < b\n";
+		return 1;
+	}
+	if (opts.count("shard") || opts.count("blur") || (opts.count("anim") == 0 && opts["keyframes"].as <string>() != "anim"))
+	{
+		cerr << "Coordinator renders only animations, shards are chosen by coordinator\n";
+		return 1;
+	}
+
+	PipeFormat pipeFormat;
+	if (!parsePipeFormat(opts["pipe-format"].as <string>(), pipeFormat))
+	{
+		cerr << "Unknown pipe format " << opts["pipe-format"].as <string>() << ", using rgb24\n";
+		pipeFormat = PipeFormat::Rgb24;
+	}
+
+	// Scene is loaded only for size of frames and name of video
+	Scene scene(1);
+	setSceneSettings(scene, opts);
+	scene.loadScene(opts["i"].as <string>());
+
+	// Workers get the same arguments, except options of coordinator. Render threads of
+	// this machine are divided between workers
+	string command = quoteArgument(args[0]);
+	for (size_t i = 1; i < args.size(); ++i)
+	{
+		const string &arg = args[i];
+		bool skipped = false;
+		for (const string option : { "--coordinator", "--threads" })
+		{
+			if (arg == option)
+				++i;
+			skipped = skipped || arg == option || arg.compare(0, option.size() + 1, option + "=") == 0;
+		}
+		if (!skipped)
+			command += " " + quoteArgument(arg);
+	}
+	command += " --threads=" + to_string(max <size_t>(getThreadCount(opts) / workers, 1));
+
+	mkdir("temp");
+	string job = getJobName(opts["i"].as <string>(), opts);
+	bool resume = opts.count("resume") != 0;
+	vector <Shard> shards(workers);
+	for (size_t i = 0; i < workers; ++i)
+	{
+		shards[i].index = i;
+		shards[i].count = workers;
+		// Frames of previous job are not mistaken for frames of this one
+		if (!resume)
+			remove(getManifestName(shards[i]).c_str());
+	}
+
+	unique_ptr <FILE, decltype(&PCLOSE)> pipe(nullptr, PCLOSE);
+	if (opts.count("no-ffmpeg") == 0)
+	{
+		pipe = unique_ptr <FILE, decltype(&PCLOSE)>(openVideoPipe(opts, pipeFormat, scene.getRegion(), scene.getOutputFile()), PCLOSE);
+		if (!pipe.get())
+		{
+			cerr << "Could not init pipe\n";
+			return 1;
+		}
+	}
+
+	// Workers run in their own process groups, so Ctrl+C reaches them only through coordinator.
+	// It forwards every SIGINT or SIGTERM and waits until workers save frames they are rendering
+	coordinatorSignals = 0;
+	signal(SIGINT, countSignal);
+	signal(SIGTERM, countSignal);
+	atomic <size_t> running(workers);
+	vector <thread> threads;
+#ifndef _MSC_VER
+	vector <pid_t> pids(workers, -1);
+#endif
+	for (size_t i = 0; i < workers; ++i)
+	{
+		string worker = command + " --shard " + to_string(i) + "/" + to_string(workers) +
+			" --no-ffmpeg > temp/worker_" + to_string(i) + ".log 2>&1";
+		auto failed = [i]()
+		{
+			cerr << "\nWorker " << i << " failed, see temp/worker_" << i << ".log\n";
+		};
+#ifdef _MSC_VER
+		threads.emplace_back([worker, failed, &running]()
+		{
+			if (system(worker.c_str()) != 0)
+				failed();
+			--running;
+		});
+#else
+		// Shell is replaced by worker, so it does not exit on forwarded signal before worker does
+		string shell = "exec " + worker;
+		pid_t pid = fork();
+		if (pid == 0)
+		{
+			setpgid(0, 0);
+			execl("/bin/sh", "sh", "-c", shell.c_str(), static_cast <char *>(nullptr));
+			_exit(127);
+		}
+		if (pid > 0)
+			setpgid(pid, pid);
+		pids[i] = pid;
+		threads.emplace_back([pid, failed, &running]()
+		{
+			int status = 0;
+			if (pid < 0 || waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			{
+				// Second signal kills workers, that is not their failure
+				if (coordinatorSignals < 2)
+					failed();
+			}
+			--running;
+		});
 #endif
+	}
 
-	if (opts.count("blur"))
+	auto start = chrono::steady_clock::now();
+	size_t next = first;
+	size_t done = 0;
+	sig_atomic_t forwarded = 0;
+	while (true)
 	{
-		// Divide every pixel by number of frames
-		for (size_t x = 0; x < blurRes.size(); ++x)
+		for (; forwarded < coordinatorSignals; ++forwarded)
 		{
-			for (size_t y = 0; y < blurRes[x].size(); ++y)
+			if (forwarded == 0)
+				cerr << "\nStopping workers after frames they are rendering, second signal stops them at once\n";
+#ifndef _MSC_VER
+			for (pid_t pid : pids)
 			{
-				blurRes[x][y] /= static_cast <float>(frames);
+				if (pid > 0)
+					kill(-pid, SIGINT);
 			}
+#endif
+			// Ffmpeg gets Ctrl+C too, video ends with frames that are already sent
+			pipe.reset();
+		}
+
+		// Manifests are read after workers are checked, so frames of finished workers are not missed.
+		// Until worker starts, its manifest may still list frames of previous run
+		bool finished = running == 0;
+		map <size_t, string> ready;
+		for (const Shard &shard : shards)
+			FrameManifest::readDone(getManifestName(shard), job, ready);
+
+		done = 0;
+		for (const auto &item : ready)
+			done += item.first >= first && item.first < end;
+
+		for (auto it = ready.find(next); it != ready.end() && it->first == next; ++it, ++next)
+		{
+			if (pipe)
+				writeToFile(encodeSavedFrame(it->second, pipeFormat), pipe.get());
 		}
 
-		writeImage(blurRes, scene.getOutputFile());
+		cerr << "\rFrames done: " << done << "/" << end - first << "  sent to ffmpeg: " << next - first << "   " << flush;
+		if (finished || next == end)
+			break;
+		this_thread::sleep_for(chrono::milliseconds(200));
 	}
 
-	auto end = chrono::steady_clock::now();
-	cerr << "Elapsed:"
-		<< "\nSript: " << (execTime / 1000.f) << " ms"
-		<< "\nRender: " << renderTime / 1000.f
-		<< "\nTotal: " << chrono::duration_cast <chrono::milliseconds>(end - start).count() / 1000.f << endl;
+	for (thread &t : threads)
+		t.join();
+	signal(SIGINT, SIG_DFL);
+	signal(SIGTERM, SIG_DFL);
 
-	lua_gc(L, 0, 0);
+	cerr << "\nElapsed: " << chrono::duration_cast <chrono::milliseconds>(chrono::steady_clock::now() - start).count() / 1000.f << endl;
+	if (forwarded != 0)
+	{
+		cerr << "Stopped, saved frames are kept and job continues with --resume\n";
+		return 1;
+	}
+	if (next != end)
+	{
+		cerr << "Frame " << next << " was not rendered, video stops before it. Logs of workers are in temp/\n";
+		return 1;
+	}
+	if (pipe)
+		cerr << "Result saved to " << getOutputVideoName(scene.getOutputFile()) << endl;
+	return 0;
 }
 
 int main(int argc, char **argv)
 {
 	//chdir("scenes");
+	if (argc > 1 && string(argv[1]) == "merge")
+		return mergePartials(argc, argv);
+
 	cxxopts::Options options("Raytracer", "");
 	options.add_options()
 		("i,input", "Input .xml file", cxxopts::value <string>())
 		("dof", "DOF (arg - amount of additional rays from camera lense)", cxxopts::value <size_t>()->implicit_value("20"))
 		("super", "Supersampling (divide every pixel in arg x arg subpixels)", cxxopts::value <size_t>()->implicit_value("2"))
-		("b,blur", "Motion blur", cxxopts::value <string>())
+		("seed", "Seed of random numbers (same seed gives identical images)", cxxopts::value <size_t>()->default_value("0"))
+		("min-throughput", "Drop reflected and refracted rays whose contribution relative to their camera ray is less than arg", cxxopts::value <float>()->default_value("0"))
+		("roulette", "Russian roulette for rays whose contribution relative to their camera ray is less than arg", cxxopts::value <float>()->default_value("0")->implicit_value("0.05"))
+		("region", "Render only part of image x0,y0,x1,y1 and save it as raw .part file, parts are combined with 'merge' command", cxxopts::value <string>())
+		("stream", "Render still image in bands of arg rows that are written to output as soon as they are ready, "
+			"pfm and exr output can be continued with --resume", cxxopts::value <size_t>()->implicit_value("32"))
+		("lazy", "Decode textures and build trees of meshes only when rays reach them, unseen objects are not loaded")
+		("wavefront", "Trace rays in sorted batches instead of pixel by pixel")
+		("sampler", "Sample sequence for supersampling and DOF: random, stratified, sobol, bluenoise", cxxopts::value <string>()->default_value("stratified"))
+		("b,blur", "Motion blur, objects and camera are moved by script during 'frames' ticks while shutter is open. Lights are not blurred, they stay as they are after the first tick", cxxopts::value <string>())
 		("a,anim", "Animation", cxxopts::value <string>())
+		("keyframes", "Animate only by keyframe tracks of input file, without script: anim or blur", cxxopts::value <string>()->default_value("")->implicit_value("anim"))
 		("framerate", "Framerate", cxxopts::value <size_t>()->default_value("30"))
 		("frames", "Amount of frames", cxxopts::value <size_t>()->default_value("30"))
 		("no-ffmpeg", "Disable output to .mp4 file")
 		("save-frames", "Save frames in temp/")
+		("pipe-format", "Format of frames sent to ffmpeg: rgb24, float (raw video) or png", cxxopts::value <string>()->default_value("rgb24"))
+		("format", "Format of output image: png, pfm or exr. Default is given by extension of output file, "
+			"pfm and exr keep float values without clamping", cxxopts::value <string>())
+		("png-level", "Compression of png images: store, rle, fast, default or best. Store and rle are for frames that are encoded again",
+			cxxopts::value <string>()->default_value("default"))
+		("threads", "Amount of render threads, default is amount of cores. Coordinator divides them between workers", cxxopts::value <size_t>())
+		("writers", "Amount of threads that encode and save animation frames", cxxopts::value <size_t>()->default_value("1"))
+		("relight", "Keep first hits of camera rays between animation frames while camera and geometry do not change")
+		("incremental", "Render only tiles of animation frame that could be changed since previous frame. Noise of samples is the same in all frames, so reused tiles have no seams")
+		("frames-in-flight", "Amount of animation frames that are rendered at the same time", cxxopts::value <size_t>()->default_value("1"))
 		("skip", "Skip first 'arg' frames", cxxopts::value <size_t>()->default_value("0"))
+		("script-profile", "Measure time that script spends in C++ functions, slows script down")
+		("resume", "Continue interrupted animation, frames listed in temp/manifest.txt are not rendered again")
+		("frame-range", "Render frames a:b (b excluded) of animation, overrides --skip and --frames", cxxopts::value <string>())
+		("shard", "Render only shard i/N of frames and save them in temp/, for several processes or machines", cxxopts::value <string>())
+		("shard-layout", "Frames of shard: interleaved (every N-th frame) or contiguous (one block of frames)", cxxopts::value <string>()->default_value("interleaved"))
+		("coordinator", "Start arg worker processes that render shards of animation and send their frames to ffmpeg in order", cxxopts::value <size_t>())
 		("ffmpeg", "Path to ffmpeg", cxxopts::value <string>()->default_value(
 #ifdef _MSC_VER
 			""
@@ -548,6 +1841,9 @@ int main(int argc, char **argv)
 		))
 		("h,help", "Show usage");
 
+	// Parser removes options from argv, coordinator passes them to workers
+	vector <string> args(argv, argv + argc);
+
 	try
 	{
 		auto res = options.parse(argc, argv);
@@ -564,7 +1860,11 @@ int main(int argc, char **argv)
 			return 0;
 		}
 
-		if (res.count("anim"))
+		if (res.count("coordinator"))
+		{
+			return coordinateWorkers(args, res);
+		}
+		else if (res.count("anim"))
 		{
 			renderMultiple(res["i"].as <string>(), res["anim"].as <string>(), res);
 		}
@@ -572,6 +1872,16 @@ int main(int argc, char **argv)
 		{
 			renderMultiple(res["i"].as <string>(), res["blur"].as <string>(), res);
 		}
+		else if (res.count("keyframes"))
+		{
+			string mode = res["keyframes"].as <string>();
+			if (mode != "anim" && mode != "blur")
+			{
+				cerr << "Keyframe mode should be anim or blur\n";
+				return 0;
+			}
+			renderMultiple(res["i"].as <string>(), "", res);
+		}
 		else
 		{
 			renderSingle(res["i"].as <string>(), res);
@@ -0,0 +1,119 @@
+#include "scene.h"
+
+#include <vector>
+#include <algorithm>
+
+using namespace std;
+
+// Relighting keeps first hits of camera rays between frames. When only lights and
+// materials change, shading starts from stored hits and only shadow, reflected and
+// refracted rays are traced
+
+bool Scene::sameGeometry(const Scene &other) const
+{
+	if (camera != other.camera || properties != other.properties || settings != other.settings ||
+		objects.size() != other.objects.size())
+		return false;
+
+	Region a = getRegion(), b = other.getRegion();
+	if (a.x0 != b.x0 || a.y0 != b.y0 || a.x1 != b.x1 || a.y1 != b.y1)
+		return false;
+
+	for (size_t i = 0; i < objects.size(); ++i)
+	{
+		if (!objects[i]->sameShape(*GET_POINTER(other.objects[i])))
+			return false;
+	}
+	return true;
+}
+
+shared_ptr <const GBuffer> Scene::buildGBuffer() const
+{
+	size_t width = camera.getResolution().first;
+	size_t height = camera.getResolution().second;
+	Region reg = getRegion();
+
+	float ratio = static_cast <float>(width) / height;
+	float xm = tan(camera.getFOV());
+	float ym = tan(camera.getFOV() / ratio);
+	float dx = 2.f * xm / width;
+	float dy = 2.f * ym / height;
+	size_t sub = hasProperty(Supersampling) ? settings.at(Scene::Supersampling) : 0;
+
+	bool super = hasProperty(SupersamplingJitter) || hasProperty(SupersamplingGrid);
+	size_t samples = super ? sub * sub : 1;
+	size_t rays = hasProperty(DOF) ? settings.at(DOF) : 0;
+
+	auto res = make_shared <GBuffer>();
+	res->raysPerPixel = samples * (rays + 1);
+	res->hits.resize(reg.width() * reg.height() * res->raysPerPixel);
+
+	forEachTile(reg, [&](size_t x0, size_t y0, size_t x1, size_t y1)
+	{
+		for (size_t y = y0; y < y1; ++y)
+		{
+			// Image rows are counted from the top, rays from the bottom
+			size_t py = height - 1 - (reg.y0 + y);
+			float yf = (2.f * static_cast <float>(py) / height - 1.f) * ym;
+			for (size_t x = x0; x < x1; ++x)
+			{
+				size_t px = reg.x0 + x;
+				float xf = (2.f * static_cast <float>(px) / width - 1.f) * xm;
+				PrimaryHit *hit = &res->hits[(y * reg.width() + x) * res->raysPerPixel];
+
+				forEachCameraRay(px, py, xf, yf, dx, dy, sub, [&](const Ray &ray, float weight, const Sampler &, uint32_t path)
+				{
+					auto [obj, inter] = findIntersectionIndex(ray);
+					*hit++ = { ray, weight, path, static_cast <uint32_t>(obj), inter };
+				});
+			}
+		}
+	});
+
+	tracedRays += res->hits.size();
+	return res;
+}
+
+Framebuffer Scene::renderRelight(const FrameHistory &previous, shared_ptr <const GBuffer> &gbuffer)
+{
+	size_t width = camera.getResolution().first;
+	size_t height = camera.getResolution().second;
+	Region reg = getRegion();
+	Framebuffer data(reg.width(), reg.height());
+
+	for (ObjectRef &obj : objects)
+		obj->updateInverse();
+	updateFrameKey();
+	tracedRays = 0;
+	prunedRays = 0;
+
+	if (previous.gbuffer != nullptr && previous.scene != nullptr && sameGeometry(*previous.scene))
+		gbuffer = previous.gbuffer;
+	else
+		gbuffer = buildGBuffer();
+
+	const GBuffer &g = *gbuffer;
+	forEachTile(reg, [&](size_t x0, size_t y0, size_t x1, size_t y1)
+	{
+		RenderStats stats;
+		for (size_t y = y0; y < y1; ++y)
+		{
+			size_t py = height - 1 - (reg.y0 + y);
+			for (size_t x = x0; x < x1; ++x)
+			{
+				size_t px = reg.x0 + x;
+				Sampler sampler(samplerType, frameKey, static_cast <uint32_t>(px), static_cast <uint32_t>(py),
+					static_cast <uint32_t>(width));
+
+				Color res;
+				const PrimaryHit *hit = &g.hits[(y * reg.width() + x) * g.raysPerPixel];
+				for (size_t i = 0; i < g.raysPerPixel; ++i, ++hit)
+					res += traceRay(hit->ray, hit->weight, camera.getMaxBounces(), sampler, hit->path, stats, nullptr, hit);
+				data.set(x, y, res);
+			}
+		}
+		addStats(stats);
+	});
+
+	return data;
+}
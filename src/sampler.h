@@ -0,0 +1,320 @@
+#ifndef RAYTRACER_SAMPLER_H_
+#define RAYTRACER_SAMPLER_H_
+
+#include "random.h"
+#include "vector.h"
+
+#include <cstdint>
+#include <cmath>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+// Dimensions of sampler used by pixel samples
+enum SampleDimension : uint32_t
+{
+	PixelArea = 0,
+	Lens = 2,
+	Time = 4,
+	Roulette = 8		// Decisions of russian roulette, offset by position of ray in ray tree
+};
+
+// Generates sample positions in [0, 1)^2 for one pixel.
+// Sample is identified by its index and total amount of samples in pixel,
+// dimension selects independent pair of coordinates (pixel area, lens, ...)
+class Sampler
+{
+public:
+	enum class Type : size_t
+	{
+		Random = 0,		// Independent uniform numbers
+		Stratified = 1,	// Correlated multi-jittered sampling
+		Sobol = 2,		// Owen-scrambled Sobol sequence
+		BlueNoise = 3	// Sobol sequence rotated by blue noise mask, error is distributed as blue noise over the image
+	};
+
+private:
+	Type type;
+	RandomSequence rnd;
+	uint32_t x;
+	uint32_t y;
+	uint32_t frameKey;
+
+	static uint32_t reverseBits(uint32_t v)
+	{
+		v = ((v >> 1) & 0x55555555u) | ((v & 0x55555555u) << 1);
+		v = ((v >> 2) & 0x33333333u) | ((v & 0x33333333u) << 2);
+		v = ((v >> 4) & 0x0F0F0F0Fu) | ((v & 0x0F0F0F0Fu) << 4);
+		v = ((v >> 8) & 0x00FF00FFu) | ((v & 0x00FF00FFu) << 8);
+		return (v >> 16) | (v << 16);
+	}
+
+	// Random permutation of [0, l) defined by p (Kensler "Correlated Multi-Jittered Sampling")
+	static uint32_t permute(uint32_t i, uint32_t l, uint32_t p)
+	{
+		uint32_t w = l - 1;
+		w |= w >> 1;
+		w |= w >> 2;
+		w |= w >> 4;
+		w |= w >> 8;
+		w |= w >> 16;
+		do
+		{
+			i ^= p; i *= 0xe170893d;
+			i ^= p >> 16;
+			i ^= (i & w) >> 4;
+			i ^= p >> 8; i *= 0x0929eb3f;
+			i ^= p >> 23;
+			i ^= (i & w) >> 1; i *= 1 | p >> 27;
+			i *= 0x6935fa69;
+			i ^= (i & w) >> 11; i *= 0x74dcb303;
+			i ^= (i & w) >> 2; i *= 0x9e501cc3;
+			i ^= (i & w) >> 2; i *= 0xc860a3df;
+			i &= w;
+			i ^= i >> 5;
+		} while (i >= l);
+		return (i + p) % l;
+	}
+
+	// Owen scrambling of bits of x (Laine, Karras "Stratified Sampling for Stochastic Transparency")
+	static uint32_t nestedUniformScramble(uint32_t x, uint32_t seed)
+	{
+		x = reverseBits(x);
+		x += seed;
+		x ^= x * 0x6c50b47cu;
+		x ^= x * 0xb82f1e52u;
+		x ^= x * 0xc7afe638u;
+		x ^= x * 0x8d22f6e6u;
+		return reverseBits(x);
+	}
+
+	// First two dimensions of Sobol sequence
+	static uint32_t sobol0(uint32_t i)
+	{
+		return reverseBits(i);
+	}
+
+	static uint32_t sobol1(uint32_t i)
+	{
+		uint32_t v = 1u << 31;
+		uint32_t res = 0;
+		for (; i != 0; i >>= 1, v ^= v >> 1)
+		{
+			if (i & 1)
+				res ^= v;
+		}
+		return res;
+	}
+
+	// Owen-scrambled 2d Sobol point (Burley "Practical Hash-based Owen Scrambling")
+	static Vector2f sobolScrambled(uint32_t sample, uint32_t seed)
+	{
+		uint32_t index = nestedUniformScramble(sample, seed);
+		return {
+			toUnitFloat(nestedUniformScramble(sobol0(index), pcgHash(seed ^ 0xa511e9b3u))),
+			toUnitFloat(nestedUniformScramble(sobol1(index), pcgHash(seed ^ 0x63d83595u)))
+		};
+	}
+
+	Vector2f stratified(uint32_t sample, uint32_t count, uint32_t seed) const
+	{
+		// Divide pixel in m x n cells
+		uint32_t m = std::max(1u, static_cast <uint32_t>(std::sqrt(static_cast <float>(count))));
+		uint32_t n = (count + m - 1) / m;
+		sample = permute(sample, count, seed * 0x51633e2du);
+
+		uint32_t sx = permute(sample % m, m, seed * 0xa511e9b3u);
+		uint32_t sy = permute(sample / m, n, seed * 0x63d83595u);
+		float jx = toUnitFloat(pcgHash(sample ^ (seed * 0xa399d265u)));
+		float jy = toUnitFloat(pcgHash(sample ^ (seed * 0x711ad6a5u)));
+
+		return {
+			(sample % m + (sy + jx) / n) / m,
+			(sample / m + (sx + jy) / m) / n
+		};
+	}
+
+	// Blue noise masks are generated once with void-and-cluster method (Ulichney)
+	static constexpr uint32_t MaskSize = 64;
+
+	static std::vector <float> generateBlueNoise(uint32_t seed)
+	{
+		const int size = static_cast <int>(MaskSize);
+		const int n = size * size;
+		const float sigma = 1.5f;
+
+		// Energy contribution of point for every toroidal offset
+		std::vector <float> kernel(n);
+		for (int dy = 0; dy < size; ++dy)
+		{
+			for (int dx = 0; dx < size; ++dx)
+			{
+				int tx = std::min(dx, size - dx);
+				int ty = std::min(dy, size - dy);
+				kernel[dy * size + dx] = std::exp(-(tx * tx + ty * ty) / (2.f * sigma * sigma));
+			}
+		}
+
+		std::vector <bool> pattern(n, false);
+		std::vector <float> energy(n, 0.f);
+		auto update = [&](int p, float sign)
+		{
+			int px = p % size, py = p / size;
+			for (int y = 0; y < size; ++y)
+			{
+				for (int x = 0; x < size; ++x)
+				{
+					int dx = (x - px + size) % size;
+					int dy = (y - py + size) % size;
+					energy[y * size + x] += sign * kernel[dy * size + dx];
+				}
+			}
+		};
+		auto find = [&](bool value, bool tightest)
+		{
+			int best = -1;
+			for (int i = 0; i < n; ++i)
+			{
+				if (pattern[i] != value)
+					continue;
+				if (best < 0 || (tightest ? energy[i] > energy[best] : energy[i] < energy[best]))
+					best = i;
+			}
+			return best;
+		};
+
+		// Initial random pattern with 10% of points set
+		int ones = 0;
+		for (uint32_t i = 0; ones < n / 10; ++i)
+		{
+			int p = static_cast <int>(pcgHash(seed ^ pcgHash(i)) % n);
+			if (!pattern[p])
+			{
+				pattern[p] = true;
+				update(p, 1.f);
+				++ones;
+			}
+		}
+
+		// Move points from tightest clusters to largest voids until pattern is stable
+		while (true)
+		{
+			int cluster = find(true, true);
+			pattern[cluster] = false;
+			update(cluster, -1.f);
+			int v = find(false, false);
+			pattern[v] = true;
+			update(v, 1.f);
+			if (v == cluster)
+				break;
+		}
+
+		std::vector <float> rank(n);
+		std::vector <bool> initial = pattern;
+		std::vector <float> initialEnergy = energy;
+
+		// Rank initial points by removing tightest clusters
+		for (int r = ones - 1; r >= 0; --r)
+		{
+			int cluster = find(true, true);
+			pattern[cluster] = false;
+			update(cluster, -1.f);
+			rank[cluster] = static_cast <float>(r);
+		}
+
+		// Rank remaining points by filling largest voids
+		pattern = initial;
+		energy = initialEnergy;
+		for (int r = ones; r < n; ++r)
+		{
+			int v = find(false, false);
+			pattern[v] = true;
+			update(v, 1.f);
+			rank[v] = static_cast <float>(r);
+		}
+
+		for (float &r : rank)
+			r = (r + 0.5f) / n;
+		return rank;
+	}
+
+	static const std::vector <float> & getBlueNoise(size_t channel)
+	{
+		static const std::vector <float> masks[2] = { generateBlueNoise(0x9e3779b9u), generateBlueNoise(0x7f4a7c15u) };
+		return masks[channel];
+	}
+
+	Vector2f blueNoise(uint32_t sample, uint32_t dimension) const
+	{
+		// Same sequence for every pixel, shifted by value of blue noise mask in this pixel.
+		// Mask is moved every frame and for every dimension to avoid correlation
+		uint32_t seed = pcgHash(frameKey ^ pcgHash(dimension));
+		Vector2f u = sobolScrambled(sample, seed);
+		uint32_t mx = (x + (seed & 0xFF)) % MaskSize;
+		uint32_t my = (y + ((seed >> 8) & 0xFF)) % MaskSize;
+		for (size_t i = 0; i < 2; ++i)
+		{
+			u[i] += getBlueNoise(i)[my * MaskSize + mx];
+			if (u[i] >= 1.f)
+				u[i] -= 1.f;
+		}
+		return u;
+	}
+
+public:
+	Sampler(Type type, uint32_t frameKey, uint32_t x, uint32_t y, uint32_t width) :
+		type(type),
+		rnd(frameKey, y * width + x),
+		x(x),
+		y(y),
+		frameKey(frameKey)
+	{
+
+	}
+
+	static bool parseType(const std::string &name, Type &type)
+	{
+		if (name == "random")
+			type = Type::Random;
+		else if (name == "stratified")
+			type = Type::Stratified;
+		else if (name == "sobol")
+			type = Type::Sobol;
+		else if (name == "bluenoise")
+			type = Type::BlueNoise;
+		else
+			return false;
+		return true;
+	}
+
+	// Build blue noise masks before rendering starts
+	static void prepare(Type type)
+	{
+		if (type == Type::BlueNoise)
+			getBlueNoise(0);
+	}
+
+	// Independent random number, used for decisions that do not need stratification
+	float get1D(uint32_t sample, uint32_t dimension) const
+	{
+		return rnd.get(sample, dimension);
+	}
+
+	// Get 2d sample with given index out of count samples in pixel
+	Vector2f get2D(uint32_t sample, uint32_t count, uint32_t dimension) const
+	{
+		switch (type)
+		{
+		case Type::Stratified:
+			return stratified(sample, std::max(count, 1u), rnd.getBits(~0u, dimension));
+		case Type::Sobol:
+			return sobolScrambled(sample, rnd.getBits(~0u, dimension));
+		case Type::BlueNoise:
+			return blueNoise(sample, dimension);
+		default:
+			return { rnd.get(sample, dimension), rnd.get(sample, dimension + 1) };
+		}
+	}
+};
+
+#endif  // RAYTRACER_SAMPLER_H_
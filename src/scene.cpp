@@ -8,59 +8,81 @@
 #include <string>
 #include <thread>
 #include <future>
-#include <random>
 #include <atomic>
-
-#ifdef LUA_BINDING_OFF
-#define GET_POINTER(x) (x)
-#else
-#define GET_POINTER(x) (x).get()
-#endif
+#include <limits>
+#include <iostream>
 
 using namespace std;
 
-thread_local static bool inside = false;
+// Ray waiting to be traced together with its weight in final color
+struct TraceTask
+{
+	Ray ray;
+	float throughput;
+	size_t bounces;
+	bool inside;		// Ray travels inside of object
+	uint32_t node;		// Position in ray tree, children of node n are 2n and 2n + 1
+};
 
-struct RandomGenerator
+// Stack of pending rays. Depth-first order keeps it at most (bounces + 1) tasks deep,
+// so it does not allocate unless scene has very deep recursion
+class TraceStack
 {
-	random_device rd;
-	mt19937 randomEngine;
-	uniform_real_distribution <float> dist;
-	//static atomic <size_t> count;
+	static constexpr size_t InlineSize = 32;
+	TraceTask local[InlineSize];
+	vector <TraceTask> overflow;
+	size_t count = 0;
 
-	RandomGenerator() :
-		rd(), randomEngine(rd()), dist(0.f, 1.f)
+public:
+	void push(const TraceTask &task)
 	{
-		//count.fetch_add(1u);
-		//cerr << count;
+		if (count < InlineSize)
+			local[count] = task;
+		else
+			overflow.push_back(task);
+		++count;
 	}
 
-	float next()
+	TraceTask pop()
 	{
-		return dist(randomEngine);
+		--count;
+		if (count < InlineSize)
+			return local[count];
+
+		TraceTask task = overflow.back();
+		overflow.pop_back();
+		return task;
 	}
-};
 
-//atomic <size_t> RandomGenerator::count(0);
+	bool empty() const
+	{
+		return count == 0;
+	}
+};
 
-float getRandom()
+Scene::Scene() :
+	Scene(make_shared <ctpl::thread_pool>(thread::hardware_concurrency()))
 {
-	// We want to make unique copy for every thread because generator is not thread safe
-	thread_local RandomGenerator rg;
-
-	return rg.next();
 }
 
-Vector2f getRandomInRadius(float r)
+Scene::Scene(size_t threads) :
+	Scene(make_shared <ctpl::thread_pool>(static_cast <int>(threads)))
 {
-	r = r * sqrt(getRandom());
-	float theta = getRandom() * 2.f * static_cast <float>(M_PI);
-	return { r * cos(theta), r * sin(theta) };
 }
 
-Scene::Scene() :
-	pool(thread::hardware_concurrency()),
-	properties(0)
+Scene::Scene(shared_ptr <ctpl::thread_pool> pool) :
+	pool(pool),
+	properties(0),
+	cameraMoving(false),
+	frame(0),
+	frameKey(0),
+	samplerType(Sampler::Type::Stratified),
+	minThroughput(0.f),
+	rouletteThreshold(0.f),
+	tracedRays(0),
+	prunedRays(0),
+	lastTiles(0),
+	lastReused(0)
 {
 }
 
@@ -75,6 +97,31 @@ Scene::~Scene()
 #endif
 }
 
+unique_ptr <Scene> Scene::snapshot() const
+{
+	unique_ptr <Scene> res(new Scene(pool));
+	res->properties = properties;
+	res->background = background;
+	res->camera = camera;
+	res->cameraMotion = cameraMotion;
+	res->cameraMoving = cameraMoving;
+	res->outputFile = outputFile;
+	res->frame = frame;
+	res->region = region;
+	res->minThroughput = minThroughput;
+	res->rouletteThreshold = rouletteThreshold;
+	res->settings = settings;
+
+	res->lights.reserve(lights.size());
+	for (const LightRef &light : lights)
+		res->lights.push_back(LightRef(light->clone()));
+	res->objects.reserve(objects.size());
+	for (const ObjectRef &obj : objects)
+		res->objects.push_back(ObjectRef(obj->clone()));
+
+	return res;
+}
+
 bool Scene::loadScene(const string &filename)
 {
 	SceneParser scene(filename);
@@ -83,13 +130,25 @@ bool Scene::loadScene(const string &filename)
 
 	for (Light *light : scene.getLights())
 		lights.push_back(light);
-	for (Object *obj : scene.getSurfaces())
+	for (Object *obj : scene.getSurfaces(*pool, hasProperty(LazyLoading)))
 		objects.push_back(obj);
 
 	camera = scene.getCamera();
 	background = scene.getBackgroundColor();
 	outputFile = scene.getOutputFile();
 
+	animation = scene.getAnimation();
+	for (const Animation::Channel &channel : animation.channels)
+	{
+		if ((channel.target == Animation::Target::Object && channel.index >= objects.size()) ||
+			(channel.target == Animation::Target::Light && channel.index >= lights.size()))
+			cerr << "Animation track refers to missing " << (channel.target == Animation::Target::Object ? "object " : "light ")
+				<< channel.index << ", track is ignored\n";
+	}
+	animation.baseTransforms.clear();
+	for (const ObjectRef &obj : objects)
+		animation.baseTransforms.push_back(obj->getTransform());
+
 	return true;
 }
 
@@ -98,202 +157,229 @@ string Scene::getOutputFile() const
 	return outputFile;
 }
 
-Color Scene::traceRay(const Ray &ray, size_t bounces) const
+void Scene::setFrame(size_t n)
 {
-	Color res;
-
-	const auto &[obj, inter] = findIntersection(ray);
-
-	if (obj == nullptr)
-		return background;
-
-	Material *mat = GET_POINTER(obj->material);
-	bool hitFromBehind = (inter.normal * ray.dir) > 0.f;
-	for (size_t i = 0; i < lights.size(); ++i)
-	{
-		if (!lights[i]->isOn())
-			continue;
-
-		if (lights[i]->isDirectional())
-		{
-			// Cast ray from point of intersection to light source
-			auto[lightDir, lightDist] = lights[i]->getDirection(inter.pos);
-			Ray lightRay(inter.pos + inter.normal * (hitFromBehind ? -0.0001f : 0.0001f), lightDir);
-			// Check if something is in the way of ray
-			const auto &[obj, lightInter] = findIntersection(lightRay);
-			if (obj != nullptr)
-			{
-				float dist = (lightInter.pos - inter.pos).length();
-				if (lightDist > dist)
-					continue;
-			}
-		}
-		else if (inside)
-		{
-			// Do not apply ambient light inside objects
-			continue;
-		}		
-		
-		res += lights[i]->getColor(inter, ray.pos, mat);
-	}
-
-	res *= (1.f - mat->reflectance - mat->transmittance);
+	frame = n;
+}
 
-	if (bounces == 0)
-		return res;
+void Scene::setPruning(float minThroughput, float rouletteThreshold)
+{
+	this->minThroughput = minThroughput;
+	this->rouletteThreshold = rouletteThreshold;
+}
 
-	if (mat->reflectance > 0.f)
-	{
-		Ray refl = ray.reflect(
-			inter.pos,
-			(inter.normal * ray.dir) > 0 ? -inter.normal : inter.normal,
-			0.0001f);
-		refl.dir.normalize();
-		res += traceRay(refl, bounces - 1) * mat->reflectance;
-	}
+void Scene::setRegion(const Region &r)
+{
+	region = r;
+	setProperty(Crop);
+}
 
-	if (mat->transmittance > 0.f)
+Region Scene::getRegion() const
+{
+	Region res;
+	res.x1 = camera.getResolution().first;
+	res.y1 = camera.getResolution().second;
+	if (hasProperty(Crop))
 	{
-		auto [refr, refracted, negated] = ray.refract(inter.pos, inter.normal, 1.f, mat->refraction, 0.0001f);
-		refr.dir.normalize();
-		
-		if (refracted)
-			inside = !inside;
-		res += traceRay(refr, bounces - 1) * mat->transmittance;
-		if (refracted)
-			inside = !inside;
+		res.x0 = min(region.x0, res.x1);
+		res.y0 = min(region.y0, res.y1);
+		res.x1 = max(res.x0, min(region.x1, res.x1));
+		res.y1 = max(res.y0, min(region.y1, res.y1));
 	}
-
 	return res;
 }
 
-Color Scene::traceReal(const Vector3f &d) const
+RenderStats Scene::getStats() const
 {
-	Color res;
-	size_t rays = settings.at(Scene::DOF);
-	Vector3f focalPoint = d * camera.getFocalLength();
-
-	for (size_t i = 0; i < rays; ++i)
-	{
-		Vector3f r(getRandomInRadius(camera.getAperture()), 0.f);
-		Vector3f dr = focalPoint - r;
-		dr.normalize();
-		dr = camera.getView() * dr;
-		r = camera.getView() * r;
-
-		Ray ray(camera.getPosition() + r, dr);
-		inside = false;
-		res += traceRay(ray, camera.getMaxBounces());
-	}
-
-	Vector3f dir = camera.getView() * d;
-	Ray ray(camera.getPosition(), dir);
-	inside = false;
-	res += traceRay(ray, camera.getMaxBounces());
+	RenderStats stats;
+	stats.rays = tracedRays.load();
+	stats.pruned = prunedRays.load();
+	stats.tiles = lastTiles;
+	stats.reused = lastReused;
+	return stats;
+}
 
-	res /= static_cast <float>(rays + 1);
-	return res;
+void Scene::updateFrameKey(bool perFrame)
+{
+	size_t seed = settings.count(Scene::Seed) ? settings.at(Scene::Seed) : 0;
+	frameKey = RandomSequence::frameKey(static_cast <uint32_t>(seed), static_cast <uint32_t>(perFrame ? frame : 0));
+	if (settings.count(Scene::SamplerType))
+		samplerType = static_cast <Sampler::Type>(settings.at(Scene::SamplerType));
+	Sampler::prepare(samplerType);
 }
 
-Color Scene::supersampleGrid(float xf, float yf, float dx, float dy, size_t sub) const
+Color Scene::traceRay(const Ray &primary, float weight, size_t maxBounces, const Sampler &sampler, uint32_t path,
+	RenderStats &stats, TileInfluence *influence, const PrimaryHit *firstHit) const
 {
 	Color res;
-	float sub_xf = xf - (dx / 2.f) + (dx / (sub * 2));
-	for (size_t sub_x = 0; sub_x < sub; ++sub_x)
+	TraceStack stack;
+	// Throughput includes weight of camera ray, thresholds are relative to camera ray,
+	// so more samples per pixel do not prune more branches
+	float minWeighted = minThroughput * weight;
+	float rouletteWeighted = rouletteThreshold * weight;
+
+	stack.push({ primary, weight, maxBounces, false, 1 });
+	while (!stack.empty())
 	{
-		float sub_yf = yf - (dy / 2.f) + (dy / (sub * 2));
-		for (size_t sub_y = 0; sub_y < sub; ++sub_y)
+		TraceTask task = stack.pop();
+		const Ray &ray = task.ray;
+
+		pair <Object *, Intersection> hit;
+		if (task.node == 1 && firstHit != nullptr)
+			hit = { firstHit->object < objects.size() ? GET_POINTER(objects[firstHit->object]) : nullptr, firstHit->inter };
+		else
+		{
+			hit = findIntersection(ray);
+			++stats.rays;
+		}
+		const auto &[obj, inter] = hit;
+
+		// Primary rays are covered by their tile on screen
+		if (influence != nullptr && task.node != 1)
 		{
-			Vector3f d(sub_xf, sub_yf, -1.f);
-			d.normalize();
-			if (hasProperty(Scene::DOF))
-				res += traceReal(d);
+			if (obj == nullptr)
+				influence->unbounded = true;
 			else
 			{
-				d = camera.getView() * d;
-				Ray ray(camera.getPosition(), d);
-				inside = false;
-				res += traceRay(ray, camera.getMaxBounces());
+				influence->segments.expand(ray.pos);
+				influence->segments.expand(inter.pos);
 			}
+		}
 
-			sub_yf += dy / sub;
+		if (obj == nullptr)
+		{
+			res += background * task.throughput;
+			continue;
 		}
-		sub_xf += dx / sub;
-	}
-	res /= static_cast <float> (sub * sub);
-	return res;
-}
 
-Color Scene::supersampleJitter(float xf, float yf, float dx, float dy, size_t sub) const
-{
-	Color res;
+		if (influence != nullptr)
+			influence->lit = true;
 
-	float sub_xf = xf - dx / 2.f;
-	for (size_t sub_x = 0; sub_x < sub; ++sub_x)
-	{
-		float sub_yf = yf - dy / 2.f;
-		for (size_t sub_y = 0; sub_y < sub; ++sub_y)
+		Color local;
+		Material *mat = GET_POINTER(obj->material);
+		bool hitFromBehind = (inter.normal * ray.dir) > 0.f;
+		for (size_t i = 0; i < lights.size(); ++i)
 		{
-			Vector3f d(
-				getRandom() * (dx / sub) + sub_xf,
-				getRandom() * (dy / sub) + sub_yf,
-				-1.f);
+			if (!lights[i]->isOn())
+				continue;
+
+			if (lights[i]->isDirectional())
+			{
+				// Cast ray from point of intersection to light source
+				auto[lightDir, lightDist] = lights[i]->getDirection(inter.pos);
+				Ray lightRay(inter.pos + inter.normal * (hitFromBehind ? -0.0001f : 0.0001f), lightDir, ray.time);
+				if (influence != nullptr)
+				{
+					if (isinf(lightDist))
+						influence->sweeps[i].expand(lightRay.pos);
+					else
+					{
+						influence->segments.expand(lightRay.pos);
+						influence->segments.expand(lightRay.pos + lightDir * lightDist);
+					}
+				}
+				// Check if something is in the way of ray
+				const auto &[obj, lightInter] = findIntersection(lightRay);
+				if (obj != nullptr)
+				{
+					float dist = (lightInter.pos - inter.pos).length();
+					if (lightDist > dist)
+						continue;
+				}
+			}
+			else if (task.inside)
+			{
+				// Do not apply ambient light inside objects
+				continue;
+			}
+
+			local += lights[i]->getColor(inter, ray.pos, mat);
+		}
 
-			d.normalize();
+		res += local * ((1.f - mat->reflectance - mat->transmittance) * task.throughput);
 
-			if (hasProperty(Scene::DOF))
-				res += traceReal(d);
-			else
+		if (task.bounces == 0)
+			continue;
+
+		// Decide if branch with given throughput is worth tracing, adjust throughput of survivors
+		auto keep = [&](float &throughput, uint32_t node)
+		{
+			if (throughput < minWeighted)
+			{
+				++stats.pruned;
+				return false;
+			}
+			if (throughput < rouletteWeighted)
 			{
-				d = camera.getView() * d;
-				Ray ray(camera.getPosition(), d);
-				inside = false;
-				res += traceRay(ray, camera.getMaxBounces());
+				float p = throughput / rouletteWeighted;
+				if (sampler.get1D(path, Roulette + node) >= p)
+				{
+					++stats.pruned;
+					return false;
+				}
+				throughput = rouletteWeighted;
 			}
+			return true;
+		};
 
-			sub_yf += dy / sub;
+		if (mat->transmittance > 0.f)
+		{
+			float throughput = task.throughput * mat->transmittance;
+			if (keep(throughput, task.node * 2 + 1))
+			{
+				auto [refr, refracted, negated] = ray.refract(inter.pos, inter.normal, 1.f, mat->refraction, 0.0001f);
+				refr.dir.normalize();
+				stack.push({ refr, throughput, task.bounces - 1, refracted ? !task.inside : task.inside, task.node * 2 + 1 });
+			}
+		}
+
+		if (mat->reflectance > 0.f)
+		{
+			float throughput = task.throughput * mat->reflectance;
+			if (keep(throughput, task.node * 2))
+			{
+				Ray refl = ray.reflect(
+					inter.pos,
+					(inter.normal * ray.dir) > 0 ? -inter.normal : inter.normal,
+					0.0001f);
+				refl.dir.normalize();
+				stack.push({ refl, throughput, task.bounces - 1, task.inside, task.node * 2 });
+			}
 		}
-		sub_xf += dx / sub;
 	}
-	res /= static_cast <float> (sub * sub);
 
 	return res;
 }
 
-Color Scene::getPixel(float xf, float yf, float dx, float dy, size_t sub) const
+Color Scene::getPixel(size_t x, size_t y, float xf, float yf, float dx, float dy, size_t sub, RenderStats &stats,
+	TileInfluence *influence) const
 {
-	if (hasProperty(SupersamplingJitter))
-	{
-		return supersampleJitter(xf, yf, dx, dy, sub);
-	}
-	else if (hasProperty(SupersamplingGrid))
-	{
-		return supersampleGrid(xf, yf, dx, dy, sub);
-	}
-	else
+	Color res;
+	forEachCameraRay(x, y, xf, yf, dx, dy, sub, [&](const Ray &ray, float weight, const Sampler &sampler, uint32_t path)
 	{
-		Vector3f d(xf, yf, -1.f);
-		d.normalize();
-		if (hasProperty(DOF))
-		{
-			return traceReal(d);
-		}
+		res += traceRay(ray, weight, camera.getMaxBounces(), sampler, path, stats, influence);
+	});
+	return res;
+}
 
-		d = camera.getView() * d;
-		Ray ray(camera.getPosition(), d);
-		inside = false;
-		return traceRay(ray, camera.getMaxBounces());
-	}
+void Scene::addStats(const RenderStats &stats) const
+{
+	tracedRays.fetch_add(stats.rays, memory_order_relaxed);
+	if (stats.pruned != 0)
+		prunedRays.fetch_add(stats.pruned, memory_order_relaxed);
 }
 
-vector <vector <Color>> Scene::render()
+Framebuffer Scene::render()
 {
-	vector <vector <Color>> data;
-	data.resize(camera.getResolution().first);
+	Region reg = getRegion();
+	Framebuffer data(reg.width(), reg.height());
 
 	// Check if transforms of objects were changed since last render call and update inverce matrices if needed
-	for (ObjectRef obj: objects)
+	for (ObjectRef &obj : objects)
 		obj->updateInverse();
+	updateFrameKey();
+	tracedRays = 0;
+	prunedRays = 0;
 
 	float ratio = static_cast <float>(camera.getResolution().first) / camera.getResolution().second;
 	float xm = tan(camera.getFOV());
@@ -305,32 +391,37 @@ vector <vector <Color>> Scene::render()
 	size_t subPixels = hasProperty(Supersampling) ? settings.at(Scene::Supersampling) : 0;
 
 	// Generate rays
-	for (size_t x = 0; x < camera.getResolution().first; ++x)
+	size_t height = camera.getResolution().second;
+	RenderStats stats;
+	for (size_t x = reg.x0; x < reg.x1; ++x)
 	{
-		data[x].resize(camera.getResolution().second);
-		
 		float xf = static_cast <float>(x) / camera.getResolution().first;
 		xf = (2.f * xf - 1.f) * xm;
-		for (size_t y = 0; y < camera.getResolution().second; ++y)
+		// Image rows are counted from the top, rays from the bottom
+		for (size_t y = height - reg.y1; y < height - reg.y0; ++y)
 		{
 			float yf = static_cast <float>(y) / camera.getResolution().second;
 			yf = (2.f * yf - 1.f) * ym;
 
-			data[x][camera.getResolution().second - y - 1] = getPixel(xf, yf, dx, dy, subPixels);
+			data.set(x - reg.x0, height - y - 1 - reg.y0, getPixel(x, y, xf, yf, dx, dy, subPixels, stats));
 		}
 	}
+	addStats(stats);
 
 	return data;
 }
 
-vector <vector <Color>> Scene::renderParallel()
+Framebuffer Scene::renderParallel()
 {
-	vector <vector <Color>> data;
-	data.resize(camera.getResolution().first);
+	Region reg = getRegion();
+	Framebuffer data(reg.width(), reg.height());
 
 	// Check if transforms of objects were changed since last render call and update inverce matrices if needed
 	for (ObjectRef &obj : objects)
 		obj->updateInverse();
+	updateFrameKey();
+	tracedRays = 0;
+	prunedRays = 0;
 
 	float ratio = static_cast <float>(camera.getResolution().first) / camera.getResolution().second;
 	float xm = tan(camera.getFOV());
@@ -341,44 +432,49 @@ vector <vector <Color>> Scene::renderParallel()
 	float dy = 2.f * ym / camera.getResolution().second;
 	size_t sub = hasProperty(Supersampling) ? settings.at(Scene::Supersampling) : 0;
 
-	vector <future <vector <Color>>> fut;
-	fut.reserve(camera.getResolution().first);
-
-	for (size_t x = 0; x < camera.getResolution().first; ++x)
+	// Every task writes its own tile of framebuffer
+	forEachTile(reg, [&](size_t x0, size_t y0, size_t x1, size_t y1)
 	{
-		float xf = static_cast <float>(x) / camera.getResolution().first;
-		xf = (2 * xf - 1) * xm;
-
-		fut.push_back(pool.push([this](int id, float xf, float ym, float dx, float dy, size_t sub)
-		{
-			return this->traceColumn(xf, ym, dx, dy, sub);
-		}, xf, ym, dx, dy, sub));
-	}
-	
-	for (size_t i = 0; i < fut.size(); ++i)
-		data[i] = fut[i].get();
+		traceTile(x0, y0, xm, ym, dx, dy, sub, reg, data.tile(x0, y0, x1 - x0, y1 - y0));
+	});
 
 	return data;
 }
 
-vector <Color> Scene::traceColumn(float xf, float ym, float dx, float dy, size_t sub) const
+void Scene::traceTile(size_t x0, size_t y0, float xm, float ym, float dx, float dy, size_t sub, const Region &reg,
+	Framebuffer::Tile data) const
 {
-	vector <Color> data;
+	size_t height = camera.getResolution().second;
+	RenderStats stats;
 
-	data.resize(camera.getResolution().second);
-	for (size_t y = 0; y < camera.getResolution().second; ++y)
+	// Rows of tile are written one after another, image rows are counted from the top, rays from the bottom
+	for (size_t ty = 0; ty < data.height(); ++ty)
 	{
+		size_t y = height - 1 - (reg.y0 + y0 + ty);
 		float yf = static_cast <float>(y) / camera.getResolution().second;
 		yf = (2 * yf - 1) * ym;
-		data[camera.getResolution().second - y - 1] = getPixel(xf, yf, dx, dy, sub);
+		for (size_t tx = 0; tx < data.width(); ++tx)
+		{
+			size_t x = reg.x0 + x0 + tx;
+			float xf = static_cast <float>(x) / camera.getResolution().first;
+			xf = (2 * xf - 1) * xm;
+			data.set(tx, ty, getPixel(x, y, xf, yf, dx, dy, sub, stats));
+		}
 	}
-	return data;
+	addStats(stats);
 }
 
 pair <Object *, Intersection> Scene::findIntersection(const Ray &ray) const
 {
-	float dist;
-	Object *obj = nullptr;
+	auto [i, inter] = findIntersectionIndex(ray);
+	return { i < objects.size() ? GET_POINTER(objects[i]) : nullptr, inter };
+}
+
+// Returns index of closest object or objects.size() if ray does not hit anything
+pair <size_t, Intersection> Scene::findIntersectionIndex(const Ray &ray) const
+{
+	float dist = numeric_limits <float>::max();
+	size_t obj = objects.size();
 	Intersection inter;
 	// Iterate through all objects and find closest intersection
 	for (size_t i = 0; i < objects.size(); ++i)
@@ -387,10 +483,10 @@ pair <Object *, Intersection> Scene::findIntersection(const Ray &ray) const
 		if (in.first)
 		{
 			float d = (ray.pos - in.second.pos).sqrLength();
-			if (obj == nullptr || d < dist)
+			if (obj == objects.size() || d < dist)
 			{
 				dist = d;
-				obj = GET_POINTER(objects[i]);
+				obj = i;
 				inter = in.second;
 			}
 		}
@@ -424,6 +520,23 @@ void Scene::setCamera(const Camera &cam)
 	camera = cam;
 }
 
+float Scene::addMotionKey(const Scene &state)
+{
+	auto cameraTransform = [](const Camera &c)
+	{
+		return Matrix4f::fromTranslation(c.getPosition()) * c.getView();
+	};
+	if (cameraMotion.size() == 0)
+		cameraMotion.addKey(cameraTransform(camera));
+	float angle = cameraMotion.addKey(cameraTransform(state.camera));
+	cameraMoving = cameraMoving || state.camera.getPosition() != camera.getPosition() || state.camera.getView() != camera.getView();
+
+	for (size_t i = 0; i < min(objects.size(), state.objects.size()); ++i)
+		angle = max(angle, objects[i]->addMotionKey(state.objects[i]->getTransform()));
+	setProperty(MotionBlur);
+	return angle;
+}
+
 Scene::ObjectRef Scene::getObject(size_t n)
 {
 	return objects[n];
@@ -479,3 +592,13 @@ size_t Scene::lightsSize() const
 {
 	return lights.size();
 }
+
+Object & Scene::objectAt(size_t n)
+{
+	return *GET_POINTER(objects[n]);
+}
+
+Light & Scene::lightAt(size_t n)
+{
+	return *GET_POINTER(lights[n]);
+}
@@ -5,15 +5,164 @@
 #include "light.h"
 #include "camera.h"
 #include "color.h"
+#include "framebuffer.h"
+#include "sampler.h"
+#include "animation.h"
 
 #include "ctpl_stl.h"
 
+#include <algorithm>
+#include <atomic>
+#include <future>
+#include <limits>
+#include <memory>
+
 //#define LUA_BINDING_OFF
 
 #ifndef LUA_BINDING_OFF
 #include "LuaBridge/RefCountedPtr.h"
 #endif
 
+#ifdef LUA_BINDING_OFF
+#define GET_POINTER(x) (x)
+#else
+#define GET_POINTER(x) (x).get()
+#endif
+
+// Ray counters of last render call
+struct RenderStats
+{
+	size_t rays = 0;	// Reflected, refracted and primary rays that were traced
+	size_t pruned = 0;	// Branches dropped because of low throughput or russian roulette
+	size_t tiles = 0;	// Tiles of incremental render
+	size_t reused = 0;	// Tiles copied from previous frame
+
+	void operator +=(const RenderStats &rhs)
+	{
+		rays += rhs.rays;
+		pruned += rhs.pruned;
+		tiles += rhs.tiles;
+		reused += rhs.reused;
+	}
+};
+
+// Axis aligned box, empty until some point is added
+struct Bounds
+{
+	Vector3f min{ std::numeric_limits <float>::max(), std::numeric_limits <float>::max(), std::numeric_limits <float>::max() };
+	Vector3f max{ -std::numeric_limits <float>::max(), -std::numeric_limits <float>::max(), -std::numeric_limits <float>::max() };
+
+	bool empty() const
+	{
+		return min[0] > max[0];
+	}
+
+	void expand(const Vector3f &p)
+	{
+		for (size_t i = 0; i < 3; ++i)
+		{
+			min[i] = std::min(min[i], p[i]);
+			max[i] = std::max(max[i], p[i]);
+		}
+	}
+
+	void expand(const Bounds &b)
+	{
+		if (!b.empty())
+		{
+			expand(b.min);
+			expand(b.max);
+		}
+	}
+
+	bool intersects(const Bounds &b) const
+	{
+		if (empty() || b.empty())
+			return false;
+		for (size_t i = 0; i < 3; ++i)
+		{
+			if (b.max[i] < min[i] || b.min[i] > max[i])
+				return false;
+		}
+		return true;
+	}
+
+	// Check if box moved along dir by any non-negative distance intersects b
+	bool sweepIntersects(const Vector3f &dir, const Bounds &b) const
+	{
+		if (empty() || b.empty())
+			return false;
+
+		// Equivalent to ray from origin hitting box b - this
+		float tNear = 0.f;
+		float tFar = std::numeric_limits <float>::infinity();
+		for (size_t i = 0; i < 3; ++i)
+		{
+			float lo = b.min[i] - max[i];
+			float hi = b.max[i] - min[i];
+			if (dir[i] == 0.f)
+			{
+				if (lo > 0.f || hi < 0.f)
+					return false;
+				continue;
+			}
+			float t1 = lo / dir[i];
+			float t2 = hi / dir[i];
+			tNear = std::max(tNear, std::min(t1, t2));
+			tFar = std::min(tFar, std::max(t1, t2));
+		}
+		return tNear <= tFar;
+	}
+};
+
+// Parts of space that rays of one image tile went through, collected while tile is traced.
+// Object that changes somewhere else can not affect pixels of tile
+struct TileInfluence
+{
+	Bounds segments;				// Reflected, refracted and shadow rays that end in known point
+	std::vector <Bounds> sweeps;	// Origins of shadow rays towards lights at infinite distance, per light
+	bool unbounded = false;			// Some reflected or refracted ray left the scene
+	bool lit = false;				// Some ray hit an object, so any change of lights changes tile
+};
+
+// Rectangle of image in pixels. (x0, y0) is top left corner, x1 and y1 are exclusive
+struct Region
+{
+	size_t x0 = 0;
+	size_t y0 = 0;
+	size_t x1 = 0;
+	size_t y1 = 0;
+
+	size_t width() const
+	{
+		return x1 - x0;
+	}
+
+	size_t height() const
+	{
+		return y1 - y0;
+	}
+};
+
+// Camera ray together with its first hit, stored for relighting
+struct PrimaryHit
+{
+	Ray ray;
+	float weight;
+	uint32_t path;		// Index of camera ray in pixel
+	uint32_t object;	// Index of object that was hit, or amount of objects if ray missed
+	Intersection inter;
+};
+
+// First hits of all camera rays of image. It stays valid while camera and geometry do not change
+struct GBuffer
+{
+	size_t raysPerPixel = 0;
+	std::vector <PrimaryHit> hits;	// Pixels row by row from the top, every pixel has raysPerPixel hits
+};
+
+struct FrameHistory;
+
 // Contains all information about scene
 class Scene
 {
@@ -22,7 +171,13 @@ public:
 		SupersamplingGrid = 1,
 		SupersamplingJitter = 2,
 		Supersampling = 3,
-		DOF = 4
+		DOF = 4,
+		Seed = 8,
+		SamplerType = 16,
+		Wavefront = 32,
+		Crop = 64,
+		MotionBlur = 128,
+		LazyLoading = 256
 	};
 
 #ifndef LUA_BINDING_OFF
@@ -37,31 +192,107 @@ private:
 	unsigned properties;
 	Color background;
 	Camera camera;
+	MotionPath cameraMotion;	// Position and view of camera at every step of exposure
+	bool cameraMoving;
 	std::vector <LightRef> lights;
 	std::vector <ObjectRef> objects;
 	std::string outputFile;
-	ctpl::thread_pool pool;
+	std::shared_ptr <ctpl::thread_pool> pool;	// Shared with snapshots of scene
+	size_t frame;
+	uint32_t frameKey;
+	Sampler::Type samplerType;
+	Region region;
 
-	Color traceRay(const Ray &ray, size_t bounces = 0) const;
+	// Branches with throughput below minThroughput are dropped,
+	// below rouletteThreshold they survive with probability throughput / rouletteThreshold
+	float minThroughput;
+	float rouletteThreshold;
+	mutable std::atomic <size_t> tracedRays;
+	mutable std::atomic <size_t> prunedRays;
+	size_t lastTiles;
+	size_t lastReused;
+	Animation animation;	// Keyframe tracks from scene file
+
+	// Trace ray from camera with given weight in pixel color, returns weighted color.
+	// Traced and pruned rays are added to stats of calling task, which adds them to scene once.
+	// If influence is given, space visited by ray tree is added to it
+	// If first hit is given, camera ray is not intersected with scene again
+	Color traceRay(const Ray &ray, float weight, size_t bounces, const Sampler &sampler, uint32_t path,
+		RenderStats &stats, TileInfluence *influence = nullptr, const PrimaryHit *firstHit = nullptr) const;
 	std::pair <Object *, Intersection> findIntersection(const Ray &ray) const;
-	Color traceReal(const Vector3f &dir) const;
-	Color supersampleGrid(float xf, float yf, float dx, float dy, size_t sub) const;
-	Color supersampleJitter(float xf, float yf, float dx, float dy, size_t sub) const;
-	Color getPixel(float xf, float yf, float dx, float dy, size_t sub) const;
+	std::pair <size_t, Intersection> findIntersectionIndex(const Ray &ray) const;
+	Color getPixel(size_t x, size_t y, float xf, float yf, float dx, float dy, size_t sub, RenderStats &stats,
+		TileInfluence *influence = nullptr) const;
+	// Add rays counted by one task to stats of render
+	void addStats(const RenderStats &stats) const;
+
+	// Call f(ray, weight, sampler, path) for every ray from camera that contributes to pixel
+	template <typename F>
+	void forEachCameraRay(size_t x, size_t y, float xf, float yf, float dx, float dy, size_t sub, F &&f) const;
 
-	std::vector <Color> traceColumn(float, float, float, float, size_t) const;
+	// Parallel renderers split region into square tiles, one task per tile. Rows of tile are
+	// contiguous in framebuffer, so tasks share cache lines only at edges of tiles
+	static constexpr size_t RenderTileSize = 32;
+
+	// Call f(x0, y0, x1, y1) as task of pool for every tile of region, coordinates are relative
+	// to region. Returns when all tiles are done
+	template <typename F>
+	void forEachTile(const Region &reg, F &&f) const;
+
+	void traceTile(size_t x0, size_t y0, float xm, float ym, float dx, float dy, size_t sub, const Region &,
+		Framebuffer::Tile) const;
+	// Part of image covered by primary rays that can hit given box
+	Region getScreenBounds(const Bounds &bounds) const;
+	bool sameView(const Scene &other) const;
+	// Camera rays of other scene hit the same objects in the same points
+	bool sameGeometry(const Scene &other) const;
+	std::shared_ptr <const GBuffer> buildGBuffer() const;
+	// Noise of samples changes every frame, unless perFrame is false: then all frames have noise
+	// of frame 0
+	void updateFrameKey(bool perFrame = true);
+
+	explicit Scene(std::shared_ptr <ctpl::thread_pool> pool);
 
 public:
 	std::unordered_map <Property, size_t> settings;
 
 	Scene();
+	// Scene whose thread pool has given amount of render threads
+	explicit Scene(size_t threads);
 	~Scene();
 
+	// Copy of current state of scene that is not affected by further changes of objects,
+	// lights and camera. Snapshots share thread pool, so several of them can be rendered at once.
+	// Must be created and destroyed on thread that runs script, because references
+	// to objects are counted without synchronization
+	std::unique_ptr <Scene> snapshot() const;
+
 	bool loadScene(const std::string &filename);
-	std::vector <std::vector <Color>> render();
-	std::vector <std::vector <Color>> renderParallel();
+	Framebuffer render();
+	Framebuffer renderParallel();
+	// Breadth-first renderer that traces rays in sorted batches
+	Framebuffer renderWavefront();
+	// Render only tiles that could be changed since previous frame and copy the rest from its image.
+	// Influence of every tile of new image is stored in tiles. Every frame has the same noise of
+	// jitter, lens and roulette samples, so copied tiles match tiles that are traced again
+	Framebuffer renderIncremental(const FrameHistory &previous, std::vector <TileInfluence> &tiles);
+	// Shade first hits of camera rays stored in G-buffer of previous frame, G-buffer is built again
+	// only if camera or geometry changed. Used G-buffer is returned in gbuffer
+	Framebuffer renderRelight(const FrameHistory &previous, std::shared_ptr <const GBuffer> &gbuffer);
 	std::string getOutputFile() const;
 
+	// Index of current frame, used together with seed to generate random numbers
+	void setFrame(size_t n);
+
+	void setPruning(float minThroughput, float rouletteThreshold);
+
+	// Render only given part of image, rendered data will have size of region
+	void setRegion(const Region &r);
+	// Part of image that is rendered, whole image if region was not set
+	Region getRegion() const;
+
+	RenderStats getStats() const;
+
 	void setProperty(Property prop);
 	bool hasProperty(Property prop) const;
 
@@ -69,6 +300,17 @@ public:
 	Camera getCamera() const;
 	void setCamera(const Camera &);
 
+	// Take state at next step of exposure from other scene, objects are matched by index. Current
+	// state is the first step, camera and objects move through all steps while shutter is open and
+	// every camera ray is traced at its own moment. Lights keep their current state.
+	// Returns the largest angle of rotation between steps, in radians
+	float addMotionKey(const Scene &state);
+
+	bool hasAnimation() const;
+	// Set objects, camera and lights animated in scene file to their state at given time in seconds.
+	// Objects and lights are matched by their position in scene file
+	void animate(float time);
+
 	ObjectRef getObject(size_t n);
 	void addObject(ObjectRef obj);
 	bool deleteObject(ObjectRef obj);
@@ -78,6 +320,117 @@ public:
 	void addLight(LightRef light);
 	bool deleteLight(LightRef light);
 	size_t lightsSize() const;
+
+	// Access without copying of references, for bulk updates from script
+	Object & objectAt(size_t n);
+	Light & lightAt(size_t n);
 };
 
+// Previous frame of animation, used for incremental rendering
+struct FrameHistory
+{
+	static constexpr size_t TileSize = 16;
+
+	std::unique_ptr <Scene> scene;	// State of scene that was rendered
+	std::shared_ptr <const Framebuffer> image;
+	std::vector <TileInfluence> tiles;	// Row by row from the top
+	std::shared_ptr <const GBuffer> gbuffer;
+};
+
+template <typename F>
+void Scene::forEachCameraRay(size_t x, size_t y, float xf, float yf, float dx, float dy, size_t sub, F &&f) const
+{
+	// Samples of pixel depend only on seed, frame and pixel position
+	Sampler sampler(samplerType, frameKey, static_cast <uint32_t>(x), static_cast <uint32_t>(y),
+		static_cast <uint32_t>(camera.getResolution().first));
+
+	bool jitter = hasProperty(SupersamplingJitter);
+	bool grid = !jitter && hasProperty(SupersamplingGrid);
+	uint32_t samples = (jitter || grid) ? static_cast <uint32_t>(sub * sub) : 1;
+	uint32_t rays = hasProperty(DOF) ? static_cast <uint32_t>(settings.at(DOF)) : 0;
+	float weight = 1.f / (samples * (rays + 1));
+	bool motion = hasProperty(MotionBlur);
+	// Cone of camera ray covers its part of pixel
+	float spread = dy / std::sqrt(static_cast <float>(samples));
+
+	for (uint32_t sample = 0; sample < samples; ++sample)
+	{
+		// Position of sample inside pixel
+		Vector3f d(xf, yf, -1.f);
+		if (jitter)
+		{
+			Vector2f u = sampler.get2D(sample, samples, PixelArea);
+			d[0] += (u[0] - 0.5f) * dx;
+			d[1] += (u[1] - 0.5f) * dy;
+		}
+		else if (grid)
+		{
+			d[0] += ((sample / sub + 0.5f) / sub - 0.5f) * dx;
+			d[1] += ((sample % sub + 0.5f) / sub - 0.5f) * dy;
+		}
+		d.normalize();
+
+		// Every ray of pixel gets its own moment of exposure. View is interpolated as rotation,
+		// so it stays orthonormal
+		Vector3f position = camera.getPosition();
+		Matrix4f view = camera.getView();
+		auto setTime = [&](Ray &ray, uint32_t path)
+		{
+			if (!motion)
+				return;
+
+			ray.time = sampler.get2D(path, samples * (rays + 1), Time)[0];
+			if (cameraMoving)
+				cameraMotion.at(ray.time, view, position);
+		};
+
+		// Rays through lens converge in focal point
+		Vector3f focalPoint = d * camera.getFocalLength();
+		for (uint32_t i = 0; i < rays; ++i)
+		{
+			Vector3f r = camera.getLensPoint(sampler.get2D(sample * rays + i, samples * rays, Lens));
+			Vector3f dr = focalPoint - r;
+			dr.normalize();
+
+			Ray ray;
+			uint32_t path = sample * (rays + 1) + i;
+			ray.spread = spread;
+			setTime(ray, path);
+			ray.pos = position + view * r;
+			ray.dir = view * dr;
+			ray.dir.normalize();
+			f(ray, weight, sampler, path);
+		}
+
+		Ray ray;
+		uint32_t path = sample * (rays + 1) + rays;
+		ray.spread = spread;
+		setTime(ray, path);
+		ray.pos = position;
+		ray.dir = view * d;
+		ray.dir.normalize();
+		f(ray, weight, sampler, path);
+	}
+}
+
+template <typename F>
+void Scene::forEachTile(const Region &reg, F &&f) const
+{
+	std::vector <std::future <void>> fut;
+	for (size_t y0 = 0; y0 < reg.height(); y0 += RenderTileSize)
+	{
+		for (size_t x0 = 0; x0 < reg.width(); x0 += RenderTileSize)
+		{
+			size_t x1 = std::min(x0 + RenderTileSize, reg.width());
+			size_t y1 = std::min(y0 + RenderTileSize, reg.height());
+			fut.push_back(pool->push([&f, x0, y0, x1, y1](int)
+			{
+				f(x0, y0, x1, y1);
+			}));
+		}
+	}
+	for (auto &t : fut)
+		t.get();
+}
+
 #endif  // RAYTRACER_SCENE_H_
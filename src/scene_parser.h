@@ -6,14 +6,16 @@
 #include "matrix.h"
 #include "light.h"
 #include "material.h"
+#include "object.h"
 #include "camera.h"
+#include "animation.h"
 
 #include "pugixml.hpp"
-#define TINYOBJLOADER_IMPLEMENTATION
-#include "tiny_obj_loader.h"
-#undef TINYOBJLOADER_IMPLEMENTATION
+#include "ctpl_stl.h"
 
 #include <iostream>
+#include <map>
+#include <set>
 #include <string>
 #include <vector>
 
@@ -108,22 +110,38 @@ class SceneParser
 		};
 	}
 
-	Material *getMaterialTextured(pugi::xml_node node)
+	static Texture::Layout getTextureLayout(pugi::xml_node texture)
+	{
+		return std::string(texture.attribute("layout").as_string()) == "linear" ? Texture::Layout::Linear : Texture::Layout::Tiled;
+	}
+
+	Material *getMaterialTextured(pugi::xml_node node, bool lazy)
 	{
 		auto f = node.child("phong");
+		auto t = node.child("texture");
+		std::string layout = t.attribute("layout").as_string("tiled");
+		if (layout != "tiled" && layout != "linear")
+			std::cerr << "Unknown texture layout " << layout << ", using tiled\n";
+		Texture::Filter filter = Texture::Filter::Trilinear;
+		std::string filterName = t.attribute("filter").as_string("trilinear");
+		if (!Texture::parseFilter(filterName, filter))
+			std::cerr << "Unknown texture filter " << filterName << ", using trilinear\n";
 		return new MaterialTextured{
-			node.child("texture").attribute("name").as_string(),
+			t.attribute("name").as_string(),
 			f.attribute("ka").as_float(),
 			f.attribute("kd").as_float(),
 			f.attribute("ks").as_float(),
 			f.attribute("exponent").as_float(),
 			node.child("reflectance").attribute("r").as_float(),
 			node.child("transmittance").attribute("t").as_float(),
-			node.child("refraction").attribute("iof").as_float()
+			node.child("refraction").attribute("iof").as_float(),
+			getTextureLayout(t),
+			filter,
+			lazy
 		};
 	}
 
-	Material *getMaterial(pugi::xml_node node)
+	Material *getMaterial(pugi::xml_node node, bool lazy)
 	{
 		auto m = node.child("material_solid");
 		if (m.type() != pugi::xml_node_type::node_null)
@@ -131,7 +149,7 @@ class SceneParser
 		else
 		{
 			m = node.child("material_textured");
-			return getMaterialTextured(m);
+			return getMaterialTextured(m, lazy);
 		}
 	}
 
@@ -193,17 +211,82 @@ public:
 		return res;
 	}
 
-	std::vector <Object *> getSurfaces()
+	// Files of meshes and textures are loaded at once by tasks of pool. Objects and materials are
+	// created on this thread, because references to materials are counted without synchronization.
+	// Lazy scene decodes textures and builds trees of meshes when rays first reach them
+	std::vector <Object *> getSurfaces(ctpl::thread_pool &pool, bool lazy)
 	{
-		std::vector <Object *> res;
 		auto surfaces = root.child("surfaces");
+
+		// Every file is loaded once, even if it is used by several objects
+		std::map <std::string, std::future <std::shared_ptr <Mesh::MeshData>>> meshes;
+		std::set <std::pair <std::string, Texture::Layout>> textureFiles;
+		for (auto it = surfaces.begin(); it != surfaces.end(); ++it)
+		{
+			std::string name(it->name());
+			if (name == "mesh")
+			{
+				std::string filename = it->attribute("name").as_string();
+				if (meshes.count(filename) == 0)
+				{
+					meshes[filename] = pool.push([filename, lazy](int)
+					{
+						return Mesh::loadData(filename, lazy);
+					});
+				}
+			}
+
+			auto texture = it->child("material_textured").child("texture");
+			if (!lazy && texture)
+				textureFiles.insert({ texture.attribute("name").as_string(), getTextureLayout(texture) });
+		}
+
+		// Materials take textures from cache
+		std::vector <std::future <std::shared_ptr <const Texture>>> textures;
+		for (const auto &[filename, layout] : textureFiles)
+		{
+			textures.push_back(pool.push([filename = filename, layout = layout](int)
+			{
+				return TextureCache::instance().get(filename, layout);
+			}));
+		}
+
+		size_t total = meshes.size() + textures.size(), done = 0;
+		auto progress = [&]()
+		{
+			++done;
+			std::cerr << "\rLoading " << done << "/" << total << " files" << (done == total ? "\n" : "") << std::flush;
+		};
+		std::map <std::string, std::shared_ptr <Mesh::MeshData>> meshData;
+		for (auto &[filename, f] : meshes)
+		{
+			meshData[filename] = f.get();
+			progress();
+		}
+		for (auto &f : textures)
+		{
+			f.get();
+			progress();
+		}
+
+		if (!meshData.empty())
+		{
+			MeshReport report;
+			for (const auto &[filename, data] : meshData)
+				report += data->report;
+			std::cerr << "Meshes: " << report.triangles << " triangles, removed " << report.degenerate << " degenerate and "
+				<< report.duplicates << " duplicate, welded " << report.corners << " corners into " << report.vertices
+				<< " vertices, " << report.bytesBefore / 1024 << " KB -> " << report.bytesAfter / 1024 << " KB\n";
+		}
+
+		std::vector <Object *> res;
 		for (auto it = surfaces.begin(); it != surfaces.end(); ++it)
 		{
 			std::string name(it->name());
 			if (name == "sphere")
 			{
 				float r = it->attribute("radius").as_float();
-				Material *mat = getMaterial(*it);
+				Material *mat = getMaterial(*it, lazy);
 				Vector3f pos = getVector(it->child("position"));
 				auto [transform, inverse] = getTransforms(it->child("transform"));
 				res.push_back(new Sphere(r, mat, transform * Matrix4f::fromTranslation(pos), Matrix4f::fromTranslation(-pos) * inverse));
@@ -211,9 +294,9 @@ public:
 			else if (name == "mesh")
 			{
 				std::string filename = it->attribute("name").as_string();
-				Material *mat = getMaterial(*it);
+				Material *mat = getMaterial(*it, lazy);
 				auto[transform, inverse] = getTransforms(it->child("transform"));
-				res.push_back(new Mesh(filename, mat, transform, inverse));
+				res.push_back(new Mesh(meshData[filename], mat, transform, inverse));
 			}
 		}
 		return res;
@@ -236,6 +319,52 @@ public:
 		};
 	}
 
+	Animation getAnimation()
+	{
+		Animation res;
+		auto animation = root.child("animation");
+		for (pugi::xml_node track : animation.children("track"))
+		{
+			Animation::Channel channel;
+			std::string target = track.attribute("target").as_string();
+			std::string property = track.attribute("property").as_string();
+			std::string interpolation = track.attribute("interpolation").as_string();
+			if (!Animation::parseTarget(target, channel.target))
+			{
+				std::cerr << "Unknown animation target \"" << target << "\", track is ignored\n";
+				continue;
+			}
+			if (!Animation::parseProperty(property, channel.target, channel.property))
+			{
+				std::cerr << "Property \"" << property << "\" can not be animated for " << target << ", track is ignored\n";
+				continue;
+			}
+
+			Track::Interpolation type;
+			if (!Track::parseInterpolation(interpolation, type))
+			{
+				std::cerr << "Unknown interpolation \"" << interpolation << "\", using linear\n";
+				type = Track::Interpolation::Linear;
+			}
+			channel.index = track.attribute("index").as_uint();
+			channel.track = Track(type);
+
+			for (pugi::xml_node key : track.children("key"))
+			{
+				float time = key.attribute("time").as_float();
+				if (channel.property == Animation::Property::Color)
+					channel.track.addKey(time, getColor(key));
+				else
+					channel.track.addKey(time, getVector(key));
+			}
+
+			if (!channel.track.empty())
+				res.channels.push_back(channel);
+		}
+
+		return res;
+	}
+
 	std::string getOutputFile()
 	{
 		return root.attribute("output_file").as_string();
@@ -0,0 +1,334 @@
+#ifndef RAYTRACER_TEXTURE_H_
+#define RAYTRACER_TEXTURE_H_
+
+#include "color.h"
+#include "lodepng.h"
+
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <future>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#ifdef _MSC_VER
+#include <malloc.h>
+#endif
+
+// 8 bit RGBA image with chain of mip levels in one aligned allocation. Texels are converted
+// to float when they are read, so texture takes 4 bytes per texel instead of 12
+class Texture
+{
+public:
+	enum class Layout {
+		Linear,		// Rows from the top
+		Tiled		// Blocks of 4x4 texels, every block is one cache line
+	};
+
+	// How texels around texture coordinates are combined
+	enum class Filter {
+		Nearest,	// Nearest texel of full resolution
+		Bilinear,	// Four nearest texels of full resolution
+		Trilinear	// Bilinear samples of two mip levels chosen by footprint of ray
+	};
+
+	static constexpr size_t Alignment = 64;
+	static constexpr size_t BlockSize = 4;
+
+private:
+	struct Deleter
+	{
+		void operator ()(uint8_t *p) const
+		{
+#ifdef _MSC_VER
+			_aligned_free(p);
+#else
+			std::free(p);
+#endif
+		}
+	};
+
+	// Every level is half of previous one, the last level is 1x1
+	struct Level
+	{
+		size_t w, h;
+		size_t blocksX;		// Blocks in one row of tiled level
+		size_t start;		// First texel of level, levels start at block boundary
+	};
+
+	std::vector <Level> levels;
+	Layout layout = Layout::Tiled;
+	std::unique_ptr <uint8_t[], Deleter> texels;
+
+	// Position of texel in texels, not in bytes
+	size_t offset(const Level &l, size_t x, size_t y) const
+	{
+		if (layout == Layout::Linear)
+			return l.start + y * l.w + x;
+		size_t block = (y / BlockSize) * l.blocksX + x / BlockSize;
+		return l.start + block * BlockSize * BlockSize + (y % BlockSize) * BlockSize + x % BlockSize;
+	}
+
+	static Color toColor(const uint8_t *t)
+	{
+		return Color(t[0] / 255.f, t[1] / 255.f, t[2] / 255.f);
+	}
+
+	// Texture is repeated in both directions
+	static size_t wrap(float coord, size_t size)
+	{
+		long long res = static_cast <long long>(coord) % static_cast <long long>(size);
+		return static_cast <size_t>(res < 0 ? res + static_cast <long long>(size) : res);
+	}
+
+	Color bilinear(const Level &l, const Vector2f &coord) const
+	{
+		float x = coord[0] * l.w - 0.5f, y = coord[1] * l.h - 0.5f;
+		float fx = std::floor(x), fy = std::floor(y);
+		float tx = x - fx, ty = y - fy;
+		size_t x0 = wrap(fx, l.w), y0 = wrap(fy, l.h);
+		size_t x1 = x0 + 1 == l.w ? 0 : x0 + 1, y1 = y0 + 1 == l.h ? 0 : y0 + 1;
+
+		const uint8_t *t = texels.get();
+		return (toColor(&t[offset(l, x0, y0) * 4]) * (1.f - tx) + toColor(&t[offset(l, x1, y0) * 4]) * tx) * (1.f - ty) +
+			(toColor(&t[offset(l, x0, y1) * 4]) * (1.f - tx) + toColor(&t[offset(l, x1, y1) * 4]) * tx) * ty;
+	}
+
+public:
+	Texture() {}
+	Texture(const Texture &) = delete;
+	Texture &operator =(const Texture &) = delete;
+
+	static bool parseFilter(const std::string &name, Filter &filter)
+	{
+		static const std::pair <const char *, Filter> names[] = {
+			{ "nearest", Filter::Nearest },
+			{ "bilinear", Filter::Bilinear },
+			{ "trilinear", Filter::Trilinear }
+		};
+		for (const auto &[n, f] : names)
+		{
+			if (name == n)
+			{
+				filter = f;
+				return true;
+			}
+		}
+		return false;
+	}
+
+	// Decode png file and build mip levels, false if it can not be read
+	bool load(const std::string &filename, Layout l = Layout::Tiled)
+	{
+		std::vector <unsigned char> image;
+		unsigned width, height;
+		unsigned error = lodepng::decode(image, width, height, filename);
+		if (error)
+		{
+			std::cerr << "PNG decoder error: " << lodepng_error_text(error) << std::endl;
+			return false;
+		}
+		if (width == 0 || height == 0)
+			return false;
+
+		layout = l;
+		levels.clear();
+		size_t count = 0;
+		for (size_t w = width, h = height; ; w = std::max <size_t>(w / 2, 1), h = std::max <size_t>(h / 2, 1))
+		{
+			// Tiled level is padded to whole blocks
+			size_t blocksX = (w + BlockSize - 1) / BlockSize;
+			levels.push_back({ w, h, blocksX, count });
+			count += layout == Layout::Linear ? w * h : blocksX * ((h + BlockSize - 1) / BlockSize) * BlockSize * BlockSize;
+			count = (count + BlockSize * BlockSize - 1) / (BlockSize * BlockSize) * BlockSize * BlockSize;
+			if (w == 1 && h == 1)
+				break;
+		}
+
+		size_t bytes = (count * 4 + Alignment - 1) / Alignment * Alignment;
+#ifdef _MSC_VER
+		void *p = _aligned_malloc(bytes, Alignment);
+#else
+		void *p = std::aligned_alloc(Alignment, bytes);
+#endif
+		if (p == nullptr)
+			throw std::bad_alloc();
+		std::memset(p, 0, bytes);
+		texels.reset(static_cast <uint8_t *>(p));
+
+		const Level &base = levels[0];
+		for (size_t y = 0; y < base.h; ++y)
+		{
+			for (size_t x = 0; x < base.w; ++x)
+				std::memcpy(&texels[offset(base, x, y) * 4], &image[(y * base.w + x) * 4], 4);
+		}
+
+		// Texel of level is average of 2x2 texels of previous level, the last row or
+		// column of odd level is repeated
+		for (size_t i = 1; i < levels.size(); ++i)
+		{
+			const Level &prev = levels[i - 1], &cur = levels[i];
+			for (size_t y = 0; y < cur.h; ++y)
+			{
+				size_t y0 = std::min(y * 2, prev.h - 1), y1 = std::min(y * 2 + 1, prev.h - 1);
+				for (size_t x = 0; x < cur.w; ++x)
+				{
+					size_t x0 = std::min(x * 2, prev.w - 1), x1 = std::min(x * 2 + 1, prev.w - 1);
+					const uint8_t *t[4] = { &texels[offset(prev, x0, y0) * 4], &texels[offset(prev, x1, y0) * 4],
+						&texels[offset(prev, x0, y1) * 4], &texels[offset(prev, x1, y1) * 4] };
+					uint8_t *out = &texels[offset(cur, x, y) * 4];
+					for (size_t c = 0; c < 4; ++c)
+						out[c] = static_cast <uint8_t>((t[0][c] + t[1][c] + t[2][c] + t[3][c] + 2) / 4);
+				}
+			}
+		}
+		return true;
+	}
+
+	size_t width() const
+	{
+		return levels.empty() ? 0 : levels[0].w;
+	}
+
+	size_t height() const
+	{
+		return levels.empty() ? 0 : levels[0].h;
+	}
+
+	bool empty() const
+	{
+		return levels.empty();
+	}
+
+	// Texel of full resolution
+	Color get(size_t x, size_t y) const
+	{
+		return toColor(&texels[offset(levels[0], x, y) * 4]);
+	}
+
+	// Color at texture coordinates. Footprint is width of area covered by ray in texture
+	// coordinates, trilinear filter takes levels whose texels have about the same size
+	Color sample(const Vector2f &coord, float footprint, Filter filter) const
+	{
+		const Level &base = levels[0];
+		if (filter == Filter::Nearest)
+		{
+			size_t x = static_cast <size_t>(static_cast <int>(coord[0] * base.w));
+			size_t y = static_cast <size_t>(static_cast <int>(coord[1] * base.h));
+			return get(x % base.w, y % base.h);
+		}
+
+		float lod = footprint > 0.f ? std::log2(footprint * std::max(base.w, base.h)) : 0.f;
+		if (filter == Filter::Bilinear || lod <= 0.f)
+			return bilinear(base, coord);
+		if (lod >= levels.size() - 1)
+			return bilinear(levels.back(), coord);
+
+		size_t l = static_cast <size_t>(lod);
+		float f = lod - l;
+		return bilinear(levels[l], coord) * (1.f - f) + bilinear(levels[l + 1], coord) * f;
+	}
+};
+
+// Textures of the whole process by canonical path, so file that is used by many materials
+// is decoded and stored once. File that was changed since it was decoded is decoded again
+class TextureCache
+{
+	using Result = std::shared_ptr <const Texture>;
+
+	struct Entry
+	{
+		std::filesystem::file_time_type time;
+		std::shared_future <Result> texture;
+	};
+
+	std::mutex mutex;
+	std::map <std::pair <std::string, Texture::Layout>, Entry> entries;
+
+	TextureCache() {}
+
+public:
+	static TextureCache &instance()
+	{
+		static TextureCache cache;
+		return cache;
+	}
+
+	// Texture of file, nullptr if it can not be read
+	Result get(const std::string &filename, Texture::Layout layout)
+	{
+		std::error_code error;
+		std::filesystem::path path = std::filesystem::canonical(filename, error);
+		std::filesystem::file_time_type time;
+		if (!error)
+			time = std::filesystem::last_write_time(path, error);
+		if (error)
+		{
+			std::cerr << "Texture " << filename << " does not exist\n";
+			return nullptr;
+		}
+
+		// File is decoded outside of lock, other threads that need it wait for the same result
+		std::promise <Result> promise;
+		std::shared_future <Result> future;
+		{
+			std::lock_guard <std::mutex> lock(mutex);
+			Entry &entry = entries[std::make_pair(path.string(), layout)];
+			if (entry.texture.valid() && entry.time == time)
+				future = entry.texture;
+			else
+			{
+				entry.time = time;
+				entry.texture = promise.get_future().share();
+			}
+		}
+		if (future.valid())
+			return future.get();
+
+		auto texture = std::make_shared <Texture>();
+		Result res = texture->load(path.string(), layout) ? texture : nullptr;
+		promise.set_value(res);
+		return res;
+	}
+};
+
+// Texture of material, shared by copies of material. Lazy texture is taken from cache when
+// it is first sampled, so textures of objects that are never hit are not decoded
+class TextureSource
+{
+	std::string filename;
+	Texture::Layout layout;
+	std::once_flag once;
+	std::shared_ptr <const Texture> texture;
+
+public:
+	TextureSource(const std::string &filename, Texture::Layout layout, bool lazy) :
+		filename(filename),
+		layout(layout)
+	{
+		if (!lazy)
+			get();
+	}
+
+	// Texture, nullptr if it can not be read
+	const Texture *get()
+	{
+		std::call_once(once, [this]
+		{
+			texture = TextureCache::instance().get(filename, layout);
+		});
+		return texture.get();
+	}
+
+	bool sameFile(const TextureSource &other) const
+	{
+		return filename == other.filename && layout == other.layout;
+	}
+};
+
+#endif  // RAYTRACER_TEXTURE_H_
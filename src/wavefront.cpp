@@ -0,0 +1,547 @@
+#include "scene.h"
+
+#include <vector>
+#include <algorithm>
+#include <future>
+
+using namespace std;
+
+// Wavefront renderer processes pixels in batches. Every ray generation (primary,
+// reflected, refracted, shadow) of the batch is stored in its own queue, sorted
+// to make neighbouring rays coherent and traced in bulk before the next one starts
+
+// Amount of pixels rendered at once, limits memory used by queues
+static const size_t BatchPixels = 1 << 14;
+// Amount of rays traced by one task of thread pool
+static const size_t KernelChunk = 1 << 12;
+
+template <typename T>
+static void append(vector <T> &v, const vector <T> &other)
+{
+	v.insert(v.end(), other.begin(), other.end());
+}
+
+// Rays of one queue stored as structure of arrays
+struct RayQueue
+{
+	vector <float> posX, posY, posZ;
+	vector <float> dirX, dirY, dirZ;
+	vector <float> throughput;
+	vector <float> time;
+	vector <float> width, spread;	// Ray cone
+	vector <uint32_t> pixel;	// Index of pixel in batch
+	vector <uint32_t> path;		// Index of camera ray in pixel
+	vector <uint32_t> node;		// Position in ray tree
+	vector <uint16_t> bounces;
+	vector <uint8_t> inside;
+
+	size_t size() const
+	{
+		return pixel.size();
+	}
+
+	void clear()
+	{
+		for (auto *v : { &posX, &posY, &posZ, &dirX, &dirY, &dirZ, &throughput, &time, &width, &spread })
+			v->clear();
+		pixel.clear();
+		path.clear();
+		node.clear();
+		bounces.clear();
+		inside.clear();
+	}
+
+	void push(const Ray &ray, float t, uint32_t pix, uint32_t p, uint32_t n, size_t b, bool in)
+	{
+		posX.push_back(ray.pos[0]);
+		posY.push_back(ray.pos[1]);
+		posZ.push_back(ray.pos[2]);
+		dirX.push_back(ray.dir[0]);
+		dirY.push_back(ray.dir[1]);
+		dirZ.push_back(ray.dir[2]);
+		throughput.push_back(t);
+		time.push_back(ray.time);
+		width.push_back(ray.width);
+		spread.push_back(ray.spread);
+		pixel.push_back(pix);
+		path.push_back(p);
+		node.push_back(n);
+		bounces.push_back(static_cast <uint16_t>(b));
+		inside.push_back(in);
+	}
+
+	void append(const RayQueue &other)
+	{
+		::append(posX, other.posX);
+		::append(posY, other.posY);
+		::append(posZ, other.posZ);
+		::append(dirX, other.dirX);
+		::append(dirY, other.dirY);
+		::append(dirZ, other.dirZ);
+		::append(throughput, other.throughput);
+		::append(time, other.time);
+		::append(width, other.width);
+		::append(spread, other.spread);
+		::append(pixel, other.pixel);
+		::append(path, other.path);
+		::append(node, other.node);
+		::append(bounces, other.bounces);
+		::append(inside, other.inside);
+	}
+
+	Ray getRay(size_t i) const
+	{
+		Ray res({ posX[i], posY[i], posZ[i] }, { dirX[i], dirY[i], dirZ[i] }, time[i]);
+		res.width = width[i];
+		res.spread = spread[i];
+		return res;
+	}
+
+	template <typename T>
+	static void gather(vector <T> &v, const vector <uint32_t> &order)
+	{
+		vector <T> res(v.size());
+		for (size_t i = 0; i < order.size(); ++i)
+			res[i] = v[order[i]];
+		v.swap(res);
+	}
+
+	void reorder(const vector <uint32_t> &order)
+	{
+		for (auto *v : { &posX, &posY, &posZ, &dirX, &dirY, &dirZ, &throughput, &time, &width, &spread })
+			gather(*v, order);
+		gather(pixel, order);
+		gather(path, order);
+		gather(node, order);
+		gather(bounces, order);
+		gather(inside, order);
+	}
+};
+
+// Shadow rays together with light contribution that is added if nothing is in the way
+struct ShadowQueue
+{
+	vector <float> posX, posY, posZ;	// Shaded point
+	vector <float> dirX, dirY, dirZ;
+	vector <float> offset;				// Offset of ray origin along normal
+	vector <float> normX, normY, normZ;
+	vector <float> lightDist;
+	vector <float> time;
+	vector <float> r, g, b;
+	vector <uint32_t> pixel;
+
+	size_t size() const
+	{
+		return pixel.size();
+	}
+
+	void clear()
+	{
+		for (auto *v : { &posX, &posY, &posZ, &dirX, &dirY, &dirZ, &offset, &normX, &normY, &normZ, &lightDist, &time, &r, &g, &b })
+			v->clear();
+		pixel.clear();
+	}
+
+	void push(const Vector3f &pos, const Vector3f &normal, float off, const Vector3f &dir, float dist, float t, const Color &c, uint32_t pix)
+	{
+		posX.push_back(pos[0]);
+		posY.push_back(pos[1]);
+		posZ.push_back(pos[2]);
+		normX.push_back(normal[0]);
+		normY.push_back(normal[1]);
+		normZ.push_back(normal[2]);
+		offset.push_back(off);
+		dirX.push_back(dir[0]);
+		dirY.push_back(dir[1]);
+		dirZ.push_back(dir[2]);
+		lightDist.push_back(dist);
+		time.push_back(t);
+		r.push_back(c[0]);
+		g.push_back(c[1]);
+		b.push_back(c[2]);
+		pixel.push_back(pix);
+	}
+
+	void append(const ShadowQueue &other)
+	{
+		::append(posX, other.posX);
+		::append(posY, other.posY);
+		::append(posZ, other.posZ);
+		::append(dirX, other.dirX);
+		::append(dirY, other.dirY);
+		::append(dirZ, other.dirZ);
+		::append(offset, other.offset);
+		::append(normX, other.normX);
+		::append(normY, other.normY);
+		::append(normZ, other.normZ);
+		::append(lightDist, other.lightDist);
+		::append(time, other.time);
+		::append(r, other.r);
+		::append(g, other.g);
+		::append(b, other.b);
+		::append(pixel, other.pixel);
+	}
+
+	Vector3f getPos(size_t i) const
+	{
+		return { posX[i], posY[i], posZ[i] };
+	}
+
+	Ray getRay(size_t i) const
+	{
+		Vector3f normal{ normX[i], normY[i], normZ[i] };
+		return Ray(getPos(i) + normal * offset[i], { dirX[i], dirY[i], dirZ[i] }, time[i]);
+	}
+};
+
+// Results of intersection kernel
+struct HitBuffer
+{
+	vector <uint32_t> object;	// Index of object, or amount of objects if ray missed
+	vector <Intersection> inter;
+
+	void resize(size_t n)
+	{
+		object.resize(n);
+		inter.resize(n);
+	}
+};
+
+// Output of shading kernel for one chunk of hits. Chunks are merged in order, so result
+// does not depend on which thread shaded which chunk
+struct ShadeOutput
+{
+	vector <pair <uint32_t, Color>> direct;	// Light added to pixels without shadow ray
+	ShadowQueue shadow;
+	RayQueue reflected, refracted;
+	size_t pruned = 0;
+
+	void clear()
+	{
+		direct.clear();
+		shadow.clear();
+		reflected.clear();
+		refracted.clear();
+		pruned = 0;
+	}
+};
+
+// Spread bits of 7 bit number so there are two zero bits between every bit
+static uint32_t expandBits(uint32_t v)
+{
+	v &= 0x7F;
+	v = (v | (v << 8)) & 0x0000F00Fu;
+	v = (v | (v << 4)) & 0x000C30C3u;
+	v = (v | (v << 2)) & 0x00249249u;
+	return v;
+}
+
+// Sort rays so that rays with similar direction and origin are traced one after another.
+// Key consists of direction octant, quantized direction and Morton code of origin
+static void sortRays(RayQueue &queue)
+{
+	size_t n = queue.size();
+	if (n < 2)
+		return;
+
+	float lo[3] = { queue.posX[0], queue.posY[0], queue.posZ[0] };
+	float hi[3] = { lo[0], lo[1], lo[2] };
+	const vector <float> *pos[3] = { &queue.posX, &queue.posY, &queue.posZ };
+	for (size_t a = 0; a < 3; ++a)
+	{
+		auto [mn, mx] = minmax_element(pos[a]->begin(), pos[a]->end());
+		lo[a] = *mn;
+		hi[a] = *mx;
+	}
+
+	vector <pair <uint32_t, uint32_t>> keys(n);
+	for (size_t i = 0; i < n; ++i)
+	{
+		uint32_t morton = 0;
+		for (size_t a = 0; a < 3; ++a)
+		{
+			float extent = hi[a] - lo[a];
+			float t = extent > 0.f ? ((*pos[a])[i] - lo[a]) / extent : 0.f;
+			morton |= expandBits(static_cast <uint32_t>(t * 127.f)) << a;
+		}
+
+		float d[3] = { queue.dirX[i], queue.dirY[i], queue.dirZ[i] };
+		uint32_t octant = (d[0] < 0.f) | ((d[1] < 0.f) << 1) | ((d[2] < 0.f) << 2);
+		uint32_t qx = static_cast <uint32_t>(fabs(d[0]) * 7.99f);
+		uint32_t qy = static_cast <uint32_t>(fabs(d[1]) * 7.99f);
+		uint32_t dirKey = (octant << 6) | (qx << 3) | qy;
+
+		keys[i] = { (dirKey << 21) | morton, static_cast <uint32_t>(i) };
+	}
+	sort(keys.begin(), keys.end());
+
+	vector <uint32_t> order(n);
+	for (size_t i = 0; i < n; ++i)
+		order[i] = keys[i].second;
+	queue.reorder(order);
+}
+
+// Run kernel(begin, end) over [0, n) on thread pool
+template <typename F>
+static void runKernel(ctpl::thread_pool &pool, size_t n, F &&kernel)
+{
+	vector <future <void>> fut;
+	for (size_t begin = 0; begin < n; begin += KernelChunk)
+	{
+		size_t end = min(n, begin + KernelChunk);
+		fut.push_back(pool.push([&kernel, begin, end](int)
+		{
+			kernel(begin, end);
+		}));
+	}
+	for (auto &f : fut)
+		f.get();
+}
+
+Framebuffer Scene::renderWavefront()
+{
+	size_t width = camera.getResolution().first;
+	size_t height = camera.getResolution().second;
+	Region reg = getRegion();
+	Framebuffer data(reg.width(), reg.height());
+
+	for (ObjectRef &obj : objects)
+		obj->updateInverse();
+	updateFrameKey();
+	tracedRays = 0;
+	prunedRays = 0;
+
+	float ratio = static_cast <float>(width) / height;
+	float xm = tan(camera.getFOV());
+	float ym = tan(camera.getFOV() / ratio);
+	float dx = 2.f * xm / width;
+	float dy = 2.f * ym / height;
+	size_t sub = hasProperty(Supersampling) ? settings.at(Scene::Supersampling) : 0;
+
+	RayQueue primary, reflected, refracted, work;
+	ShadowQueue shadow;
+	HitBuffer hits;
+	vector <uint8_t> occluded;
+	vector <uint32_t> order;
+	vector <ShadeOutput> shaded;
+	vector <Color> pixels;
+	size_t traced = 0;
+	size_t pruned = 0;
+	// Objects with equal materials have the same key, rays that miss have the largest one
+	vector <size_t> materialKey(objects.size() + 1, objects.size());
+	for (size_t i = 0; i < objects.size(); ++i)
+	{
+		materialKey[i] = i;
+		for (size_t j = 0; j < i; ++j)
+		{
+			if (GET_POINTER(objects[j]->material)->sameAs(*GET_POINTER(objects[i]->material)))
+			{
+				materialKey[i] = materialKey[j];
+				break;
+			}
+		}
+	}
+	// Every camera ray has the same weight, pruning thresholds are relative to camera ray
+	float minWeighted = minThroughput;
+	float rouletteWeighted = rouletteThreshold;
+
+	// Pixels of region are numbered row by row from the top,
+	// position of pixel in image is given with rays counted from the bottom
+	auto pixelX = [&](size_t p)
+	{
+		return reg.x0 + p % reg.width();
+	};
+	auto pixelY = [&](size_t p)
+	{
+		return height - 1 - (reg.y0 + p / reg.width());
+	};
+	auto samplerFor = [&](size_t begin, uint32_t pixel)
+	{
+		size_t p = begin + pixel;
+		return Sampler(samplerType, frameKey, static_cast <uint32_t>(pixelX(p)), static_cast <uint32_t>(pixelY(p)),
+			static_cast <uint32_t>(width));
+	};
+
+	size_t total = reg.width() * reg.height();
+	for (size_t begin = 0; begin < total; begin += BatchPixels)
+	{
+		size_t end = min(total, begin + BatchPixels);
+		pixels.assign(end - begin, Color());
+
+		// Generate camera rays of batch
+		primary.clear();
+		for (size_t p = begin; p < end; ++p)
+		{
+			size_t x = pixelX(p);
+			size_t y = pixelY(p);
+			float xf = (2.f * static_cast <float>(x) / width - 1.f) * xm;
+			float yf = (2.f * static_cast <float>(y) / height - 1.f) * ym;
+			uint32_t pixel = static_cast <uint32_t>(p - begin);
+
+			forEachCameraRay(x, y, xf, yf, dx, dy, sub, [&](const Ray &ray, float weight, const Sampler &, uint32_t path)
+			{
+				minWeighted = minThroughput * weight;
+				rouletteWeighted = rouletteThreshold * weight;
+				primary.push(ray, weight, pixel, path, 1, camera.getMaxBounces(), false);
+			});
+		}
+
+		while (primary.size() != 0 || reflected.size() != 0 || refracted.size() != 0)
+		{
+			// Take whole queue, shading will fill queues for the next generation
+			RayQueue &next = primary.size() != 0 ? primary : (reflected.size() != 0 ? reflected : refracted);
+			swap(work, next);
+			next.clear();
+			sortRays(work);
+
+			// Intersection kernel
+			size_t n = work.size();
+			traced += n;
+			hits.resize(n);
+			runKernel(*pool, n, [&](size_t b, size_t e)
+			{
+				for (size_t i = b; i < e; ++i)
+				{
+					auto [obj, inter] = findIntersectionIndex(work.getRay(i));
+					hits.object[i] = static_cast <uint32_t>(obj);
+					hits.inter[i] = inter;
+				}
+			});
+
+			// Group hits by material so that shading of one material is done at once, misses go last
+			order.resize(n);
+			for (size_t i = 0; i < n; ++i)
+				order[i] = static_cast <uint32_t>(i);
+			stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b)
+			{
+				return materialKey[hits.object[a]] < materialKey[hits.object[b]];
+			});
+
+			// Shading kernel, every chunk of sorted hits fills its own output
+			shaded.resize((n + KernelChunk - 1) / KernelChunk);
+			runKernel(*pool, n, [&](size_t b, size_t e)
+			{
+				ShadeOutput &out = shaded[b / KernelChunk];
+				out.clear();
+				for (size_t k = b; k < e; ++k)
+				{
+					uint32_t i = order[k];
+					float throughput = work.throughput[i];
+					uint32_t pixel = work.pixel[i];
+					if (hits.object[i] == objects.size())
+					{
+						out.direct.push_back({ pixel, background * throughput });
+						continue;
+					}
+
+					const Intersection &inter = hits.inter[i];
+					Ray ray = work.getRay(i);
+					Material *mat = GET_POINTER(objects[hits.object[i]]->material);
+					bool hitFromBehind = (inter.normal * ray.dir) > 0.f;
+					float weight = (1.f - mat->reflectance - mat->transmittance) * throughput;
+
+					for (size_t l = 0; l < lights.size(); ++l)
+					{
+						if (!lights[l]->isOn())
+							continue;
+
+						if (lights[l]->isDirectional())
+						{
+							auto [lightDir, lightDist] = lights[l]->getDirection(inter.pos);
+							out.shadow.push(inter.pos, inter.normal, hitFromBehind ? -0.0001f : 0.0001f, lightDir, lightDist, ray.time,
+								lights[l]->getColor(inter, ray.pos, mat) * weight, pixel);
+						}
+						else if (!work.inside[i])
+						{
+							// Ambient light is not applied inside objects
+							out.direct.push_back({ pixel, lights[l]->getColor(inter, ray.pos, mat) * weight });
+						}
+					}
+
+					if (work.bounces[i] == 0)
+						continue;
+
+					// Same pruning rules as in traceRay
+					auto keep = [&](float &t, uint32_t node)
+					{
+						if (t < minWeighted)
+						{
+							++out.pruned;
+							return false;
+						}
+						if (t < rouletteWeighted)
+						{
+							float p = t / rouletteWeighted;
+							if (samplerFor(begin, pixel).get1D(work.path[i], Roulette + node) >= p)
+							{
+								++out.pruned;
+								return false;
+							}
+							t = rouletteWeighted;
+						}
+						return true;
+					};
+
+					if (mat->transmittance > 0.f)
+					{
+						float t = throughput * mat->transmittance;
+						if (keep(t, work.node[i] * 2 + 1))
+						{
+							auto [refr, isRefracted, negated] = ray.refract(inter.pos, inter.normal, 1.f, mat->refraction, 0.0001f);
+							refr.dir.normalize();
+							bool in = work.inside[i] != 0;
+							out.refracted.push(refr, t, pixel, work.path[i], work.node[i] * 2 + 1, work.bounces[i] - 1, isRefracted ? !in : in);
+						}
+					}
+
+					if (mat->reflectance > 0.f)
+					{
+						float t = throughput * mat->reflectance;
+						if (keep(t, work.node[i] * 2))
+						{
+							Ray refl = ray.reflect(inter.pos, hitFromBehind ? -inter.normal : inter.normal, 0.0001f);
+							refl.dir.normalize();
+							out.reflected.push(refl, t, pixel, work.path[i], work.node[i] * 2, work.bounces[i] - 1, work.inside[i] != 0);
+						}
+					}
+				}
+			});
+
+			shadow.clear();
+			for (const ShadeOutput &out : shaded)
+			{
+				for (const auto &[pixel, c] : out.direct)
+					pixels[pixel] += c;
+				shadow.append(out.shadow);
+				reflected.append(out.reflected);
+				refracted.append(out.refracted);
+				pruned += out.pruned;
+			}
+
+			// Shadow kernel
+			occluded.resize(shadow.size());
+			runKernel(*pool, shadow.size(), [&](size_t b, size_t e)
+			{
+				for (size_t i = b; i < e; ++i)
+				{
+					auto [obj, lightInter] = findIntersectionIndex(shadow.getRay(i));
+					occluded[i] = obj != objects.size() &&
+						shadow.lightDist[i] > (lightInter.pos - shadow.getPos(i)).length();
+				}
+			});
+
+			for (size_t i = 0; i < shadow.size(); ++i)
+			{
+				if (!occluded[i])
+					pixels[shadow.pixel[i]] += Color(shadow.r[i], shadow.g[i], shadow.b[i]);
+			}
+		}
+
+		for (size_t p = begin; p < end; ++p)
+			data.set(p % reg.width(), p / reg.width(), pixels[p - begin]);
+	}
+
+	tracedRays = traced;
+	prunedRays = pruned;
+	return data;
+}